@@ -0,0 +1,510 @@
+// vim: set sw=4 ts=4 sts=4 et tw=78
+//
+// Offline benchmark. Compresses synthetic corpora, generated in memory from
+// a fixed seed, through each engine over a matrix of chunk sizes, levels and
+// thread counts. Every configuration is run a few times after a warm-up, and
+// the median and spread of the throughput are reported as CSV or JSON, so
+// that results of two versions can be diffed.
+//
+// "store" is the qzip engine with incompressible chunks stored as-is, and
+// "pgzip" is zlib on a thread pool, pigz-style. With the parallel engines,
+// threads are their workers. With the others, each thread compresses the
+// whole corpus through a cookie of its own, and the throughput is the
+// aggregate.
+//
+
+#include "qzip_cookie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <zlib.h>
+
+#define MAXLIST 16
+
+enum { ENGINE_ZLIB, ENGINE_QZIP, ENGINE_ASYNC, ENGINE_STORE, ENGINE_STREAM, ENGINE_PARALLEL, ENGINE_PGZIP, NENGINES };
+enum { CORPUS_TEXT, CORPUS_BINARY, CORPUS_RANDOM, CORPUS_REDUNDANT, NCORPORA };
+
+static const char *engine_names[NENGINES] = { "zlib", "qzip", "async", "store", "stream", "parallel", "pgzip" };
+static const char *corpus_names[NCORPORA] = { "text", "binary", "random", "redundant" };
+
+// \begin corpora
+// xorshift64*, so that corpora are identical on every run and machine
+static unsigned long long rng_state;
+
+static inline unsigned long long rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Words from a made-up vocabulary, favouring the first ones as natural
+// language does, with punctuation and line breaks
+static void gen_text(char *buf, size_t size)
+{
+    static char vocab[256][12];
+    size_t off = 0;
+    int i, j, len, words = 0;
+
+    for (i = 0; i < 256; i++) {
+        len = 2 + rng() % 8;
+        for (j = 0; j < len; j++) {
+            vocab[i][j] = 'a' + rng() % 26;
+        }
+        vocab[i][len] = '\0';
+    }
+
+    while (off < size) {
+        unsigned long long r = rng();
+        const char *w = vocab[((r & 0xff) * ((r >> 8) & 0xff)) >> 8];
+        for (; *w != '\0' && off < size; w++) {
+            buf[off++] = *w;
+        }
+        if (off < size) {
+            buf[off++] = (++words % 12 == 0) ? '\n' : ((r >> 16) % 16 == 0) ? ',' : ' ';
+        }
+    }
+}
+
+// Fixed-size records of counters, timestamps, ids from a small set and
+// sparse flags, like a log or a table dump
+static void gen_binary(char *buf, size_t size)
+{
+    unsigned char rec[32];
+    unsigned int seq = 0, ts = 1600000000;
+    size_t off, n;
+
+    for (off = 0; off < size; off += n) {
+        unsigned long long r = rng();
+        memset(rec, 0, sizeof(rec));
+        seq++;
+        ts += r % 4;
+        memcpy(rec, &seq, 4);
+        memcpy(rec + 4, &ts, 4);
+        rec[8] = (r >> 8) % 64;
+        rec[12] = (r >> 16) & 0xff;
+        rec[13] = (r >> 24) & 0x0f;
+        rec[20] = ((r >> 32) % 8 == 0) ? 1 : 0;
+        n = (size - off < sizeof(rec)) ? size - off : sizeof(rec);
+        memcpy(buf + off, rec, n);
+    }
+}
+
+static void gen_random(char *buf, size_t size)
+{
+    unsigned long long r;
+    size_t off, n;
+
+    for (off = 0; off < size; off += n) {
+        r = rng();
+        n = (size - off < sizeof(r)) ? size - off : sizeof(r);
+        memcpy(buf + off, &r, n);
+    }
+}
+
+// Copies of a 64 KB block with a few bytes changed in each
+static void gen_redundant(char *buf, size_t size)
+{
+    const size_t block = 64 * 1024;
+    size_t off, n;
+    int i;
+
+    gen_text(buf, (size < block) ? size : block);
+    for (off = block; off < size; off += n) {
+        n = (size - off < block) ? size - off : block;
+        memcpy(buf + off, buf, n);
+        for (i = 0; i < 8; i++) {
+            buf[off + rng() % n] = rng() & 0xff;
+        }
+    }
+}
+
+static char *gen_corpus(int corpus, size_t size, int *kind)
+{
+    char *buf = (char *)qzip_huge_alloc(size, kind);
+    assert(buf != NULL);
+
+    rng_state = 0x9E3779B97F4A7C15ULL + corpus;
+    switch (corpus) {
+        case CORPUS_TEXT:
+            gen_text(buf, size);
+            break;
+        case CORPUS_BINARY:
+            gen_binary(buf, size);
+            break;
+        case CORPUS_RANDOM:
+            gen_random(buf, size);
+            break;
+        default:
+            gen_redundant(buf, size);
+            break;
+    }
+
+    return buf;
+}
+// \end corpora
+
+// \begin runs
+typedef struct {
+    int                 engine;
+    int                 level;
+    unsigned int        nthreads;
+    const char          *data;
+    size_t              size;
+    size_t              chunk;
+    unsigned long long  out_bytes;
+    pthread_t           tid;
+} run_t;
+
+// Output is counted and dropped
+static ssize_t null_write(void *cookie, const char *buf, size_t size)
+{
+    *(unsigned long long *)cookie += size;
+    return size;
+}
+
+static cookie_io_functions_t null_funcs = {
+    .write = null_write,
+};
+
+// Baseline: zlib with the same gzip framing, no cookie involved
+static void run_zlib(run_t *run)
+{
+    const size_t out_sz = 256 * 1024;
+    unsigned char *out = (unsigned char *)malloc(out_sz);
+    z_stream strm;
+    size_t off = 0, n;
+    int rc, flush;
+
+    assert(out != NULL);
+    memset(&strm, 0, sizeof(strm));
+    rc = deflateInit2(&strm, run->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    assert(rc == Z_OK);
+
+    do {
+        n = (run->size - off < run->chunk) ? run->size - off : run->chunk;
+        flush = (off + n == run->size) ? Z_FINISH : Z_NO_FLUSH;
+        strm.next_in = (unsigned char *)run->data + off;
+        strm.avail_in = n;
+        do {
+            strm.next_out = out;
+            strm.avail_out = out_sz;
+            rc = deflate(&strm, flush);
+            assert(rc != Z_STREAM_ERROR);
+            run->out_bytes += out_sz - strm.avail_out;
+        } while (0 == strm.avail_out);
+        off += n;
+    } while (off < run->size);
+
+    deflateEnd(&strm);
+    free(out);
+}
+
+static void *run_thread(void *arg)
+{
+    run_t *run = (run_t *)arg;
+    qzip_params_t params;
+    FILE *sink, *fout = NULL;
+    char mode[4];
+    size_t off, n;
+    int rc;
+
+    if (ENGINE_ZLIB == run->engine) {
+        run_zlib(run);
+        return NULL;
+    }
+
+    sink = fopencookie(&run->out_bytes, "w", null_funcs);
+    assert(sink != NULL);
+    rc = setvbuf(sink, NULL, _IONBF, 0);
+    assert(rc == 0);
+
+    snprintf(mode, sizeof(mode), "w%d", run->level);
+    switch (run->engine) {
+        case ENGINE_QZIP:
+        case ENGINE_ASYNC:
+        case ENGINE_STORE:
+            rc = qzip_params_init(&params);
+            assert(rc == 0);
+            params.comp_lvl = run->level;
+            params.nslots = (ENGINE_ASYNC == run->engine) ? 4 : 0;
+            params.passthrough = (ENGINE_STORE == run->engine);
+            fout = qzip_hook_ex(sink, "w", &params);
+            break;
+        case ENGINE_STREAM:
+            fout = qzip_stream_hook(sink, mode);
+            break;
+        case ENGINE_PARALLEL:
+            fout = qzip_parallel_hook(sink, mode, run->nthreads);
+            break;
+        case ENGINE_PGZIP:
+            fout = gzip_parallel_hook(sink, mode, run->nthreads);
+            break;
+    }
+    assert(fout != NULL);
+
+    for (off = 0; off < run->size; off += n) {
+        n = (run->size - off < run->chunk) ? run->size - off : run->chunk;
+        rc = fwrite(run->data + off, 1, n, fout) != n;
+        assert(rc == 0);
+    }
+    fclose(fout);
+    fclose(sink);
+
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run one configuration once. Returns MB/s of input and stores the
+// compression ratio in `ratio`.
+static double run_once(int engine, const char *data, size_t size, size_t chunk,
+                       int level, unsigned int nthreads, double *ratio)
+{
+    unsigned int ncookies = (ENGINE_PARALLEL == engine || ENGINE_PGZIP == engine) ? 1 : nthreads;
+    run_t runs[ncookies];
+    unsigned long long in_bytes = 0, out_bytes = 0;
+    double start, elapsed;
+    unsigned int i;
+    int rc;
+
+    start = now();
+    for (i = 0; i < ncookies; i++) {
+        runs[i].engine = engine;
+        runs[i].level = level;
+        runs[i].nthreads = nthreads;
+        runs[i].data = data;
+        runs[i].size = size;
+        runs[i].chunk = chunk;
+        runs[i].out_bytes = 0;
+        rc = pthread_create(&runs[i].tid, NULL, run_thread, &runs[i]);
+        assert(rc == 0);
+    }
+    for (i = 0; i < ncookies; i++) {
+        pthread_join(runs[i].tid, NULL);
+        in_bytes += size;
+        out_bytes += runs[i].out_bytes;
+    }
+    elapsed = now() - start;
+
+    *ratio = (out_bytes > 0) ? (double)in_bytes / out_bytes : 0;
+    return in_bytes / elapsed / (1024 * 1024);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+// \end runs
+
+// \begin options
+typedef struct {
+    int n;
+    long v[MAXLIST];
+} list_t;
+
+// Parse "a,b,c" into `list`, mapping names through `names` when given
+static void parse_list(list_t *list, const char *arg, const char **names, int nnames)
+{
+    char buf[256], *tok, *save;
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    list->n = 0;
+    for (tok = strtok_r(buf, ",", &save); tok != NULL && list->n < MAXLIST;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (NULL == names) {
+            list->v[list->n] = atol(tok);
+            assert(list->v[list->n] > 0);
+            list->n++;
+            continue;
+        }
+        for (i = 0; i < nnames; i++) {
+            if (0 == strcmp(tok, names[i])) {
+                break;
+            }
+        }
+        if (i == nnames) {
+            fprintf(stderr, "Unknown name: %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        list->v[list->n++] = i;
+    }
+}
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [options]\n", progname);
+    printf("Program options:\n");
+    printf("    -e  --engines <LIST>  zlib,qzip,async,store,stream,parallel,pgzip (default all)\n");
+    printf("    -c  --corpora <LIST>  text,binary,random,redundant (default all)\n");
+    printf("    -s  --chunks <LIST>   Sizes of writes (default 4096,65536,1048576)\n");
+    printf("    -l  --levels <LIST>   Compression levels (default 1,6)\n");
+    printf("    -t  --threads <LIST>  Thread counts (default 1,4)\n");
+    printf("    -S  --size <INT>      Corpus size in MB (default 16)\n");
+    printf("    -w  --warmup <INT>    Runs discarded before measuring (default 1)\n");
+    printf("    -n  --repeat <INT>    Measured runs (default 5)\n");
+    printf("    -f  --format <FMT>    csv or json (default csv)\n");
+    printf("    -o  --output <FILE>   Write results to FILE (default stdout)\n");
+    printf("    -h  --help            This message\n");
+}
+// \end options
+
+int main(int argc, char **argv)
+{
+    list_t engines = { NENGINES, { ENGINE_ZLIB, ENGINE_QZIP, ENGINE_ASYNC, ENGINE_STORE,
+                                   ENGINE_STREAM, ENGINE_PARALLEL, ENGINE_PGZIP } };
+    list_t corpora = { NCORPORA, { CORPUS_TEXT, CORPUS_BINARY, CORPUS_RANDOM,
+                                   CORPUS_REDUNDANT } };
+    list_t chunks  = { 3, { 4096, 65536, 1048576 } };
+    list_t levels  = { 2, { 1, 6 } };
+    list_t threads = { 2, { 1, 4 } };
+    size_t size    = 16;
+    int warmup     = 1;
+    int repeat     = 5;
+    int json       = 0;
+    FILE *out      = stdout;
+
+    // \begin parse commandline args
+    int opt;
+
+    static struct option long_options[] = {
+        {"engines", required_argument, 0, 'e'},
+        {"corpora", required_argument, 0, 'c'},
+        {"chunks",  required_argument, 0, 's'},
+        {"levels",  required_argument, 0, 'l'},
+        {"threads", required_argument, 0, 't'},
+        {"size",    required_argument, 0, 'S'},
+        {"warmup",  required_argument, 0, 'w'},
+        {"repeat",  required_argument, 0, 'n'},
+        {"format",  required_argument, 0, 'f'},
+        {"output",  required_argument, 0, 'o'},
+        {"help",    no_argument,       0, 'h'},
+        {0,         0,                 0,  0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "e:c:s:l:t:S:w:n:f:o:h", long_options, NULL)) != -1) {
+
+        switch (opt) {
+            case 'e':
+                parse_list(&engines, optarg, engine_names, NENGINES);
+                break;
+            case 'c':
+                parse_list(&corpora, optarg, corpus_names, NCORPORA);
+                break;
+            case 's':
+                parse_list(&chunks, optarg, NULL, 0);
+                break;
+            case 'l':
+                parse_list(&levels, optarg, NULL, 0);
+                break;
+            case 't':
+                parse_list(&threads, optarg, NULL, 0);
+                break;
+            case 'S':
+                size = atol(optarg);
+                assert(size > 0);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                assert(warmup >= 0);
+                break;
+            case 'n':
+                repeat = atoi(optarg);
+                assert(repeat > 0);
+                break;
+            case 'f':
+                json = (0 == strcmp(optarg, "json"));
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                assert(out != NULL);
+                break;
+            case 'h':
+            case '?':
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    size *= 1024 * 1024;
+    // \end parse commandline args
+
+    double mbps[repeat], ratio = 0, mean, var;
+    int c, e, s, l, t, i, kind, first = 1;
+
+    if (json) {
+        fprintf(out, "[\n");
+    } else {
+        fprintf(out, "corpus,engine,chunk,level,threads,size,ratio,"
+                     "mbps_median,mbps_min,mbps_max,mbps_stdev,runs\n");
+    }
+
+    for (c = 0; c < corpora.n; c++) {
+        char *data = gen_corpus(corpora.v[c], size, &kind);
+
+        for (e = 0; e < engines.n; e++)
+        for (s = 0; s < chunks.n; s++)
+        for (l = 0; l < levels.n; l++)
+        for (t = 0; t < threads.n; t++) {
+            for (i = 0; i < warmup; i++) {
+                run_once(engines.v[e], data, size, chunks.v[s], levels.v[l],
+                         threads.v[t], &ratio);
+            }
+            for (i = 0, mean = 0; i < repeat; i++) {
+                mbps[i] = run_once(engines.v[e], data, size, chunks.v[s], levels.v[l],
+                                   threads.v[t], &ratio);
+                mean += mbps[i] / repeat;
+            }
+            for (i = 0, var = 0; i < repeat; i++) {
+                var += (mbps[i] - mean) * (mbps[i] - mean) / repeat;
+            }
+            qsort(mbps, repeat, sizeof(double), cmp_double);
+
+            double median = (repeat % 2) ? mbps[repeat / 2] :
+                            (mbps[repeat / 2 - 1] + mbps[repeat / 2]) / 2;
+            if (json) {
+                fprintf(out, "%s  {\"corpus\": \"%s\", \"engine\": \"%s\", \"chunk\": %ld, "
+                             "\"level\": %ld, \"threads\": %ld, \"size\": %zu, "
+                             "\"ratio\": %.3f, \"mbps_median\": %.2f, \"mbps_min\": %.2f, "
+                             "\"mbps_max\": %.2f, \"mbps_stdev\": %.2f, \"runs\": %d}",
+                        first ? "" : ",\n", corpus_names[corpora.v[c]],
+                        engine_names[engines.v[e]], chunks.v[s], levels.v[l], threads.v[t],
+                        size, ratio, median, mbps[0], mbps[repeat - 1], sqrt(var), repeat);
+            } else {
+                fprintf(out, "%s,%s,%ld,%ld,%ld,%zu,%.3f,%.2f,%.2f,%.2f,%.2f,%d\n",
+                        corpus_names[corpora.v[c]], engine_names[engines.v[e]],
+                        chunks.v[s], levels.v[l], threads.v[t], size, ratio,
+                        median, mbps[0], mbps[repeat - 1], sqrt(var), repeat);
+            }
+            fflush(out);
+            first = 0;
+        }
+
+        qzip_huge_free(data, size, kind);
+    }
+
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
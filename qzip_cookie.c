@@ -4,7 +4,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <zlib.h>
 #include "cpa.h"
@@ -14,9 +30,21 @@
 #include "qatzip_internal.h"
 
 #define MAXDATA  QC_MAXDATA
+#define MAXSLICE (4*1024*1024)
 #define HUGEPAGE (2*1024*1024)
+#define DIRECT_ALIGN (4096)
+#define DIRECT_BUF   (4*1024*1024)
+#define URING_BUF    (1024*1024)
+#define URING_DEPTH_MAX 256
+#define RING_SLOTS_MAX  64
+#define POLL_SLEEP_MAX  100
 
-run_time_list_node_t *run_time_list_head = NULL;
+// What gzip(1) writes for empty input. Write cookies emit it when closed
+// without any output, so that the result still decompresses.
+static const unsigned char gzip_empty_member[20] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+    0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
 
 // \begin gzip cookie
 // Details of cookie can refer to `man fopencookie`
@@ -31,40 +59,140 @@ gzip_cookie_close(void *cookie)
     return gzclose((gzFile)cookie);
 }
 
+static ssize_t
+gzip_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return gzread((gzFile)cookie, (voidp)buf, (unsigned)size);
+}
+
 static cookie_io_functions_t gzip_write_funcs = {
     .write = gzip_cookie_write,
     .close = gzip_cookie_close
 };
 
+static cookie_io_functions_t gzip_read_funcs = {
+    .read  = gzip_cookie_read,
+    .close = gzip_cookie_close
+};
+
 FILE *
 gzip_fopen(const char *fname, const char *mode)
 {
     gzFile zfd = gzopen(fname, mode);
+    if (mode[0] == 'r') {
+        return fopencookie(zfd, mode, gzip_read_funcs);
+    }
     return fopencookie(zfd, mode, gzip_write_funcs);
 }
 // \end gzip cookie
 
+// \begin huge pages
+// Multi-MB buffers streamed through at GB/s thrash the TLB with 4 KB pages.
+// Prefer explicitly reserved huge pages, then transparent huge pages, and
+// only then the heap. Mappings are rounded up to whole huge pages.
+static inline size_t
+qzip_huge_len(size_t sz)
+{
+    return (sz + HUGEPAGE - 1) & ~((size_t)HUGEPAGE - 1);
+}
+
+// THP only backs huge-page aligned ranges, so over-map by one huge page and
+// trim both ends
+static void *
+qzip_thp_alloc(size_t len)
+{
+    char *m = mmap(NULL, len + HUGEPAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == m) {
+        return NULL;
+    }
+
+    char *aligned = (char *)qzip_huge_len((size_t)m);
+    if (aligned > m) {
+        munmap(m, aligned - m);
+    }
+    munmap(aligned + len, m + HUGEPAGE - aligned);
+
+    if (0 != madvise(aligned, len, MADV_HUGEPAGE)) {
+        munmap(aligned, len);
+        return NULL;
+    }
+
+    return aligned;
+}
+
+void *
+qzip_huge_alloc(size_t sz, int *kind)
+{
+    size_t len = qzip_huge_len(sz);
+    void *m = NULL;
+    int k = QC_HUGE_MALLOC;
+
+    if (sz >= HUGEPAGE) {
+        m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED != m) {
+            k = QC_HUGE_HUGETLB;
+        } else if (NULL != (m = qzip_thp_alloc(len))) {
+            k = QC_HUGE_THP;
+        }
+    }
+    if (QC_HUGE_MALLOC == k) {
+        m = malloc(sz);
+    }
+
+    QC_DEBUG("qzip_huge_alloc: %zu bytes backed by %s\n", sz, qzip_huge_kind_str(k));
+    if (NULL != kind) {
+        *kind = k;
+    }
+
+    return m;
+}
+
+void
+qzip_huge_free(void *m, size_t sz, int kind)
+{
+    if (NULL == m) {
+        return;
+    }
+
+    if (QC_HUGE_MALLOC == kind) {
+        free(m);
+    } else {
+        munmap(m, qzip_huge_len(sz));
+    }
+}
+
+const char *
+qzip_huge_kind_str(int kind)
+{
+    switch (kind) {
+        case QC_HUGE_HUGETLB:
+            return "hugetlb";
+        case QC_HUGE_THP:
+            return "thp";
+        default:
+            return "malloc";
+    }
+}
+// \end huge pages
+
 // \begin buffer manager
+// For write-side cookies `consumed` is the amount of data waiting to be
+// flushed. Read-side cookies use `consumed` as the fill level and `offset`
+// as the cursor of data already handed out to the caller.
 typedef struct {
     char            *buf;
     unsigned int    size;
     unsigned int    consumed;
+    unsigned int    offset;
+    int             backing;    // QC_HUGE_*
 } bufm_t;
 
-static inline void
-bufm_flush(bufm_t *bufm, FILE *fout)
-{
-    if (bufm->consumed > 0) {
-        size_t bytes_written = fwrite(bufm->buf, 1, bufm->consumed, fout);
-        assert(bytes_written == bufm->consumed);
-        bufm->consumed = 0;
-    }
-}
-
 static inline int
 bufm_init(bufm_t *bufm, unsigned int size)
 {
-    if (NULL == (bufm->buf = (char *)malloc(size))) {
+    if (NULL == (bufm->buf = (char *)qzip_huge_alloc(size, &bufm->backing))) {
         return 1;
     }
 
@@ -72,322 +200,5078 @@ bufm_init(bufm_t *bufm, unsigned int size)
     {
         bufm->size = size;
         bufm->consumed = 0;
+        bufm->offset = 0;
+    }
+
+    return 0;
+}
+
+// Mappings can't be realloc'ed, so move data to a fresh buffer. Only the
+// first `consumed` bytes are live.
+static inline int
+bufm_grow(bufm_t *bufm, unsigned int size)
+{
+    int backing;
+    char *buf = (char *)qzip_huge_alloc(size, &backing);
+    if (NULL == buf) {
+        return 1;
     }
 
+    memcpy(buf, bufm->buf, bufm->consumed);
+    qzip_huge_free(bufm->buf, bufm->size, bufm->backing);
+    bufm->buf = buf;
+    bufm->size = size;
+    bufm->backing = backing;
+
     return 0;
 }
 
+// Move unread data to the head of buffer then top it up from `fin`. Returns
+// the number of bytes newly read.
+static inline size_t
+bufm_fill(bufm_t *bufm, FILE *fin)
+{
+    size_t bytes_read;
+
+    if (bufm->offset > 0) {
+        memmove(bufm->buf, bufm->buf + bufm->offset, bufm->consumed - bufm->offset);
+        bufm->consumed -= bufm->offset;
+        bufm->offset = 0;
+    }
+
+    bytes_read = fread(bufm->buf + bufm->consumed, 1, bufm->size - bufm->consumed, fin);
+    bufm->consumed += bytes_read;
+
+    return bytes_read;
+}
+
+// Copy at most `size` bytes of unread data out. Buffer cursors are reset
+// once everything has been handed out.
+static inline size_t
+bufm_drain(bufm_t *bufm, char *dst, size_t size)
+{
+    size_t avail = bufm->consumed - bufm->offset;
+    size_t n = (avail < size) ? avail : size;
+
+    memcpy(dst, bufm->buf + bufm->offset, n);
+    bufm->offset += n;
+    if (bufm->offset == bufm->consumed) {
+        bufm->offset = bufm->consumed = 0;
+    }
+
+    return n;
+}
+
 static inline void
 bufm_destor(bufm_t *bufm)
 {
-    free(bufm->buf);
+    qzip_huge_free(bufm->buf, bufm->size, bufm->backing);
 }
 // \end buffer manager
 
-// \begin qzip cookie
+// \begin pinned memory
+// Buffers handed to `qzCompress` in pinned (DMA-able) memory are used by the
+// accelerator as is, while anything else is first copied by QATzip into its
+// own pinned buffers. Pinned memory is a scarce resource though, so fall
+// back to plain heap memory when it runs out.
+static void *
+qzip_mem_alloc(size_t sz, int pinned)
+{
+    static int warned = 0;
+    void *m = NULL;
+
+    if (pinned) {
+        m = qzMalloc(sz, NODE_0, PINNED_MEM);
+        if (NULL == m && !warned) {
+            QC_PRINT("qzip_mem_alloc: pinned memory unavailable, falling back to malloc\n");
+            warned = 1;
+        }
+    }
+
+    return (NULL == m) ? malloc(sz) : m;
+}
+
+static void
+qzip_mem_free(void *m)
+{
+    if (NULL == m) {
+        return;
+    }
+
+    if (qzMemFindAddr((unsigned char *)m)) {
+        qzFree(m);
+    } else {
+        free(m);
+    }
+}
+// \end pinned memory
+
+// \begin io_uring
+// Asynchronous writes through io_uring, driven by raw syscalls so that
+// liburing isn't needed. Data is copied into one of `depth` buffers, and a
+// buffer is queued as a write at an explicit file offset once it's full, so
+// the caller never waits for storage unless every buffer is in flight.
+// Buffers come back to the free list as their completions are reaped.
 typedef struct {
-    QzSession_T       qz_sess;
-    QzSessionParams_T qz_sess_params;
-    FILE              *fp;
-} qzip_cookie_t;
+    int                 ring_fd;
+    int                 fd;
+    unsigned int        *sq_tail;
+    unsigned int        *sq_mask;
+    unsigned int        *sq_array;
+    unsigned int        *cq_head;
+    unsigned int        *cq_tail;
+    unsigned int        *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr;
+    void                *cq_ptr;
+    size_t              sq_len;
+    size_t              cq_len;
+    size_t              sqes_len;
+    unsigned int        depth;
+    char                **bufs;
+    unsigned int        *lens;
+    off_t               *offs;
+    unsigned int        *free_idx;  // stack of idle buffers
+    unsigned int        nfree;
+    unsigned int        cur;        // buffer being filled, `depth` if none
+    unsigned int        cur_len;
+    off_t               offset;     // where the next buffer goes
+    int                 sync;       // kernel can't do IORING_OP_WRITE
+    int                 error;
+} qzip_uring_t;
 
-// Fixed data buffer to eliminate overhead of buffer allocation and free
-static char data_buf[MAXDATA];
+static inline int
+qzip_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete,
+                 unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
 
-// Refer to QATzip/utils/qzip.c:doProcessFile
-static ssize_t
-qzip_cookie_write(void *cookie, const char *buf, size_t size)
+static int
+qzip_pwrite_all(int fd, const char *buf, size_t len, off_t off)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
-    QzSession_T *qz_sess = &(qz_cookie->qz_sess);
-    const char *src = buf;
-    unsigned int src_len = size;
-    assert(size <= MAXDATA);    // Will cause overflow error if compressed data
-                                // is bigger than expectation
-    unsigned int dst_len = MAXDATA;
-    unsigned int done = 0;
-    unsigned int buf_processed = 0;
-    unsigned int buf_remaining = size;
-    unsigned int bytes_written = 0;
-    unsigned int valid_dst_len = dst_len;
-    int rc = QZ_FAIL;
+    ssize_t n;
 
-    char *dst = &data_buf;
+    while (len > 0) {
+        n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return 1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
 
-    QC_DEBUG("qzip_cookie_write: new buf at %x (%d Bytes)\n", buf, size);
+    return 0;
+}
 
-    while (!done) {
-        rc = qzCompress(qz_sess, src, &src_len, dst, &dst_len, 1);
+static void
+qzip_uring_destroy(qzip_uring_t *uring)
+{
+    unsigned int i;
 
-        if (rc != QZ_OK &&
-            rc != QZ_BUF_ERROR &&
-            rc != QZ_DATA_ERROR) {
-            QC_ERROR("qzip_cookie_write: failed with error: %d\n", rc);
-            QC_ERROR("qzip_cookie_write: src_len %d, dst_len %d\n", src_len, dst_len);
-            break;
+    if (NULL != uring->bufs) {
+        for (i = 0; i < uring->depth; i++) {
+            free(uring->bufs[i]);
         }
+    }
+    free(uring->bufs);
+    free(uring->lens);
+    free(uring->offs);
+    free(uring->free_idx);
+    if (NULL != uring->sqes) {
+        munmap(uring->sqes, uring->sqes_len);
+    }
+    if (NULL != uring->cq_ptr && uring->cq_ptr != uring->sq_ptr) {
+        munmap(uring->cq_ptr, uring->cq_len);
+    }
+    if (NULL != uring->sq_ptr) {
+        munmap(uring->sq_ptr, uring->sq_len);
+    }
+    if (uring->ring_fd >= 0) {
+        close(uring->ring_fd);
+    }
+    free(uring);
+}
+
+// Returns NULL when io_uring is unavailable or `fd` isn't seekable, in which
+// case the caller should stick to plain writes
+static qzip_uring_t *
+qzip_uring_create(int fd, unsigned int depth)
+{
+    struct io_uring_params p;
+    qzip_uring_t *uring;
+    unsigned int i;
+    void *m;
 
-        bytes_written = fwrite(dst, 1, dst_len, qz_cookie->fp);
-        assert(bytes_written == dst_len);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return NULL;
+    }
 
-        buf_processed += src_len;
-        buf_remaining -= src_len;
-        if (buf_remaining == 0) {
-            done = 1;
+    if (NULL == (uring = (qzip_uring_t *)calloc(1, sizeof(qzip_uring_t)))) {
+        return NULL;
+    }
+    uring->fd = fd;
+    uring->offset = offset;
+
+    memset(&p, 0, sizeof(p));
+    uring->ring_fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (uring->ring_fd < 0) {
+        goto fail;
+    }
+
+    uring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    uring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_len > uring->sq_len) {
+            uring->sq_len = uring->cq_len;
         }
-        src += src_len;
-        src_len = buf_remaining;
-        dst_len = valid_dst_len;
+        uring->cq_len = uring->sq_len;
+    }
+    m = mmap(NULL, uring->sq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == m) {
+        goto fail;
+    }
+    uring->sq_ptr = m;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ptr = uring->sq_ptr;
+    } else {
+        m = mmap(NULL, uring->cq_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == m) {
+            goto fail;
+        }
+        uring->cq_ptr = m;
+    }
+    uring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    m = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == m) {
+        goto fail;
     }
+    uring->sqes = (struct io_uring_sqe *)m;
 
-    return buf_processed;
+    uring->sq_tail  = (unsigned int *)((char *)uring->sq_ptr + p.sq_off.tail);
+    uring->sq_mask  = (unsigned int *)((char *)uring->sq_ptr + p.sq_off.ring_mask);
+    uring->sq_array = (unsigned int *)((char *)uring->sq_ptr + p.sq_off.array);
+    uring->cq_head  = (unsigned int *)((char *)uring->cq_ptr + p.cq_off.head);
+    uring->cq_tail  = (unsigned int *)((char *)uring->cq_ptr + p.cq_off.tail);
+    uring->cq_mask  = (unsigned int *)((char *)uring->cq_ptr + p.cq_off.ring_mask);
+    uring->cqes     = (struct io_uring_cqe *)((char *)uring->cq_ptr + p.cq_off.cqes);
+
+    uring->depth = depth;
+    uring->bufs = (char **)calloc(depth, sizeof(char *));
+    uring->lens = (unsigned int *)calloc(depth, sizeof(unsigned int));
+    uring->offs = (off_t *)calloc(depth, sizeof(off_t));
+    uring->free_idx = (unsigned int *)calloc(depth, sizeof(unsigned int));
+    if (NULL == uring->bufs || NULL == uring->lens || NULL == uring->offs ||
+        NULL == uring->free_idx) {
+        goto fail;
+    }
+    for (i = 0; i < depth; i++) {
+        if (NULL == (uring->bufs[i] = (char *)malloc(URING_BUF))) {
+            goto fail;
+        }
+        uring->free_idx[i] = i;
+    }
+    uring->nfree = depth;
+    uring->cur = depth;
+
+    return uring;
+
+fail:
+    qzip_uring_destroy(uring);
+    return NULL;
 }
 
-static char *data_buf_pinned = NULL;
+// Reap completions, waiting for at least `wait_nr` of them
+static int
+qzip_uring_reap(qzip_uring_t *uring, unsigned int wait_nr)
+{
+    unsigned int head, tail, idx;
+    struct io_uring_cqe *cqe;
+    int res;
+
+    if (wait_nr > 0 &&
+        qzip_uring_enter(uring->ring_fd, 0, wait_nr, IORING_ENTER_GETEVENTS) < 0 &&
+        EINTR != errno) {
+        return 1;
+    }
+
+    head = *uring->cq_head;
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &(uring->cqes[head & *uring->cq_mask]);
+        idx = (unsigned int)cqe->user_data;
+        res = cqe->res;
 
-static ssize_t
-my_qzip_cookie_write(void *cookie, const char *buf, size_t size)
+        if (res < 0 && (-EINVAL == res || -EOPNOTSUPP == res) && !uring->sync) {
+            QC_PRINT("qzip_uring_reap: IORING_OP_WRITE unsupported, falling back to pwrite\n");
+            uring->sync = 1;
+        }
+        if (res < 0) {
+            res = 0;
+            if (!uring->sync) {
+                uring->error = 1;
+            }
+        }
+        // Finish short or refused writes in place
+        if ((unsigned int)res < uring->lens[idx] &&
+            0 != qzip_pwrite_all(uring->fd, uring->bufs[idx] + res,
+                                 uring->lens[idx] - res, uring->offs[idx] + res)) {
+            uring->error = 1;
+        }
+        uring->free_idx[uring->nfree++] = idx;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    return uring->error;
+}
+
+static int
+qzip_uring_submit(qzip_uring_t *uring)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
-    QzSession_T *qz_sess = &(qz_cookie->qz_sess);
-    const char *src = buf;
-    unsigned int src_len = size;
-    assert(size <= MAXDATA);    // Will cause overflow error if compressed data
-                                // is bigger than expectation
-    unsigned int dst_len = MAXDATA;
-    unsigned int done = 0;
-    unsigned int buf_processed = 0;
-    unsigned int buf_remaining = size;
-    unsigned int bytes_written = 0;
-    unsigned int valid_dst_len = dst_len;
-    int rc = QZ_FAIL;
+    unsigned int idx = uring->cur;
+    unsigned int tail, sq_idx;
+    struct io_uring_sqe *sqe;
+
+    if (uring->depth == idx) {
+        return 0;
+    }
+
+    uring->lens[idx] = uring->cur_len;
+    uring->offs[idx] = uring->offset;
+    uring->offset += uring->cur_len;
+    uring->cur = uring->depth;
+    uring->cur_len = 0;
+
+    if (uring->sync) {
+        uring->free_idx[uring->nfree++] = idx;
+        return qzip_pwrite_all(uring->fd, uring->bufs[idx], uring->lens[idx],
+                               uring->offs[idx]);
+    }
+
+    tail = *uring->sq_tail;
+    sq_idx = tail & *uring->sq_mask;
+    sqe = &(uring->sqes[sq_idx]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = uring->fd;
+    sqe->addr = (unsigned long)uring->bufs[idx];
+    sqe->len = uring->lens[idx];
+    sqe->off = uring->offs[idx];
+    sqe->user_data = idx;
+    uring->sq_array[sq_idx] = sq_idx;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (qzip_uring_enter(uring->ring_fd, 1, 0, 0) < 0) {
+        if (EINTR != errno) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+qzip_uring_write(qzip_uring_t *uring, const char *buf, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        if (uring->depth == uring->cur) {
+            // Take completed buffers as they come, only block when none is
+            // idle. A wait cut short by a signal may reap nothing.
+            if (0 != qzip_uring_reap(uring, 0)) {
+                return 1;
+            }
+            while (0 == uring->nfree) {
+                if (0 != qzip_uring_reap(uring, 1)) {
+                    return 1;
+                }
+            }
+            uring->cur = uring->free_idx[--uring->nfree];
+            uring->cur_len = 0;
+        }
+
+        n = URING_BUF - uring->cur_len;
+        n = (n < len) ? n : len;
+        memcpy(uring->bufs[uring->cur] + uring->cur_len, buf, n);
+        uring->cur_len += n;
+        buf += n;
+        len -= n;
+
+        if (URING_BUF == uring->cur_len && 0 != qzip_uring_submit(uring)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Queue the partly filled buffer and wait for every write in flight. The
+// file position is moved past the data, as plain writes would have.
+static int
+qzip_uring_sync(qzip_uring_t *uring)
+{
+    if (0 != qzip_uring_submit(uring)) {
+        return 1;
+    }
+    while (uring->nfree < uring->depth) {
+        if (0 != qzip_uring_reap(uring, 1)) {
+            return 1;
+        }
+    }
+
+    return (lseek(uring->fd, uring->offset, SEEK_SET) < 0) ? 1 : uring->error;
+}
+// \end io_uring
+
+// \begin histograms
+// See `qzip_hist_t`. Writers only ever add to a histogram, with relaxed
+// atomics since a cookie's writer thread and caller may record into the
+// same one, and readers take a copy that may be slightly torn but never
+// invalid.
+static inline unsigned long long
+qzip_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+qzip_hist_record(qzip_hist_t *hist, unsigned long long v)
+{
+    unsigned int i = (0 == v) ? 0 : 64 - __builtin_clzll(v);
+    unsigned long long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    if (i >= QC_HIST_BUCKETS) {
+        i = QC_HIST_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&hist->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, v, __ATOMIC_RELAXED);
+    while (v > max &&
+           !__atomic_compare_exchange_n(&hist->max, &max, v, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void
+qzip_hist_merge(qzip_hist_t *dst, const qzip_hist_t *src)
+{
+    unsigned int i;
+
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    dst->max    = (src->max > dst->max) ? src->max : dst->max;
+    for (i = 0; i < QC_HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+// Value below which a `q` fraction of the samples fall, assuming samples are
+// spread evenly across their bucket
+static unsigned long long
+qzip_hist_quantile(const qzip_hist_t *hist, double q)
+{
+    unsigned long long rank, seen = 0, lo, hi, v;
+    unsigned int i;
+
+    if (0 == hist->count) {
+        return 0;
+    }
+
+    rank = (unsigned long long)(q * hist->count);
+    rank = (rank < 1) ? 1 : rank;
+    for (i = 0; i < QC_HIST_BUCKETS; i++) {
+        if (seen + hist->buckets[i] >= rank) {
+            break;
+        }
+        seen += hist->buckets[i];
+    }
+    if (0 == i || QC_HIST_BUCKETS == i) {
+        return (0 == i) ? 0 : hist->max;
+    }
+
+    lo = 1ULL << (i - 1);
+    hi = (1ULL << i) - 1;
+    v  = lo + (unsigned long long)((double)(hi - lo) * (rank - seen) / hist->buckets[i]);
+
+    return (v > hist->max) ? hist->max : v;
+}
+
+static inline void
+qzip_hist_summarize(qzip_hist_t *hist)
+{
+    hist->p50  = qzip_hist_quantile(hist, 0.50);
+    hist->p99  = qzip_hist_quantile(hist, 0.99);
+    hist->p999 = qzip_hist_quantile(hist, 0.999);
+}
+// \end histograms
+
+// \begin crc32
+// CRC-32 of gzip by folding 16 or 64 bytes at a time with carry-less
+// multiplies, after Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction". Constants are x^n mod P, bit-reflected and
+// shifted left by one, for folding forward by n - 32 and n + 32 bits. The
+// kernels work on the inverted CRC register and leave tails under 16 bytes,
+// or inputs too short to fold, to zlib.
+#if defined(__x86_64__)
+#define CRC_FOLD_MIN    64      // 4 x 128 bits with PCLMULQDQ
+#define CRC_FOLD512_MIN 256     // 4 x 512 bits with VPCLMULQDQ
+
+static const unsigned long long crc_k1k2[2]  = { 0x154442bd4, 0x1c6e41596 };  // 512 bits
+static const unsigned long long crc_k3k4[2]  = { 0x1751997d0, 0x0ccaa009e };  // 128 bits
+static const unsigned long long crc_k5k0[2]  = { 0x163cd6124, 0 };           // 64 to 32 bits
+static const unsigned long long crc_poly[2]  = { 0x1db710641, 0x1f7011641 };  // P' and mu
+static const unsigned long long crc_k2048[2] = { 0x11542778a, 0x1322d1430 };
+static const unsigned long long crc_k384[2]  = { 0x03db1ecdc, 0x174359406 };
+static const unsigned long long crc_k256[2]  = { 0x0f1da05aa, 0x15a546366 };
+
+static inline __attribute__((target("pclmul,sse4.1"))) __m128i
+crc_fold16(__m128i x, __m128i k, __m128i next)
+{
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// Fold what's left 16 bytes at a time into `x1` then reduce it to 32 bits
+static __attribute__((target("pclmul,sse4.1"))) unsigned int
+crc_fold_tail(__m128i x1, const unsigned char *buf, size_t len)
+{
+    __m128i x0 = _mm_loadu_si128((const __m128i *)crc_k3k4);
+    __m128i x2, x3;
+
+    for (; len >= 16; buf += 16, len -= 16) {
+        x1 = crc_fold16(x1, x0, _mm_loadu_si128((const __m128i *)buf));
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)crc_k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_loadu_si128((const __m128i *)crc_poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+// `len` is at least CRC_FOLD_MIN and a multiple of 16
+static __attribute__((target("pclmul,sse4.1"))) unsigned int
+crc32_pclmul(unsigned int crc, const unsigned char *buf, size_t len)
+{
+    __m128i k = _mm_loadu_si128((const __m128i *)crc_k1k2);
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64) {
+        x1 = crc_fold16(x1, k, _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = crc_fold16(x2, k, _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = crc_fold16(x3, k, _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = crc_fold16(x4, k, _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    }
+
+    k = _mm_loadu_si128((const __m128i *)crc_k3k4);
+    x1 = crc_fold16(x1, k, x2);
+    x1 = crc_fold16(x1, k, x3);
+    x1 = crc_fold16(x1, k, x4);
+
+    return crc_fold_tail(x1, buf, len);
+}
+
+#define CRC_AVX512 "avx512f,avx512vl,vpclmulqdq,pclmul,sse4.1"
+
+static inline __attribute__((target(CRC_AVX512))) __m512i
+crc_fold64(__m512i x, __m512i k, __m512i next)
+{
+    __m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+    __m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+
+    return _mm512_ternarylogic_epi64(lo, hi, next, 0x96);  // lo ^ hi ^ next
+}
+
+// Same as `crc32_pclmul` with four times wider lanes, `len` is at least
+// CRC_FOLD512_MIN and a multiple of 16
+static __attribute__((target(CRC_AVX512))) unsigned int
+crc32_vpclmul(unsigned int crc, const unsigned char *buf, size_t len)
+{
+    __m512i k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)crc_k2048));
+    __m512i z1 = _mm512_loadu_si512(buf + 0x00);
+    __m512i z2 = _mm512_loadu_si512(buf + 0x40);
+    __m512i z3 = _mm512_loadu_si512(buf + 0x80);
+    __m512i z4 = _mm512_loadu_si512(buf + 0xc0);
+    __m128i x1;
+
+    z1 = _mm512_xor_si512(z1, _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+    for (buf += 256, len -= 256; len >= 256; buf += 256, len -= 256) {
+        z1 = crc_fold64(z1, k, _mm512_loadu_si512(buf + 0x00));
+        z2 = crc_fold64(z2, k, _mm512_loadu_si512(buf + 0x40));
+        z3 = crc_fold64(z3, k, _mm512_loadu_si512(buf + 0x80));
+        z4 = crc_fold64(z4, k, _mm512_loadu_si512(buf + 0xc0));
+    }
+
+    k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)crc_k1k2));
+    z1 = crc_fold64(z1, k, z2);
+    z1 = crc_fold64(z1, k, z3);
+    z1 = crc_fold64(z1, k, z4);
+    for (; len >= 64; buf += 64, len -= 64) {
+        z1 = crc_fold64(z1, k, _mm512_loadu_si512(buf));
+    }
+
+    // Fold the four lanes into the last one
+    x1 = _mm512_extracti32x4_epi32(z1, 3);
+    x1 = crc_fold16(_mm512_extracti32x4_epi32(z1, 2),
+                    _mm_loadu_si128((const __m128i *)crc_k3k4), x1);
+    x1 = crc_fold16(_mm512_extracti32x4_epi32(z1, 1),
+                    _mm_loadu_si128((const __m128i *)crc_k256), x1);
+    x1 = crc_fold16(_mm512_extracti32x4_epi32(z1, 0),
+                    _mm_loadu_si128((const __m128i *)crc_k384), x1);
+
+    return crc_fold_tail(x1, buf, len);
+}
+#endif  // __x86_64__
 
-    //char *dst = data_buf_pinned;
-    char *dst = &data_buf;
+enum { CRC_IMPL_SCALAR, CRC_IMPL_PCLMUL, CRC_IMPL_VPCLMUL };
+
+static const char *crc_impl_names[] = { "scalar", "pclmulqdq", "vpclmulqdq" };
+
+static int crc_impl = CRC_IMPL_SCALAR;
+static unsigned int crc_x2n[32];    // x^(2^n) mod P
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// a * b mod P, bit-reflected
+static unsigned int
+crc_multmodp(unsigned int a, unsigned int b)
+{
+    unsigned int m = 1U << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if (0 == (a & (m - 1))) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+    }
+
+    return p;
+}
+
+static void
+crc_setup(void)
+{
+    unsigned int n, p = 1U << 30;   // x^1
+
+    for (n = 0; n < 32; n++) {
+        crc_x2n[n] = p;
+        p = crc_multmodp(p, p);
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("vpclmulqdq") && __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vl")) {
+        crc_impl = CRC_IMPL_VPCLMUL;
+    } else if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc_impl = CRC_IMPL_PCLMUL;
+    }
+#endif
+
+    // Capped from the environment, to compare kernels on one machine
+    const char *cap = getenv("QZIP_CRC32_IMPL");
+    for (n = 0; NULL != cap && n < (unsigned int)crc_impl; n++) {
+        if (0 == strcmp(cap, crc_impl_names[n])) {
+            crc_impl = n;
+        }
+    }
+}
+
+const char *
+qzip_crc32_impl(void)
+{
+    pthread_once(&crc_once, crc_setup);
+    return crc_impl_names[crc_impl];
+}
+
+unsigned long
+qzip_crc32(unsigned long crc, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    pthread_once(&crc_once, crc_setup);
+
+#if defined(__x86_64__)
+    size_t n = len & ~(size_t)15;
+    unsigned int reg = ~(unsigned int)crc;
+
+    if (CRC_IMPL_VPCLMUL == crc_impl && n >= CRC_FOLD512_MIN) {
+        reg = crc32_vpclmul(reg, p, n);
+    } else if (CRC_IMPL_SCALAR != crc_impl && n >= CRC_FOLD_MIN) {
+        reg = crc32_pclmul(reg, p, n);
+    } else {
+        n = 0;
+    }
+    crc = ~reg;
+    p += n;
+    len -= n;
+#endif
+
+    // zlib takes at most 4 GB a call
+    while (len > 0) {
+        unsigned int chunk = (len > (1U << 30)) ? (1U << 30) : len;
+        crc = crc32(crc, p, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+
+    return crc;
+}
+
+// x^(8 * len2) times crc1, plus crc2: O(log len2) multiplies
+unsigned long
+qzip_crc32_combine(unsigned long crc1, unsigned long crc2, unsigned long long len2)
+{
+    unsigned int p = 1U << 31;  // x^0
+    unsigned int k = 3;         // bytes to bits
+
+    pthread_once(&crc_once, crc_setup);
+
+    for (; len2 > 0; len2 >>= 1, k++) {
+        if (len2 & 1) {
+            p = crc_multmodp(crc_x2n[k & 31], p);
+        }
+    }
+
+    return crc_multmodp(p, crc1) ^ crc2;
+}
+// \end crc32
+
+// \begin output sink
+// Where compressed data goes: either a stdio stream, or a raw file
+// descriptor written with `writev` so that several finished buffers leave in
+// one syscall and skip libc's buffer. With `direct`, the descriptor is in
+// O_DIRECT mode and data is staged in an aligned buffer, written out in
+// whole blocks only. The unaligned tail is written at close, after clearing
+// O_DIRECT. Should the kernel refuse a direct write, O_DIRECT is dropped
+// and staging goes on with buffered writes. With an io_uring queue, writes
+// are asynchronous instead and O_DIRECT isn't used.
+//
+// A pipe sink may use `vmsplice` to hand pages to the pipe instead of
+// copying them. The pipe then references the caller's memory until the
+// reader consumes it, so a buffer may only be reused once
+// `qzip_sink_consumed` has moved past it. Only the async writer can wait
+// for that, see `qzip_ring_release`.
+#define SINK_IOV_MAX 16
+
+typedef struct {
+    FILE            *fp;        // stdio backend, NULL for fd backend
+    int             fd;
+    int             direct;
+    char            *align_buf;
+    size_t          align_len;
+    qzip_uring_t    *uring;
+    int             splice;     // vmsplice into a pipe
+    unsigned long   spliced;    // bytes handed to the pipe so far
+    qzip_hist_t     *write_ns;  // time of each write, NULL if not recorded
+} qzip_sink_t;
+
+static inline void
+qzip_sink_init_fp(qzip_sink_t *sink, FILE *fp)
+{
+    memset(sink, 0, sizeof(qzip_sink_t));
+    sink->fp = fp;
+    sink->fd = -1;
+}
+
+// Fall back to plain writes if io_uring can't be set up, and to buffered
+// writes if the descriptor refuses O_DIRECT
+static int
+qzip_sink_init_fd(qzip_sink_t *sink, int fd, int direct, unsigned int uring_depth)
+{
+    static int warned = 0;
+    static int uring_warned = 0;
+    int flags;
+
+    memset(sink, 0, sizeof(qzip_sink_t));
+    sink->fd = fd;
+    if (uring_depth > 0) {
+        sink->uring = qzip_uring_create(fd, uring_depth);
+        if (NULL != sink->uring) {
+            return 0;
+        }
+        if (!uring_warned) {
+            QC_PRINT("qzip_sink_init_fd: io_uring unavailable or output not seekable, falling back to writev\n");
+            uring_warned = 1;
+        }
+    }
+    if (!direct) {
+        return 0;
+    }
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return 1;
+    }
+    if (0 != fcntl(fd, F_SETFL, flags | O_DIRECT)) {
+        if (!warned) {
+            QC_PRINT("qzip_sink_init_fd: O_DIRECT unsupported, falling back to buffered writes\n");
+            warned = 1;
+        }
+        return 0;
+    }
+    if (0 != posix_memalign((void **)&sink->align_buf, DIRECT_ALIGN, DIRECT_BUF)) {
+        fcntl(fd, F_SETFL, flags);
+        return 1;
+    }
+    sink->direct = 1;
+
+    return 0;
+}
+
+// Write all of `iov`, resuming after short writes. `iov` is consumed.
+static int
+qzip_sink_writev_fd(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return 1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int
+qzip_sink_clear_direct(qzip_sink_t *sink)
+{
+    int flags = fcntl(sink->fd, F_GETFL);
+
+    sink->direct = 0;
+    return (flags < 0 || 0 != fcntl(sink->fd, F_SETFL, flags & ~O_DIRECT)) ? 1 : 0;
+}
+
+// Write out the whole blocks of the staging buffer and keep the tail
+static int
+qzip_sink_drain_direct(qzip_sink_t *sink)
+{
+    size_t len = sink->align_len & ~((size_t)DIRECT_ALIGN - 1);
+    struct iovec iov = { sink->align_buf, len };
+
+    if (0 == len) {
+        return 0;
+    }
+    if (0 != qzip_sink_writev_fd(sink->fd, &iov, 1)) {
+        // An unaligned file offset is only caught by the first write
+        if (EINVAL != errno || 0 != qzip_sink_clear_direct(sink)) {
+            return 1;
+        }
+        iov.iov_base = sink->align_buf;
+        iov.iov_len = len;
+        if (0 != qzip_sink_writev_fd(sink->fd, &iov, 1)) {
+            return 1;
+        }
+    }
+
+    memmove(sink->align_buf, sink->align_buf + len, sink->align_len - len);
+    sink->align_len -= len;
+
+    return 0;
+}
+
+static inline int
+qzip_sink_is_pipe(const qzip_sink_t *sink)
+{
+    struct stat st;
+
+    return (NULL == sink->fp && NULL == sink->uring && NULL == sink->align_buf &&
+            0 == fstat(sink->fd, &st) && S_ISFIFO(st.st_mode)) ? 1 : 0;
+}
+
+static int
+qzip_sink_vmsplice(qzip_sink_t *sink, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = vmsplice(sink->fd, iov, iovcnt, 0);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return 1;
+        }
+        sink->spliced += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+// Number of spliced bytes the pipe's reader has consumed, derived from what
+// is still queued in the pipe
+static int
+qzip_sink_consumed(qzip_sink_t *sink, unsigned long *consumed)
+{
+    int unread;
+
+    if (0 != ioctl(sink->fd, FIONREAD, &unread)) {
+        return 1;
+    }
+    *consumed = sink->spliced - unread;
+
+    return 0;
+}
+
+// Block until the pipe's reader makes progress. Fails once it has gone.
+static int
+qzip_sink_wait(qzip_sink_t *sink)
+{
+    struct pollfd pfd = { sink->fd, POLLOUT, 0 };
+
+    // POLLOUT fires as soon as the reader frees space, otherwise re-check
+    // every millisecond since partial reads may not free a whole page
+    if (poll(&pfd, 1, 1) < 0 && EINTR != errno) {
+        return 1;
+    }
+
+    return (pfd.revents & POLLERR) ? 1 : 0;
+}
+
+static int
+qzip_sink_dispatch(qzip_sink_t *sink, struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    if (NULL != sink->fp) {
+        for (i = 0; i < iovcnt; i++) {
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, sink->fp) != iov[i].iov_len) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (sink->splice) {
+        return qzip_sink_vmsplice(sink, iov, iovcnt);
+    }
+
+    if (NULL != sink->uring) {
+        for (i = 0; i < iovcnt; i++) {
+            if (0 != qzip_uring_write(sink->uring, iov[i].iov_base, iov[i].iov_len)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (NULL == sink->align_buf) {
+        return qzip_sink_writev_fd(sink->fd, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        char *src = (char *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            size_t n = DIRECT_BUF - sink->align_len;
+            n = (n < left) ? n : left;
+            memcpy(sink->align_buf + sink->align_len, src, n);
+            sink->align_len += n;
+            src += n;
+            left -= n;
+            if (DIRECT_BUF == sink->align_len && 0 != qzip_sink_drain_direct(sink)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+qzip_sink_writev(qzip_sink_t *sink, struct iovec *iov, int iovcnt)
+{
+    unsigned long long start;
+    int rc;
+
+    if (NULL == sink->write_ns) {
+        return qzip_sink_dispatch(sink, iov, iovcnt);
+    }
+
+    start = qzip_now_ns();
+    rc = qzip_sink_dispatch(sink, iov, iovcnt);
+    qzip_hist_record(sink->write_ns, qzip_now_ns() - start);
+
+    return rc;
+}
+
+static inline int
+qzip_sink_write(qzip_sink_t *sink, char *buf, size_t len)
+{
+    struct iovec iov = { buf, len };
+
+    return qzip_sink_writev(sink, &iov, 1);
+}
+
+// Push everything accepted so far to the file. O_DIRECT sinks keep their
+// unaligned tail until close.
+static int
+qzip_sink_flush(qzip_sink_t *sink)
+{
+    if (NULL != sink->fp) {
+        return fflush(sink->fp);
+    }
+    if (NULL != sink->uring) {
+        return qzip_uring_sync(sink->uring);
+    }
+
+    return (NULL != sink->align_buf) ? qzip_sink_drain_direct(sink) : 0;
+}
+
+// Write the O_DIRECT tail and release the sink. The underlying file is
+// closed only with `owned` set.
+static int
+qzip_sink_close(qzip_sink_t *sink, int owned)
+{
+    int rc = 0;
+
+    if (NULL != sink->fp) {
+        return owned ? fclose(sink->fp) : 0;
+    }
+
+    if (NULL != sink->uring) {
+        rc = qzip_uring_sync(sink->uring);
+        qzip_uring_destroy(sink->uring);
+    }
+
+    if (NULL != sink->align_buf) {
+        rc = qzip_sink_drain_direct(sink);
+        if (sink->align_len > 0) {
+            struct iovec iov = { sink->align_buf, sink->align_len };
+            if (sink->direct) {
+                rc |= qzip_sink_clear_direct(sink);
+            }
+            rc |= qzip_sink_writev_fd(sink->fd, &iov, 1);
+        }
+        free(sink->align_buf);
+    }
+    if (owned) {
+        rc |= close(sink->fd);
+    }
+
+    return rc;
+}
+// \end output sink
+
+// \begin async writer
+// A small ring of output buffers drained by a dedicated writer thread. The
+// producer compresses into the slot at `head` while the writer thread
+// flushes slots from `tail`, so compression and disk IO overlap. Slots
+// spliced into a pipe stay `inflight` until the pipe's reader has consumed
+// them.
+typedef struct {
+    char            *buf;
+    unsigned int    len;
+    unsigned long   end;        // sink offset just past this slot
+} qzip_slot_t;
+
+typedef struct {
+    qzip_slot_t     *slots;
+    unsigned int    nslots;
+    unsigned int    head;       // next slot to fill
+    unsigned int    tail;       // next slot to release
+    unsigned int    count;      // number of filled slots
+    unsigned int    inflight;   // filled slots already written from `tail`
+    unsigned long   written;
+    int             stop;
+    int             error;
+    qzip_sink_t     *sink;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_full;
+    pthread_cond_t  not_empty;
+    pthread_t       writer;
+} qzip_ring_t;
+
+// Hand written slots back to the producer. Called with the lock held.
+static void
+qzip_ring_release(qzip_ring_t *ring)
+{
+    unsigned long consumed = ring->written;
+    unsigned int n = 0;
+
+    if (ring->sink->splice && !ring->error &&
+        0 != qzip_sink_consumed(ring->sink, &consumed)) {
+        ring->error = 1;
+        consumed = ring->written;
+    }
+
+    while (n < ring->inflight &&
+           ring->slots[(ring->tail + n) % ring->nslots].end <= consumed) {
+        n++;
+    }
+    if (n > 0) {
+        ring->tail = (ring->tail + n) % ring->nslots;
+        ring->count -= n;
+        ring->inflight -= n;
+        pthread_cond_signal(&ring->not_full);
+    }
+}
+
+// Every filled slot up to the end of the ring is written with one `writev`
+static void *
+qzip_ring_writer(void *arg)
+{
+    qzip_ring_t *ring = (qzip_ring_t *)arg;
+    struct iovec iov[SINK_IOV_MAX];
+    unsigned int i, n, first;
+    int rc;
+
+    pthread_mutex_lock(&ring->lock);
+    while (1) {
+        qzip_ring_release(ring);
+
+        n = ring->count - ring->inflight;
+        if (0 == n) {
+            if (0 == ring->inflight) {
+                if (ring->stop) {
+                    break;
+                }
+                pthread_cond_wait(&ring->not_empty, &ring->lock);
+            } else {
+                pthread_mutex_unlock(&ring->lock);
+                rc = qzip_sink_wait(ring->sink);
+                pthread_mutex_lock(&ring->lock);
+                if (0 != rc) {
+                    QC_ERROR("qzip_ring_writer: pipe reader has gone\n");
+                    ring->error = 1;
+                }
+            }
+            continue;
+        }
+
+        first = (ring->tail + ring->inflight) % ring->nslots;
+        if (n > ring->nslots - first) {
+            n = ring->nslots - first;
+        }
+        if (n > SINK_IOV_MAX) {
+            n = SINK_IOV_MAX;
+        }
+        for (i = 0; i < n; i++) {
+            qzip_slot_t *slot = &(ring->slots[first + i]);
+            iov[i].iov_base = slot->buf;
+            iov[i].iov_len = slot->len;
+            ring->written += slot->len;
+            slot->end = ring->written;
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        rc = qzip_sink_writev(ring->sink, iov, n);
+
+        pthread_mutex_lock(&ring->lock);
+        if (0 != rc) {
+            QC_ERROR("qzip_ring_writer: failed to write %u slots\n", n);
+            ring->error = 1;
+        }
+        ring->inflight += n;
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+static int
+qzip_ring_init(qzip_ring_t *ring, unsigned int nslots, unsigned int slot_sz,
+               int pinned, qzip_sink_t *sink)
+{
+    unsigned int i;
+
+    ring->slots = (qzip_slot_t *)calloc(nslots, sizeof(qzip_slot_t));
+    if (NULL == ring->slots) {
+        return 1;
+    }
+    for (i = 0; i < nslots; i++) {
+        if (NULL == (ring->slots[i].buf = (char *)qzip_mem_alloc(slot_sz, pinned))) {
+            goto free_slots;
+        }
+    }
+
+    ring->nslots = nslots;
+    ring->head = ring->tail = ring->count = ring->inflight = 0;
+    ring->written = 0;
+    ring->stop = ring->error = 0;
+    ring->sink = sink;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->not_full, NULL);
+    pthread_cond_init(&ring->not_empty, NULL);
+
+    if (0 == pthread_create(&ring->writer, NULL, qzip_ring_writer, ring)) {
+        return 0;
+    }
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->not_full);
+    pthread_cond_destroy(&ring->not_empty);
+free_slots:
+    while (i-- > 0) {
+        qzip_mem_free(ring->slots[i].buf);
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+
+    return 1;
+}
+
+// Wait for a free slot and return its buffer, or NULL if the writer failed
+static char *
+qzip_ring_acquire(qzip_ring_t *ring)
+{
+    char *buf;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == ring->nslots && !ring->error) {
+        pthread_cond_wait(&ring->not_full, &ring->lock);
+    }
+    buf = ring->error ? NULL : ring->slots[ring->head].buf;
+    pthread_mutex_unlock(&ring->lock);
+
+    return buf;
+}
+
+static void
+qzip_ring_commit(qzip_ring_t *ring, unsigned int len)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->slots[ring->head].len = len;
+    ring->head = (ring->head + 1) % ring->nslots;
+    ring->count++;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Drain every filled slot, then stop the writer thread
+static int
+qzip_ring_destroy(qzip_ring_t *ring)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->writer, NULL);
+
+    for (i = 0; i < ring->nslots; i++) {
+        qzip_mem_free(ring->slots[i].buf);
+    }
+    free(ring->slots);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->not_full);
+    pthread_cond_destroy(&ring->not_empty);
+
+    return ring->error;
+}
+
+// Wait until the writer has drained every committed slot
+static int
+qzip_ring_sync(qzip_ring_t *ring)
+{
+    int error;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count > 0 && !ring->error) {
+        pthread_cond_wait(&ring->not_full, &ring->lock);
+    }
+    error = ring->error;
+    pthread_mutex_unlock(&ring->lock);
+
+    return error ? -1 : 0;
+}
+// \end async writer
+
+// \begin cookie parameters
+int
+qzip_params_init(qzip_params_t *params)
+{
+    QzSessionParams_T defaults;
+
+    if (QZ_OK != qzGetDefaults(&defaults)) {
+        return -1;
+    }
+
+    memset(params, 0, sizeof(qzip_params_t));
+    params->comp_lvl          = defaults.comp_lvl;
+    params->hw_buff_sz        = defaults.hw_buff_sz;
+    params->poll_sleep        = defaults.poll_sleep;
+    params->input_sz_thrshold = defaults.input_sz_thrshold;
+    params->coalesce_sz       = defaults.hw_buff_sz;
+
+    return 0;
+}
+
+// Reject what QATzip would refuse in `qzSetupSession`, so that the `_ex`
+// constructors can fail instead of asserting
+static int
+qzip_params_check(const qzip_params_t *params)
+{
+    if (params->comp_lvl < 1 || params->comp_lvl > 9) {
+        return -1;
+    }
+    if (params->hw_buff_sz < 4 * 1024 || params->hw_buff_sz > 512 * 1024 ||
+        (params->hw_buff_sz & (params->hw_buff_sz - 1)) != 0) {
+        return -1;
+    }
+    if (params->input_sz_thrshold > params->hw_buff_sz) {
+        return -1;
+    }
+    if (params->poll_sleep > POLL_SLEEP_MAX) {
+        return -1;
+    }
+    if (params->nslots > RING_SLOTS_MAX) {
+        return -1;
+    }
+    if (params->coalesce_sz > MAXSLICE) {
+        return -1;
+    }
+    if (params->uring > URING_DEPTH_MAX) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Fill QATzip session parameters from `params`, or QATzip's defaults when it
+// is NULL. A zlib-style level digit in `mode`, as in "w6", takes precedence.
+static int
+qzip_sess_params_setup(QzSessionParams_T *qz_sess_params,
+                       const qzip_params_t *params, const char *mode)
+{
+    if (QZ_OK != qzGetDefaults(qz_sess_params)) {
+        return -1;
+    }
+
+    if (NULL != params) {
+        qz_sess_params->comp_lvl          = params->comp_lvl;
+        qz_sess_params->hw_buff_sz        = params->hw_buff_sz;
+        qz_sess_params->poll_sleep        = params->poll_sleep;
+        qz_sess_params->input_sz_thrshold = params->input_sz_thrshold;
+    }
+
+    for (; *mode != '\0'; mode++) {
+        if (*mode >= '1' && *mode <= '9') {
+            qz_sess_params->comp_lvl = *mode - '0';
+        }
+    }
+
+    return 0;
+}
+
+// Drop level digits from `mode` before it reaches fopen
+static const char *
+qzip_fopen_mode(const char *mode, char *buf, size_t size)
+{
+    size_t i = 0;
+
+    for (; *mode != '\0' && i < size - 1; mode++) {
+        if (*mode < '0' || *mode > '9') {
+            buf[i++] = *mode;
+        }
+    }
+    buf[i] = '\0';
+
+    return buf;
+}
+// \end cookie parameters
+
+// \begin session pool
+// `qzInit`/`qzSetupSession` and their teardown counterparts are far more
+// expensive than a compression request on small files. Idle sessions are
+// therefore parked in a process-wide pool and handed out again to the next
+// cookie asking for the same parameters.
+#define SESS_POOL_MAX 64   // idle sessions kept at most
+
+typedef struct qzip_sess_entry_ {
+    QzSession_T             qz_sess;    // must stay first, see qzip_sess_put
+    QzSessionParams_T       qz_sess_params;
+    struct qzip_sess_entry_ *next;
+} qzip_sess_entry_t;
+
+static struct {
+    qzip_sess_entry_t *idle;
+    unsigned long     nidle;
+    unsigned long     hits;
+    unsigned long     misses;
+    pthread_mutex_t   lock;
+} sess_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_once_t sess_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+qzip_sess_pool_init(void)
+{
+    atexit(qzip_sess_pool_drain);
+}
+
+// Parameter structs may contain padding, so they are compared field by field
+static inline int
+qzip_sess_params_eq(const QzSessionParams_T *a, const QzSessionParams_T *b)
+{
+    return a->huffman_hdr       == b->huffman_hdr &&
+           a->direction         == b->direction &&
+           a->data_fmt          == b->data_fmt &&
+           a->comp_lvl          == b->comp_lvl &&
+           a->comp_algorithm    == b->comp_algorithm &&
+           a->poll_sleep        == b->poll_sleep &&
+           a->max_forks         == b->max_forks &&
+           a->sw_backup         == b->sw_backup &&
+           a->hw_buff_sz        == b->hw_buff_sz &&
+           a->strm_buff_sz      == b->strm_buff_sz &&
+           a->input_sz_thrshold == b->input_sz_thrshold &&
+           a->req_cnt_thrshold  == b->req_cnt_thrshold &&
+           a->wait_cnt_thrshold == b->wait_cnt_thrshold;
+}
+
+static qzip_sess_entry_t *
+qzip_sess_new(const QzSessionParams_T *params)
+{
+    qzip_sess_entry_t *entry =
+        (qzip_sess_entry_t *)calloc(1, sizeof(qzip_sess_entry_t));
+    int rc;
+
+    if (NULL == entry) {
+        return NULL;
+    }
+    entry->qz_sess_params = *params;
+
+    // 1 means use software as backup when QAT hardware is unavailable
+    rc = qzInit(&(entry->qz_sess), 1);
+    if (QZ_OK != rc && QZ_DUPLICATE != rc) {
+        QC_ERROR("qzip_sess_new: qzInit failed with error: %d\n", rc);
+        free(entry);
+        return NULL;
+    }
+    rc = qzSetupSession(&(entry->qz_sess), &(entry->qz_sess_params));
+    if (QZ_OK != rc) {
+        QC_ERROR("qzip_sess_new: qzSetupSession failed with error: %d\n", rc);
+        qzClose(&(entry->qz_sess));
+        free(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void
+qzip_sess_free(qzip_sess_entry_t *entry)
+{
+    qzTeardownSession(&(entry->qz_sess));
+    qzClose(&(entry->qz_sess));
+    free(entry);
+}
+
+// Check a session set up with `params` out of the pool
+static QzSession_T *
+qzip_sess_get(const QzSessionParams_T *params)
+{
+    qzip_sess_entry_t **pp;
+    qzip_sess_entry_t *entry = NULL;
+
+    pthread_once(&sess_pool_once, qzip_sess_pool_init);
+
+    pthread_mutex_lock(&sess_pool.lock);
+    for (pp = &sess_pool.idle; *pp != NULL; pp = &((*pp)->next)) {
+        if (qzip_sess_params_eq(&((*pp)->qz_sess_params), params)) {
+            entry = *pp;
+            *pp = entry->next;
+            sess_pool.nidle--;
+            break;
+        }
+    }
+    if (NULL != entry) {
+        sess_pool.hits++;
+    } else {
+        sess_pool.misses++;
+    }
+    pthread_mutex_unlock(&sess_pool.lock);
+
+    if (NULL == entry) {
+        entry = qzip_sess_new(params);
+    }
+
+    return (NULL == entry) ? NULL : &(entry->qz_sess);
+}
+
+// Return a session to the pool, or tear it down when the pool is full
+static void
+qzip_sess_put(QzSession_T *qz_sess)
+{
+    qzip_sess_entry_t *entry = (qzip_sess_entry_t *)qz_sess;
+
+    pthread_mutex_lock(&sess_pool.lock);
+    if (sess_pool.nidle < SESS_POOL_MAX) {
+        entry->next = sess_pool.idle;
+        sess_pool.idle = entry;
+        sess_pool.nidle++;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&sess_pool.lock);
+
+    if (NULL != entry) {
+        qzip_sess_free(entry);
+    }
+}
+
+int
+qzip_sess_pool_warmup(const QzSessionParams_T *params, unsigned int count)
+{
+    QzSessionParams_T defaults;
+    qzip_sess_entry_t *entry;
+    unsigned int i;
+
+    if (NULL == params) {
+        if (QZ_OK != qzGetDefaults(&defaults)) {
+            return -1;
+        }
+        params = &defaults;
+    }
+
+    pthread_once(&sess_pool_once, qzip_sess_pool_init);
+
+    for (i = 0; i < count; i++) {
+        if (NULL == (entry = qzip_sess_new(params))) {
+            return -1;
+        }
+        qzip_sess_put(&(entry->qz_sess));
+    }
+
+    return 0;
+}
+
+void
+qzip_sess_pool_get_stats(qzip_sess_pool_stats_t *stats)
+{
+    pthread_mutex_lock(&sess_pool.lock);
+    stats->hits   = sess_pool.hits;
+    stats->misses = sess_pool.misses;
+    stats->idle   = sess_pool.nidle;
+    pthread_mutex_unlock(&sess_pool.lock);
+}
+
+void
+qzip_sess_pool_drain(void)
+{
+    qzip_sess_entry_t *entry;
+
+    pthread_mutex_lock(&sess_pool.lock);
+    entry = sess_pool.idle;
+    sess_pool.idle = NULL;
+    sess_pool.nidle = 0;
+    pthread_mutex_unlock(&sess_pool.lock);
+
+    while (NULL != entry) {
+        qzip_sess_entry_t *next = entry->next;
+        qzip_sess_free(entry);
+        entry = next;
+    }
+}
+// \end session pool
+
+// \begin cookie registry
+// fopencookie hides the cookie behind the FILE * it returns. Cookies that
+// support out-of-band operations such as `qzip_flush` record themselves here
+// when opened and drop out when closed. An entry found by `qzip_flush` or
+// `qzip_cookie_get_stats` is held until they are done with it, and closing
+// waits for that, so the cookie isn't freed under them.
+typedef struct qzip_registry_entry_ {
+    FILE                        *fp;
+    void                        *cookie;
+    int                         (*flush)(void *cookie);     // NULL if unsupported
+    void                        (*stats)(void *cookie, qzip_cookie_stats_t *stats);
+    int                         refs;                       // held by lookups
+    struct qzip_registry_entry_ *next;
+} qzip_registry_entry_t;
+
+static struct {
+    qzip_registry_entry_t *head;
+    qzip_cookie_stats_t   retired;  // sum over closed cookies
+    pthread_mutex_t       lock;
+    pthread_cond_t        released; // an entry's last hold was dropped
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .released = PTHREAD_COND_INITIALIZER,
+};
+
+static int
+qzip_registry_add(FILE *fp, void *cookie, int (*flush)(void *),
+                  void (*stats)(void *, qzip_cookie_stats_t *))
+{
+    qzip_registry_entry_t *entry =
+        (qzip_registry_entry_t *)malloc(sizeof(qzip_registry_entry_t));
+    if (NULL == entry) {
+        return 1;
+    }
+
+    entry->fp = fp;
+    entry->cookie = cookie;
+    entry->flush = flush;
+    entry->stats = stats;
+    entry->refs = 0;
+
+    pthread_mutex_lock(&registry.lock);
+    entry->next = registry.head;
+    registry.head = entry;
+    pthread_mutex_unlock(&registry.lock);
+
+    return 0;
+}
+
+static void
+qzip_registry_del(void *cookie)
+{
+    qzip_registry_entry_t **pp, *entry = NULL;
+
+    pthread_mutex_lock(&registry.lock);
+    for (pp = &registry.head; *pp != NULL; pp = &((*pp)->next)) {
+        if ((*pp)->cookie == cookie) {
+            entry = *pp;
+            *pp = entry->next;
+            break;
+        }
+    }
+    while (NULL != entry && entry->refs > 0) {
+        pthread_cond_wait(&registry.released, &registry.lock);
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    free(entry);
+}
+
+// Return the entry of `fp` held, to be dropped with `qzip_registry_put`
+static qzip_registry_entry_t *
+qzip_registry_find(FILE *fp)
+{
+    qzip_registry_entry_t *entry;
+
+    pthread_mutex_lock(&registry.lock);
+    for (entry = registry.head; entry != NULL; entry = entry->next) {
+        if (entry->fp == fp) {
+            entry->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    return entry;
+}
+
+static void
+qzip_registry_put(qzip_registry_entry_t *entry)
+{
+    pthread_mutex_lock(&registry.lock);
+    if (0 == --entry->refs) {
+        pthread_cond_broadcast(&registry.released);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+int
+qzip_flush(FILE *fp)
+{
+    qzip_registry_entry_t *entry;
+    int rc;
+
+    if (fflush(fp) != 0) {
+        return EOF;
+    }
+    if (NULL == (entry = qzip_registry_find(fp))) {
+        errno = EBADF;
+        return EOF;
+    }
+    if (NULL == entry->flush) {
+        qzip_registry_put(entry);
+        errno = ENOTSUP;
+        return EOF;
+    }
+
+    rc = entry->flush(entry->cookie);
+    qzip_registry_put(entry);
+
+    return (rc == 0) ? 0 : EOF;
+}
+
+// Fold the final counters of a closing cookie into the process totals
+static void
+qzip_stats_retire(const qzip_cookie_stats_t *stats)
+{
+    pthread_mutex_lock(&registry.lock);
+    registry.retired.bytes_in  += stats->bytes_in;
+    registry.retired.bytes_out += stats->bytes_out;
+    registry.retired.hw_bytes  += stats->hw_bytes;
+    registry.retired.sw_bytes  += stats->sw_bytes;
+    registry.retired.requests  += stats->requests;
+    registry.retired.stored_bytes += stats->stored_bytes;
+    registry.retired.route_hw_bytes += stats->route_hw_bytes;
+    registry.retired.route_sw_bytes += stats->route_sw_bytes;
+    qzip_hist_merge(&registry.retired.comp_ns, &stats->comp_ns);
+    qzip_hist_merge(&registry.retired.write_ns, &stats->write_ns);
+    qzip_hist_merge(&registry.retired.req_bytes, &stats->req_bytes);
+    pthread_mutex_unlock(&registry.lock);
+}
+
+int
+qzip_cookie_get_stats(FILE *fp, qzip_cookie_stats_t *stats)
+{
+    qzip_registry_entry_t *entry;
+
+    if (NULL == fp) {
+        pthread_mutex_lock(&registry.lock);
+        *stats = registry.retired;
+        pthread_mutex_unlock(&registry.lock);
+    } else if (NULL == (entry = qzip_registry_find(fp))) {
+        errno = EBADF;
+        return -1;
+    } else {
+        entry->stats(entry->cookie, stats);
+        qzip_registry_put(entry);
+    }
+
+    qzip_hist_summarize(&stats->comp_ns);
+    qzip_hist_summarize(&stats->write_ns);
+    qzip_hist_summarize(&stats->req_bytes);
+    return 0;
+}
+
+// Account for one request that took `ns` nanoseconds, with `qz_sess` NULL
+// for one done with zlib. QATzip doesn't say where a request ran. Requests
+// under the session's threshold go to software, and so does everything once
+// the session has no hardware behind it.
+static inline void
+qzip_stats_add(qzip_cookie_stats_t *stats, const QzSession_T *qz_sess,
+               const QzSessionParams_T *qz_sess_params,
+               unsigned int in_len, unsigned int out_len, unsigned long long ns)
+{
+    stats->bytes_in += in_len;
+    stats->bytes_out += out_len;
+    stats->requests++;
+    qzip_hist_record(&stats->comp_ns, ns);
+    qzip_hist_record(&stats->req_bytes, in_len);
+    if (NULL != qz_sess && QZ_OK == qz_sess->hw_session_stat &&
+        in_len >= qz_sess_params->input_sz_thrshold) {
+        stats->hw_bytes += in_len;
+    } else {
+        stats->sw_bytes += in_len;
+    }
+}
+
+// Account for a chunk stored without compression
+static inline void
+qzip_stats_store(qzip_cookie_stats_t *stats, unsigned int in_len, unsigned int out_len)
+{
+    stats->bytes_in += in_len;
+    stats->bytes_out += out_len;
+    stats->stored_bytes += in_len;
+}
+// \end cookie registry
+
+// \begin seek index
+// Seekable output is a plain multi-member gzip stream followed by an index
+// of (uncompressed offset, compressed offset) pairs, one every SEEK_SPAN
+// bytes of input or so, each pointing at the start of a member. The index
+// is stored in the FEXTRA field of empty members, which gzip(1) skips, and
+// the stream ends with a fixed-size empty member telling where the index
+// starts. Offsets count from where the cookie started writing.
+//
+//   index member: 1f 8b 08 04 <mtime 0> 00 ff <xlen> 'Q' 'I' <len>
+//                 { u64 uncompressed, u64 compressed } * n
+//                 03 00 <crc32 0> <isize 0>
+//   tail member:  same with 'Q' 'T' and { u64 index offset, u64 count,
+//                 u64 uncompressed size }
+//
+// All integers are little-endian.
+#define SEEK_SPAN        (1024*1024)
+#define INDEX_PER_MEMBER 4000       // keeps FEXTRA under 64 KB
+#define INDEX_HDR        16         // gzip header, XLEN and subfield header
+#define INDEX_FTR        10         // empty deflate block, CRC32 and ISIZE
+#define INDEX_TAIL       (INDEX_HDR + 24 + INDEX_FTR)
+
+typedef struct {
+    unsigned long long u_off;
+    unsigned long long c_off;
+} qzip_index_entry_t;
+
+typedef struct {
+    qzip_index_entry_t *ents;
+    size_t             len;
+    size_t             cap;
+} qzip_index_t;
+
+static inline void
+put_le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static inline void
+put_le32(unsigned char *p, unsigned int v)
+{
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+static inline void
+put_le64(unsigned char *p, unsigned long long v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        p[i] = (v >> (8 * i)) & 0xff;
+    }
+}
+
+static inline unsigned long long
+get_le64(const unsigned char *p)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+static int
+qzip_index_push(qzip_index_t *idx, unsigned long long u_off, unsigned long long c_off)
+{
+    if (idx->len == idx->cap) {
+        size_t cap = (0 == idx->cap) ? 64 : 2 * idx->cap;
+        qzip_index_entry_t *ents = realloc(idx->ents, cap * sizeof(qzip_index_entry_t));
+        if (NULL == ents) {
+            return -1;
+        }
+        idx->ents = ents;
+        idx->cap = cap;
+    }
+
+    idx->ents[idx->len].u_off = u_off;
+    idx->ents[idx->len].c_off = c_off;
+    idx->len++;
+
+    return 0;
+}
+
+// Record a seek point unless the last one is less than SEEK_SPAN behind
+static inline int
+qzip_index_add(qzip_index_t *idx, unsigned long long u_off, unsigned long long c_off)
+{
+    if (idx->len > 0 && u_off - idx->ents[idx->len - 1].u_off < SEEK_SPAN) {
+        return 0;
+    }
+
+    return qzip_index_push(idx, u_off, c_off);
+}
+
+// Wrap `len` bytes of `data` into an empty member tagged `si2`. Returns the
+// size of the member.
+static unsigned int
+qzip_index_member(unsigned char *buf, unsigned char si2, const unsigned char *data,
+                  unsigned int len)
+{
+    static const unsigned char hdr[10] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff
+    };
+
+    memcpy(buf, hdr, sizeof(hdr));
+    put_le16(buf + 10, 4 + len);
+    buf[12] = 'Q';
+    buf[13] = si2;
+    put_le16(buf + 14, len);
+    memmove(buf + INDEX_HDR, data, len);
+    memcpy(buf + INDEX_HDR + len, gzip_empty_member + 10, INDEX_FTR);
+
+    return INDEX_HDR + len + INDEX_FTR;
+}
+
+// Serialize index entries `from`..`from + n` as one member into `buf`
+static unsigned int
+qzip_index_encode(unsigned char *buf, const qzip_index_t *idx, size_t from, size_t n)
+{
+    unsigned char *data = buf + INDEX_HDR;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        put_le64(data + 16 * i, idx->ents[from + i].u_off);
+        put_le64(data + 16 * i + 8, idx->ents[from + i].c_off);
+    }
+
+    return qzip_index_member(buf, 'I', data, 16 * n);
+}
+
+static unsigned int
+qzip_index_tail(unsigned char *buf, unsigned long long idx_off, unsigned long long count,
+                unsigned long long u_size)
+{
+    unsigned char data[24];
+
+    put_le64(data, idx_off);
+    put_le64(data + 8, count);
+    put_le64(data + 16, u_size);
+
+    return qzip_index_member(buf, 'T', data, sizeof(data));
+}
+
+// Check that `buf` starts an index member tagged `si2` and return the
+// length of its payload, or -1
+static int
+qzip_index_check(const unsigned char *buf, unsigned char si2)
+{
+    unsigned int len = buf[14] | (buf[15] << 8);
+
+    if (buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 0x08 || buf[3] != 0x04 ||
+        buf[12] != 'Q' || buf[13] != si2 ||
+        (buf[10] | (buf[11] << 8)) != 4 + len) {
+        return -1;
+    }
+
+    return len;
+}
+
+// Read the index of the seekable stream starting at `base` in `fp`. On
+// success the stream's compressed data (index excluded) ends at `c_end` and
+// decompresses to `u_size` bytes. `fp` is left at `base` either way.
+static int
+qzip_index_load(FILE *fp, off_t base, qzip_index_t *idx, unsigned long long *c_end,
+                unsigned long long *u_size)
+{
+    unsigned char *buf = NULL;
+    unsigned long long idx_off, count;
+    off_t end;
+    int len, rc = -1;
+    size_t n;
+
+    if (fseeko(fp, 0, SEEK_END) != 0 || (end = ftello(fp)) - base < INDEX_TAIL) {
+        goto out;
+    }
+
+    buf = (unsigned char *)malloc(INDEX_HDR + 16 * INDEX_PER_MEMBER + INDEX_FTR);
+    if (NULL == buf ||
+        fseeko(fp, end - INDEX_TAIL, SEEK_SET) != 0 ||
+        fread(buf, 1, INDEX_TAIL, fp) != INDEX_TAIL ||
+        qzip_index_check(buf, 'T') != 24) {
+        goto out;
+    }
+
+    idx_off = get_le64(buf + INDEX_HDR);
+    count   = get_le64(buf + INDEX_HDR + 8);
+    *u_size = get_le64(buf + INDEX_HDR + 16);
+    if (idx_off > (unsigned long long)(end - base - INDEX_TAIL) ||
+        fseeko(fp, base + idx_off, SEEK_SET) != 0) {
+        goto out;
+    }
+
+    idx->len = 0;
+    while (idx->len < count) {
+        if (fread(buf, 1, INDEX_HDR, fp) != INDEX_HDR ||
+            (len = qzip_index_check(buf, 'I')) < 0 ||
+            len % 16 != 0 || len > 16 * INDEX_PER_MEMBER ||
+            fread(buf + INDEX_HDR, 1, len + INDEX_FTR, fp) != (size_t)len + INDEX_FTR) {
+            goto out;
+        }
+        for (n = 0; n < (size_t)len / 16; n++) {
+            if (qzip_index_push(idx, get_le64(buf + INDEX_HDR + 16 * n),
+                               get_le64(buf + INDEX_HDR + 16 * n + 8)) != 0) {
+                goto out;
+            }
+        }
+        if (0 == len) {
+            break;
+        }
+    }
+
+    if (idx->len == count) {
+        *c_end = idx_off;
+        rc = 0;
+    }
+
+out:
+    free(buf);
+    if (rc != 0) {
+        idx->len = 0;
+    }
+    fseeko(fp, base, SEEK_SET);
+    return rc;
+}
+
+// Return the last entry at or before `u_off`, or NULL
+static const qzip_index_entry_t *
+qzip_index_find(const qzip_index_t *idx, unsigned long long u_off)
+{
+    size_t lo = 0, hi = idx->len;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->ents[mid].u_off <= u_off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo > 0) ? &(idx->ents[lo - 1]) : NULL;
+}
+// \end seek index
+
+// \begin stored members
+// Already compressed input (JPEG, zstd, gzip...) comes out of `qzCompress`
+// slightly larger than it went in. A sample of each chunk is checked first,
+// and chunks that look incompressible are wrapped as-is into stored deflate
+// blocks, which costs a CRC32 instead of a compression request.
+//
+// The check is the collision entropy of bytes sampled from SAMPLE_STRIPES
+// places across the chunk: with counts c_i over n sampled bytes, data is
+// taken as incompressible when 256 * sum(c_i^2) < n^2 * 5/4, that is over
+// about 7.7 bits per byte. Uniformly random data sits near 1.06, text above
+// 10. It's order-0 only, so redundancy at longer range slips through.
+#define SAMPLE_STRIPES   16
+#define SAMPLE_STRIPE    256
+#define SAMPLE_MIN       (SAMPLE_STRIPES * SAMPLE_STRIPE)
+#define STORED_BLOCK     65535
+
+static int
+qzip_incompressible(const unsigned char *buf, size_t len)
+{
+    unsigned int counts[256] = { 0 };
+    unsigned long long n = SAMPLE_MIN, sum = 0;
+    size_t step, i, j;
+
+    if (len < SAMPLE_MIN) {
+        return 0;
+    }
+
+    step = (len - SAMPLE_STRIPE) / (SAMPLE_STRIPES - 1);
+    for (i = 0; i < SAMPLE_STRIPES; i++) {
+        const unsigned char *p = buf + i * step;
+        for (j = 0; j < SAMPLE_STRIPE; j++) {
+            counts[p[j]]++;
+        }
+    }
+    for (i = 0; i < 256; i++) {
+        sum += (unsigned long long)counts[i] * counts[i];
+    }
+
+    return 4 * 256 * sum < 5 * n * n;
+}
+
+// Size of `len` bytes as a stored member
+static inline size_t
+qzip_stored_len(size_t len)
+{
+    size_t nblocks = (0 == len) ? 1 : (len + STORED_BLOCK - 1) / STORED_BLOCK;
+
+    return 10 + 5 * nblocks + len + 8;
+}
+
+// Wrap `len` bytes of `src` into one gzip member of stored blocks at `dst`,
+// which must hold `qzip_stored_len(len)` bytes. Returns the member size.
+static size_t
+qzip_store_member(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    unsigned long crc = qzip_crc32(0L, src, len);
+    unsigned char *p = dst;
+    size_t off = 0, n;
+
+    memcpy(p, gzip_empty_member, 10);
+    p += 10;
+    do {
+        n = (len - off > STORED_BLOCK) ? STORED_BLOCK : len - off;
+        p[0] = (off + n == len) ? 1 : 0;    // BFINAL, BTYPE 00
+        put_le16(p + 1, n);
+        put_le16(p + 3, ~n & 0xffff);
+        memcpy(p + 5, src + off, n);
+        p += 5 + n;
+        off += n;
+    } while (off < len);
+    put_le32(p, crc);
+    put_le32(p + 4, len);
+
+    return p + 8 - dst;
+}
+// \end stored members
+
+// \begin qzip read cookie
+// Decompress with the non-stream API. Compressed data is staged in `src`
+// and each call to `qzDecompress` inflates as many whole members as fit
+// into `dst`, which is then handed out to the caller piece by piece.
+typedef struct {
+    QzSession_T       *qz_sess;
+    QzSessionParams_T qz_sess_params;
+    bufm_t            src;
+    bufm_t            dst;
+    int               eof;
+    FILE              *fp;
+    qzip_cookie_stats_t stats;
+    off_t             base;         // where the stream starts in `fp`, -1 if not seekable
+    unsigned long long c_pos;       // compressed bytes read from `fp`
+    unsigned long long c_end;       // compressed data ends here, index excluded
+    unsigned long long u_pos;       // uncompressed bytes handed out
+    unsigned long long u_size;      // total uncompressed size, if indexed
+    int               indexed;
+    qzip_index_t      index;
+} qzip_read_cookie_t;
+
+// Refill `dst` with decompressed data. Returns 0 on progress, 1 at the end
+// of input and -1 on error.
+static int
+qzip_read_cookie_refill(qzip_read_cookie_t *qz_cookie)
+{
+    QzSession_T *qz_sess = qz_cookie->qz_sess;
+    bufm_t *src = &(qz_cookie->src);
+    bufm_t *dst = &(qz_cookie->dst);
+    unsigned int src_len;
+    unsigned int dst_len;
+    unsigned long long start, elapsed;
+    int rc = QZ_OK;
+
+    while (1) {
+        src_len = src->consumed - src->offset;
+        dst_len = dst->size;
+
+        if (src_len > 0) {
+            start = qzip_now_ns();
+            rc = qzDecompress(qz_sess, src->buf + src->offset, &src_len,
+                              dst->buf, &dst_len);
+            elapsed = qzip_now_ns() - start;
+            if (rc != QZ_OK &&
+                rc != QZ_BUF_ERROR &&
+                rc != QZ_DATA_ERROR) {
+                QC_ERROR("qzip_cookie_read: failed with error: %d\n", rc);
+                return -1;
+            }
+
+            QC_DEBUG("qzip_cookie_read: rc %d, src_len %d, dst_len %d\n",
+                     rc, src_len, dst_len);
+
+            if (src_len > 0) {
+                qzip_stats_add(&(qz_cookie->stats), qz_sess, &(qz_cookie->qz_sess_params),
+                               src_len, dst_len, elapsed);
+            }
+            src->offset += src_len;
+            if (dst_len > 0) {
+                dst->offset = 0;
+                dst->consumed = dst_len;
+                return 0;
+            }
+            if (src_len > 0) {
+                continue;   // Only empty members were consumed
+            }
+        }
+
+        // No progress was made, so either the next member is incomplete in
+        // `src` or it won't fit into `dst`. Read more input while there is
+        // room for it, otherwise enlarge the staging buffers.
+        if (!qz_cookie->eof && (src->offset > 0 || src->consumed < src->size)) {
+            size_t bytes_read = bufm_fill(src, qz_cookie->fp);
+            if (0 == bytes_read) {
+                if (ferror(qz_cookie->fp)) {
+                    QC_ERROR("qzip_cookie_read: failed to read input\n");
+                    return -1;
+                }
+                qz_cookie->eof = 1;
+            }
+            // Leave the seek index out
+            qz_cookie->c_pos += bytes_read;
+            if (qz_cookie->indexed && qz_cookie->c_pos >= qz_cookie->c_end) {
+                src->consumed -= qz_cookie->c_pos - qz_cookie->c_end;
+                qz_cookie->c_pos = qz_cookie->c_end;
+                qz_cookie->eof = 1;
+            }
+            continue;
+        }
+
+        if (src->consumed == src->offset) {
+            return 1;
+        }
+
+        // Once all the input is in, a member that doesn't decompress is cut
+        // short or corrupt, unless it merely didn't fit into `dst`
+        if ((qz_cookie->eof && rc != QZ_BUF_ERROR) ||
+            dst->size >= MAXDATA ||
+            bufm_grow(dst, dst->size * 2) ||
+            (!qz_cookie->eof && src->size < MAXDATA && bufm_grow(src, src->size * 2))) {
+            QC_ERROR("qzip_cookie_read: can't decompress member at input offset %llu\n",
+                     qz_cookie->c_pos - (src->consumed - src->offset));
+            return -1;
+        }
+    }
+}
+
+static ssize_t
+qzip_read_cookie_read(void *cookie, char *buf, size_t size)
+{
+    qzip_read_cookie_t *qz_cookie = (qzip_read_cookie_t *)cookie;
+    bufm_t *dst = &(qz_cookie->dst);
+    size_t copied = 0;
+    int rc;
+
+    QC_DEBUG("qzip_cookie_read: new buf at %p (%zu Bytes)\n", buf, size);
+
+    while (copied < size) {
+        if (dst->consumed > dst->offset) {
+            copied += bufm_drain(dst, buf + copied, size - copied);
+            continue;
+        }
+
+        rc = qzip_read_cookie_refill(qz_cookie);
+        if (rc > 0) {
+            break;
+        }
+        if (rc < 0) {
+            return (copied > 0) ? copied : -1;
+        }
+    }
+    qz_cookie->u_pos += copied;
+
+    return copied;
+}
+
+// Restart decompression at a member `c_off` bytes into the stream, which
+// holds uncompressed offset `u_off`
+static int
+qzip_read_cookie_jump(qzip_read_cookie_t *qz_cookie, unsigned long long c_off,
+                      unsigned long long u_off)
+{
+    if (qz_cookie->base < 0 ||
+        fseeko(qz_cookie->fp, qz_cookie->base + c_off, SEEK_SET) != 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    qz_cookie->src.offset = qz_cookie->src.consumed = 0;
+    qz_cookie->dst.offset = qz_cookie->dst.consumed = 0;
+    qz_cookie->eof = 0;
+    qz_cookie->c_pos = c_off;
+    qz_cookie->u_pos = u_off;
+
+    return 0;
+}
+
+// Seek to the closest indexed member, or to the start of the stream without
+// an index, then decompress and drop data up to `target`. Seeking forward
+// within reach of the current position only decompresses the gap.
+static int
+qzip_read_cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+    qzip_read_cookie_t *qz_cookie = (qzip_read_cookie_t *)cookie;
+    bufm_t *dst = &(qz_cookie->dst);
+    const qzip_index_entry_t *ent;
+    long long target;
+    size_t n;
+    int rc;
+
+    switch (whence) {
+        case SEEK_SET:
+            target = *offset;
+            break;
+        case SEEK_CUR:
+            target = qz_cookie->u_pos + *offset;
+            break;
+        case SEEK_END:
+            if (!qz_cookie->indexed) {
+                errno = EINVAL;
+                return -1;
+            }
+            target = qz_cookie->u_size + *offset;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    if (target < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ent = qzip_index_find(&(qz_cookie->index), target);
+    if ((unsigned long long)target < qz_cookie->u_pos ||
+        (NULL != ent && ent->u_off > qz_cookie->u_pos)) {
+        rc = (NULL != ent) ?
+             qzip_read_cookie_jump(qz_cookie, ent->c_off, ent->u_off) :
+             qzip_read_cookie_jump(qz_cookie, 0, 0);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+
+    while (qz_cookie->u_pos < (unsigned long long)target) {
+        if (dst->consumed > dst->offset) {
+            n = dst->consumed - dst->offset;
+            if (n > target - qz_cookie->u_pos) {
+                n = target - qz_cookie->u_pos;
+            }
+            dst->offset += n;
+            if (dst->offset == dst->consumed) {
+                dst->offset = dst->consumed = 0;
+            }
+            qz_cookie->u_pos += n;
+            continue;
+        }
+
+        rc = qzip_read_cookie_refill(qz_cookie);
+        if (rc > 0) {
+            break;      // Past the end, stay there
+        }
+        if (rc < 0) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    *offset = qz_cookie->u_pos;
+    return 0;
+}
+
+static int
+qzip_read_cookie_close(void *cookie)
+{
+    qzip_read_cookie_t *qz_cookie = (qzip_read_cookie_t *)cookie;
+    QzSession_T *qz_sess = qz_cookie->qz_sess;
+
+    qzip_registry_del(qz_cookie);
+    fclose(qz_cookie->fp);
+    bufm_destor(&(qz_cookie->src));
+    bufm_destor(&(qz_cookie->dst));
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_cookie->stats));
+    free(qz_cookie->index.ents);
+    free(qz_cookie);
+
+    return 0;
+}
+
+// Won't close the hooked file
+static int
+qzip_read_cookie_close2(void *cookie)
+{
+    qzip_read_cookie_t *qz_cookie = (qzip_read_cookie_t *)cookie;
+    QzSession_T *qz_sess = qz_cookie->qz_sess;
+
+    qzip_registry_del(qz_cookie);
+    bufm_destor(&(qz_cookie->src));
+    bufm_destor(&(qz_cookie->dst));
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_cookie->stats));
+    free(qz_cookie->index.ents);
+    free(qz_cookie);
+
+    return 0;
+}
+
+static void
+qzip_read_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    *stats = ((qzip_read_cookie_t *)cookie)->stats;
+}
+
+static cookie_io_functions_t qzip_read_funcs = {
+    .read  = qzip_read_cookie_read,
+    .seek  = qzip_read_cookie_seek,
+    .close = qzip_read_cookie_close
+};
+
+static cookie_io_functions_t qzip_read2_funcs = {
+    .read  = qzip_read_cookie_read,
+    .seek  = qzip_read_cookie_seek,
+    .close = qzip_read_cookie_close2
+};
+
+static FILE *
+qzip_read_hook(FILE *fp, const char *mode, cookie_io_functions_t funcs,
+               const qzip_params_t *params)
+{
+    qzip_read_cookie_t *qz_cookie =
+        (qzip_read_cookie_t *)calloc(1, sizeof(qzip_read_cookie_t));
+    assert(qz_cookie != NULL);
+
+    QzSessionParams_T *qz_sess_params = &(qz_cookie->qz_sess_params);
+    int rc;
+
+    rc = qzip_sess_params_setup(qz_sess_params, params, mode);
+    assert(0 == rc);
+    qz_cookie->qz_sess = qzip_sess_get(qz_sess_params);
+    assert(qz_cookie->qz_sess != NULL);
+
+    // Output is usually several times bigger than input, so give it more
+    // room to let one `qzDecompress` call go through many members.
+    rc = bufm_init(&(qz_cookie->src), HUGEPAGE);
+    if (0 == rc && 0 != (rc = bufm_init(&(qz_cookie->dst), 4 * HUGEPAGE))) {
+        bufm_destor(&(qz_cookie->src));
+    }
+    if (0 != rc) {
+        qzip_sess_put(qz_cookie->qz_sess);
+        free(qz_cookie);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    qz_cookie->fp = fp;
+
+    // Pick up the seek index of seekable output, if any
+    qz_cookie->base = ftello(fp);
+    if (qz_cookie->base >= 0 &&
+        0 == qzip_index_load(fp, qz_cookie->base, &(qz_cookie->index),
+                             &(qz_cookie->c_end), &(qz_cookie->u_size))) {
+        qz_cookie->indexed = 1;
+        QC_DEBUG("qzip_read_hook: %zu seek points\n", qz_cookie->index.len);
+    }
+
+    // Keep stdio's own buffer here: small reads like `fgets` are served
+    // from it, while big reads go straight to `qzip_read_cookie_read`.
+    FILE *cookie_fp = fopencookie(qz_cookie, mode, funcs);
+
+    rc = qzip_registry_add(cookie_fp, qz_cookie, NULL, qzip_read_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
+}
+// \end qzip read cookie
+
+// \begin qzip cookie
+typedef struct qzip_cookie_ qzip_cookie_t;
+
+struct qzip_cookie_ {
+    QzSession_T       *qz_sess;
+    QzSessionParams_T qz_sess_params;
+    bufm_t            agg;          // small-write aggregation, unused if buf is NULL
+    ssize_t           (*compress)(qzip_cookie_t *, const char *, size_t);
+    char              *src;         // pinned staging of input, NULL if unused
+    char              *dst;
+    unsigned int      dst_sz;
+    unsigned int      slice_sz;
+    int               pinned;
+    qzip_ring_t       *ring;        // NULL unless pipelined
+    qzip_sink_t       sink;
+    int               error;        // sticky, output was lost
+    qzip_cookie_stats_t stats;
+    qzip_index_t      *index;       // seek points, NULL unless seekable
+    int               passthrough;  // store incompressible chunks
+};
+
+// Each write is compressed `slice_sz` bytes at a time into a buffer owned by
+// the cookie. It is allocated once and sized from the bound of one slice, so
+// cookies never share output memory. With `pinned` set, input is staged in
+// pinned memory too, so neither side of `qzCompress` needs a bounce copy.
+static inline int
+qzip_cookie_init_dst(qzip_cookie_t *qz_cookie, int pinned)
+{
+    qz_cookie->slice_sz = MAXSLICE;
+    qz_cookie->dst_sz = qzMaxCompressedLength(qz_cookie->slice_sz);
+    qz_cookie->pinned = pinned;
+    qz_cookie->dst = (char *)qzip_mem_alloc(qz_cookie->dst_sz, pinned);
+    if (pinned) {
+        qz_cookie->src = (char *)qzip_mem_alloc(qz_cookie->slice_sz, pinned);
+    }
+
+    return (NULL == qz_cookie->dst || (pinned && NULL == qz_cookie->src)) ? 1 : 0;
+}
+
+// Pipelined cookies compress into a ring slot instead of `dst`. The slot is
+// handed over to the writer thread as soon as it's filled.
+static inline int
+qzip_cookie_init_ring(qzip_cookie_t *qz_cookie, unsigned int nslots, int pinned)
+{
+    qz_cookie->slice_sz = MAXSLICE;
+    qz_cookie->dst_sz = qzMaxCompressedLength(qz_cookie->slice_sz);
+    qz_cookie->pinned = pinned;
+    if (pinned) {
+        qz_cookie->src = (char *)qzip_mem_alloc(qz_cookie->slice_sz, pinned);
+        if (NULL == qz_cookie->src) {
+            return 1;
+        }
+    }
+    qz_cookie->ring = (qzip_ring_t *)calloc(1, sizeof(qzip_ring_t));
+    if (NULL == qz_cookie->ring) {
+        return 1;
+    }
+
+    // Slots are only reused once released, so they can be spliced into a
+    // pipe rather than copied
+    qz_cookie->sink.splice = qzip_sink_is_pipe(&(qz_cookie->sink));
+
+    if (0 != qzip_ring_init(qz_cookie->ring, nslots, qz_cookie->dst_sz, pinned,
+                            &(qz_cookie->sink))) {
+        free(qz_cookie->ring);
+        qz_cookie->ring = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+// The aggregation buffer is pinned along with the staging buffers, so that
+// batched input goes to `qzCompress` without another copy.
+static inline int
+qzip_cookie_init_agg(qzip_cookie_t *qz_cookie, unsigned int size)
+{
+    if (0 == size) {
+        return 0;
+    }
+
+    qz_cookie->agg.buf = (char *)qzip_mem_alloc(size, qz_cookie->pinned);
+    qz_cookie->agg.size = size;
+    qz_cookie->agg.consumed = 0;
+
+    return (NULL == qz_cookie->agg.buf) ? 1 : 0;
+}
+
+// Return where to compress `src_len` bytes at `src` from. Input is copied to
+// the pinned staging buffer unless it already lives in pinned memory.
+static inline const char *
+qzip_cookie_in_get(qzip_cookie_t *qz_cookie, const char *src, unsigned int src_len)
+{
+    if (NULL == qz_cookie->src || qzMemFindAddr((unsigned char *)src)) {
+        return src;
+    }
+
+    memcpy(qz_cookie->src, src, src_len);
+    return qz_cookie->src;
+}
+
+static inline char *
+qzip_cookie_out_get(qzip_cookie_t *qz_cookie)
+{
+    return (NULL == qz_cookie->ring) ?
+        qz_cookie->dst : qzip_ring_acquire(qz_cookie->ring);
+}
+
+static inline int
+qzip_cookie_out_put(qzip_cookie_t *qz_cookie, char *dst, unsigned int dst_len)
+{
+    if (NULL == qz_cookie->ring) {
+        return qzip_sink_write(&(qz_cookie->sink), dst, dst_len);
+    }
+
+    qzip_ring_commit(qz_cookie->ring, dst_len);
+    return 0;
+}
+
+// Return nonzero if the writer thread failed to write a slot
+static inline int
+qzip_cookie_out_destroy(qzip_cookie_t *qz_cookie)
+{
+    int error = 0;
+
+    if (NULL != qz_cookie->ring) {
+        error = qzip_ring_destroy(qz_cookie->ring);
+        free(qz_cookie->ring);
+    }
+    qzip_mem_free(qz_cookie->dst);
+    qzip_mem_free(qz_cookie->src);
+    qzip_mem_free(qz_cookie->agg.buf);
+    if (NULL != qz_cookie->index) {
+        free(qz_cookie->index->ents);
+        free(qz_cookie->index);
+    }
+
+    return error;
+}
+
+// Refer to QATzip/utils/qzip.c:doProcessFile
+static ssize_t
+qzip_cookie_compress(qzip_cookie_t *qz_cookie, const char *buf, size_t size)
+{
+    QzSession_T *qz_sess = qz_cookie->qz_sess;
+    const char *src = buf;
+    unsigned int slice_sz = qz_cookie->slice_sz;
+    unsigned int src_len = (size > slice_sz) ? slice_sz : size;
+    unsigned int dst_len = qz_cookie->dst_sz;
+    unsigned int done = 0;
+    size_t buf_processed = 0;
+    size_t buf_remaining = size;
+    unsigned int valid_dst_len = dst_len;
+    unsigned long long start, elapsed;
+    int rc = QZ_FAIL;
+
+    char *dst = NULL;
+
+    QC_DEBUG("qzip_cookie_write: new buf at %x (%d Bytes)\n", buf, size);
+
+    // Nothing written after a lost member could be decompressed anyway.
+    // Failures are short counts, glibc can't take -1 from an unbuffered
+    // cookie's fwrite.
+    if (qz_cookie->error) {
+        return 0;
+    }
+
+    while (!done) {
+        if (NULL == (dst = qzip_cookie_out_get(qz_cookie))) {
+            qz_cookie->error = 1;
+            break;
+        }
+        // Every call starts a new member, so it can be seeked to
+        if (NULL != qz_cookie->index) {
+            if (qzip_index_add(qz_cookie->index, qz_cookie->stats.bytes_in,
+                               qz_cookie->stats.bytes_out) != 0) {
+                QC_ERROR("qzip_cookie_write: failed to grow the seek index\n");
+                qz_cookie->error = 1;
+                break;
+            }
+        }
+        if (qz_cookie->passthrough &&
+            qzip_incompressible((const unsigned char *)src, src_len)) {
+            assert(qzip_stored_len(src_len) <= dst_len);
+            dst_len = qzip_store_member((unsigned char *)dst,
+                                        (const unsigned char *)src, src_len);
+            qzip_stats_store(&(qz_cookie->stats), src_len, dst_len);
+        } else {
+            start = qzip_now_ns();
+            rc = qzCompress(qz_sess, qzip_cookie_in_get(qz_cookie, src, src_len),
+                            &src_len, dst, &dst_len, 1);
+            elapsed = qzip_now_ns() - start;
+
+            if (rc != QZ_OK &&
+                rc != QZ_BUF_ERROR &&
+                rc != QZ_DATA_ERROR) {
+                QC_ERROR("qzip_cookie_write: failed with error: %d\n", rc);
+                QC_ERROR("qzip_cookie_write: src_len %d, dst_len %d\n", src_len, dst_len);
+                qz_cookie->error = 1;
+                break;
+            }
+
+            qzip_stats_add(&(qz_cookie->stats), qz_sess, &(qz_cookie->qz_sess_params),
+                           src_len, dst_len, elapsed);
+        }
+        if (qzip_cookie_out_put(qz_cookie, dst, dst_len) != 0) {
+            QC_ERROR("qzip_cookie_write: failed to write %u bytes\n", dst_len);
+            qz_cookie->error = 1;
+            break;
+        }
+
+        buf_processed += src_len;
+        buf_remaining -= src_len;
+        if (buf_remaining == 0) {
+            done = 1;
+        }
+        src += src_len;
+        src_len = (buf_remaining > slice_sz) ? slice_sz : buf_remaining;
+        dst_len = valid_dst_len;
+    }
+
+    return buf_processed;
+}
+
+// Compress whatever has been aggregated so far
+static int
+qzip_cookie_flush_agg(qzip_cookie_t *qz_cookie)
+{
+    bufm_t *agg = &(qz_cookie->agg);
+    size_t len = agg->consumed;
+
+    if (0 == len) {
+        return 0;
+    }
+
+    agg->consumed = 0;
+    return (qz_cookie->compress(qz_cookie, agg->buf, len) == (ssize_t)len) ? 0 : -1;
+}
+
+// Small writes are batched in `agg` and compressed once it's full, so a
+// stream of tiny writes costs one `qzCompress` and one gzip member per
+// aggregation buffer rather than per write. Writes that would fill the buffer
+// on their own skip it once it's empty.
+static ssize_t
+qzip_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
+    bufm_t *agg = &(qz_cookie->agg);
+    size_t buf_processed = 0;
+    size_t len;
+    ssize_t rc;
+
+    if (NULL == agg->buf) {
+        return qz_cookie->compress(qz_cookie, buf, size);
+    }
+
+    while (buf_processed < size) {
+        if (0 == agg->consumed && size - buf_processed >= agg->size) {
+            rc = qz_cookie->compress(qz_cookie, buf + buf_processed,
+                                     size - buf_processed);
+            return (rc < 0) ? rc : (ssize_t)(buf_processed + rc);
+        }
+
+        len = agg->size - agg->consumed;
+        if (len > size - buf_processed) {
+            len = size - buf_processed;
+        }
+        memcpy(agg->buf + agg->consumed, buf + buf_processed, len);
+        agg->consumed += len;
+        buf_processed += len;
+
+        if (agg->consumed == agg->size && qzip_cookie_flush_agg(qz_cookie) != 0) {
+            return buf_processed - len;
+        }
+    }
+
+    return buf_processed;
+}
+
+static void
+qzip_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    *stats = ((qzip_cookie_t *)cookie)->stats;
+}
+
+// Append the seek index and the tail pointing at it
+static int
+qzip_cookie_write_index(qzip_cookie_t *qz_cookie)
+{
+    qzip_index_t *idx = qz_cookie->index;
+    unsigned long long idx_off = qz_cookie->stats.bytes_out;
+    unsigned int len;
+    size_t from = 0, n;
+    char *dst;
+
+    do {
+        n = (idx->len - from > INDEX_PER_MEMBER) ? INDEX_PER_MEMBER : idx->len - from;
+        if (NULL == (dst = qzip_cookie_out_get(qz_cookie))) {
+            return -1;
+        }
+        len = qzip_index_encode((unsigned char *)dst, idx, from, n);
+        if (qzip_cookie_out_put(qz_cookie, dst, len) != 0) {
+            return -1;
+        }
+        qz_cookie->stats.bytes_out += len;
+        from += n;
+    } while (from < idx->len);
+
+    if (NULL == (dst = qzip_cookie_out_get(qz_cookie))) {
+        return -1;
+    }
+    len = qzip_index_tail((unsigned char *)dst, idx_off, idx->len,
+                          qz_cookie->stats.bytes_in);
+    if (qzip_cookie_out_put(qz_cookie, dst, len) != 0) {
+        return -1;
+    }
+    qz_cookie->stats.bytes_out += len;
+
+    return 0;
+}
+
+// Compress what is left over at close. A file that lost any of its output
+// doesn't get an index, which would point past what was written.
+static int
+qzip_cookie_finish(qzip_cookie_t *qz_cookie)
+{
+    char *dst;
+
+    if (qzip_cookie_flush_agg(qz_cookie) != 0 || qz_cookie->error) {
+        return -1;
+    }
+    if (0 == qz_cookie->stats.bytes_out) {
+        if (NULL == (dst = qzip_cookie_out_get(qz_cookie))) {
+            return -1;
+        }
+        memcpy(dst, gzip_empty_member, sizeof(gzip_empty_member));
+        if (qzip_cookie_out_put(qz_cookie, dst, sizeof(gzip_empty_member)) != 0) {
+            return -1;
+        }
+        qz_cookie->stats.bytes_out += sizeof(gzip_empty_member);
+    }
+    if (NULL != qz_cookie->index) {
+        return qzip_cookie_write_index(qz_cookie);
+    }
+
+    return 0;
+}
+
+// Called by `qzip_flush`: push aggregated input through the compressor and
+// wait until everything compressed so far has reached `fp`
+static int
+qzip_cookie_flush(void *cookie)
+{
+    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
+
+    if (qzip_cookie_flush_agg(qz_cookie) != 0) {
+        return -1;
+    }
+    if (NULL != qz_cookie->ring && qzip_ring_sync(qz_cookie->ring) != 0) {
+        return -1;
+    }
+
+    return qzip_sink_flush(&(qz_cookie->sink));
+}
+
+static int
+qzip_cookie_close(void *cookie)
+{
+    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
+    QzSession_T *qz_sess = qz_cookie->qz_sess;
+    int error;
+
+    qzip_registry_del(qz_cookie);
+    error = qzip_cookie_finish(qz_cookie);
+    // Wait for pending output before closing the file under it
+    error |= qzip_cookie_out_destroy(qz_cookie);
+    error |= qzip_sink_close(&(qz_cookie->sink), 1);
+    error |= qz_cookie->error;
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_cookie->stats));
+    free(qz_cookie);
+
+    return error ? EOF : 0;
+}
+
+// This API is used for pipe-like program where input/output file is
+// stdio/stdout seperatly.
+static int
+qzip_cookie_close2(void *cookie)
+{
+    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
+    QzSession_T *qz_sess = qz_cookie->qz_sess;
+    int error;
+
+    qzip_registry_del(qz_cookie);
+    error = qzip_cookie_finish(qz_cookie);
+    // Won't close stdout
+    error |= qzip_cookie_out_destroy(qz_cookie);
+    error |= qzip_sink_close(&(qz_cookie->sink), 0);
+    error |= qz_cookie->error;
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_cookie->stats));
+    free(qz_cookie);
+
+    return error ? EOF : 0;
+}
+
+static cookie_io_functions_t qzip_write_funcs = {
+    .write = qzip_cookie_write,
+    .close = qzip_cookie_close
+};
+
+
+static cookie_io_functions_t qzip_write2_funcs = {
+    .write = qzip_cookie_write,
+    .close = qzip_cookie_close2
+};
+
+// Set up a write-side cookie on top of `sink`. With `params->nslots` > 0,
+// compressed data is written out by a background thread through a ring of
+// that many buffers.
+static FILE *
+qzip_write_hook(const qzip_sink_t *sink, const char *mode, cookie_io_functions_t funcs,
+                const qzip_params_t *params)
+{
+    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)calloc(1, sizeof(qzip_cookie_t));
+    assert(qz_cookie != NULL);
+    int rc;
+
+    // \begin initialization and setup for QAT's compression service
+    QzSessionParams_T *qz_sess_params = &(qz_cookie->qz_sess_params);
+
+    // For simplicity, initializations and setup function calls are not required
+    // to obtain compression services. If the initialization and setup functions
+    // are not called before compression or decompression requests, then they
+    // will be called with default arguments from within the compression or
+    // decompression functions. This results in serveral legal calling scenarios,
+    // see QATzip/include/qatzip.h for more details. For better understanding,
+    // we use scenario 1 here, described blow.
+    //
+    // Scenario 1 - all functions explicilty invoked by caller, with all arguments
+    // provided
+    //
+    // qzInit(&sess_c, sw_backup);
+    // qzSetupSession(&sess_c, &params);
+    // qzCompress(&sess, src, &src_len, dest, &dest_len, 1);
+    // qzDecompress(&sess, src, &src_len, dest, &dest_len);
+    // qzTeardownSession(&sess);
+    // qzClose(&sess);
+    //
+    // The first two and last two calls are what makes opening a cookie
+    // expensive, so sessions are kept in a process-wide pool and only set up
+    // on a pool miss, see `qzip_sess_get`.
+
+    // Default parameters:
+    // - dynamic or static huffman headers: fully dynamic
+    // - compression or decompression: both
+    // - deflate, deflate with GZip or deflate with GZip ext: Gzip ext
+    // - Compression level 1..9: 1 that is twice faster than others and a little
+    //   compression ratio loss
+    // - Nanosleep between poll [0..100] (0 means no sleep): 10
+    // - Maximum forks permitted in current thread (0 means no forking permitted): 3
+    // - Use software as backup or not: yes
+    // - Default buffer size (power of 2 - 4K, 8K, 16K, 32K, 64K, 128K): 64KB
+    // - Stream buffer size (1K..2M-5K): 64KB
+    // - Default threshold of compression service's input size: 1KB. For SW
+    //   failover, if the size of input request less than the threshold, QATzip
+    //   will route the request to software.
+    // - req_cnt_thrshold (1..4): 4 as default
+    // - wait_cnt_thrshold: when previous try (call icp_sal_userStartProcess in qzInit)
+    //   failed, wait for specific number of call before retry device open. Default is 8.
+    //
+    // Level, buffer size, polling interval and SW threshold can be changed per
+    // cookie through `qzip_params_t` or a level digit in `mode`.
+    rc = qzip_sess_params_setup(qz_sess_params, params, mode);
+    assert(0 == rc);
+
+    qz_cookie->qz_sess = qzip_sess_get(qz_sess_params);
+    assert(qz_cookie->qz_sess != NULL);
+    // \end initialization and setup for QAT's compression service
+
+    qz_cookie->sink = *sink;
+    qz_cookie->sink.write_ns = &(qz_cookie->stats.write_ns);
+
+    qz_cookie->compress = qzip_cookie_compress;
+
+    int pinned = (NULL != params) ? params->pinned : 0;
+    rc = (NULL != params && params->nslots > 0) ?
+         qzip_cookie_init_ring(qz_cookie, params->nslots, pinned) :
+         qzip_cookie_init_dst(qz_cookie, pinned);
+    if (0 != rc) {
+        goto fail;
+    }
+
+    qz_cookie->passthrough = (NULL != params) ? params->passthrough : 0;
+
+    if (NULL != params && params->seekable) {
+        qz_cookie->index = (qzip_index_t *)calloc(1, sizeof(qzip_index_t));
+        if (NULL == qz_cookie->index) {
+            goto fail;
+        }
+    }
+
+    // Aggregate up to one hardware buffer by default
+    rc = qzip_cookie_init_agg(qz_cookie, (NULL != params) ?
+                              params->coalesce_sz : qz_sess_params->hw_buff_sz);
+    if (0 != rc) {
+        goto fail;
+    }
+
+    FILE *cookie_fp = fopencookie(qz_cookie, mode, funcs);
+
+    // Disable cookie_fp's stream buffer, writes are batched in `agg` instead
+    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
+    assert(0 == rc);
+
+    rc = qzip_registry_add(cookie_fp, qz_cookie, qzip_cookie_flush, qzip_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
+
+fail:
+    // Whatever was allocated goes, the sink is left to the caller
+    qzip_cookie_out_destroy(qz_cookie);
+    qzip_sess_put(qz_cookie->qz_sess);
+    free(qz_cookie);
+    errno = ENOMEM;
+    return NULL;
+}
+
+FILE *
+qzip_fopen_ex(const char *fname, const char *mode, const qzip_params_t *params)
+{
+    char fmode[16];
+    qzip_sink_t sink;
+
+    if (NULL != params && qzip_params_check(params) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    FILE *fp = fopen(fname, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+    if (NULL == fp) {
+        return NULL;
+    }
+
+    FILE *cookie_fp;
+    if (mode[0] == 'r') {
+        cookie_fp = qzip_read_hook(fp, mode, qzip_read_funcs, params);
+    } else {
+        qzip_sink_init_fp(&sink, fp);
+        cookie_fp = qzip_write_hook(&sink, mode, qzip_write_funcs, params);
+    }
+    if (NULL == cookie_fp) {
+        int err = errno;
+        fclose(fp);
+        errno = err;
+    }
+
+    return cookie_fp;
+}
+
+FILE *
+qzip_hook_ex(FILE *fp, const char *mode, const qzip_params_t *params)
+{
+    qzip_sink_t sink;
+
+    if (NULL != params && qzip_params_check(params) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (mode[0] == 'r') {
+        return qzip_read_hook(fp, mode, qzip_read2_funcs, params);
+    }
+
+    qzip_sink_init_fp(&sink, fp);
+    return qzip_write_hook(&sink, mode, qzip_write2_funcs, params);
+}
+
+FILE *
+qzip_fdopen_ex(int fd, const char *mode, const qzip_params_t *params)
+{
+    char fmode[16];
+    qzip_sink_t sink;
+
+    if (NULL != params && qzip_params_check(params) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (mode[0] == 'r') {
+        FILE *fp = fdopen(fd, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+        if (NULL == fp) {
+            return NULL;
+        }
+        FILE *cookie_fp = qzip_read_hook(fp, mode, qzip_read_funcs, params);
+        if (NULL == cookie_fp) {
+            // Drop `fp` but keep `fd` open, as fdopen does when it fails
+            int err = errno;
+            int keep = dup(fd);
+            fclose(fp);
+            if (keep >= 0) {
+                dup2(keep, fd);
+                close(keep);
+            }
+            errno = err;
+        }
+        return cookie_fp;
+    }
+
+    if (0 != qzip_sink_init_fd(&sink, fd, (NULL != params) ? params->direct : 0,
+                               (NULL != params) ? params->uring : 0)) {
+        return NULL;
+    }
+    FILE *cookie_fp = qzip_write_hook(&sink, mode, qzip_write_funcs, params);
+    if (NULL == cookie_fp) {
+        // Release the sink's buffers but leave `fd` open, as fdopen does
+        int err = errno;
+        qzip_sink_close(&sink, 0);
+        errno = err;
+    }
+
+    return cookie_fp;
+}
+
+FILE *
+qzip_fopen(const char *fname, const char *mode)
+{
+    FILE *cookie_fp = qzip_fopen_ex(fname, mode, NULL);
+    assert(cookie_fp != NULL);
+
+    return cookie_fp;
+}
+
+FILE *
+qzip_hook(FILE *fp, const char *mode)
+{
+    return qzip_hook_ex(fp, mode, NULL);
+}
+
+FILE *
+qzip_fopen_async(const char *fname, const char *mode, unsigned int nslots)
+{
+    qzip_params_t params;
+    int rc = qzip_params_init(&params);
+    assert(0 == rc);
+    params.nslots = nslots;
+
+    return qzip_fopen_ex(fname, mode, &params);
+}
+
+FILE *
+qzip_hook_async(FILE *fp, const char *mode, unsigned int nslots)
+{
+    qzip_params_t params;
+    int rc = qzip_params_init(&params);
+    assert(0 == rc);
+    params.nslots = nslots;
+
+    return qzip_hook_ex(fp, mode, &params);
+}
+
+static cookie_io_functions_t my_qzip_writes_funcs = {
+    .write = qzip_cookie_write,
+    .close = qzip_cookie_close2
+};
+
+FILE *
+my_qzip_hook(FILE *fp, const char *mode)
+{
+    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)calloc(1, sizeof(qzip_cookie_t));
+    QzSessionParams_T *qz_sess_params = &(qz_cookie->qz_sess_params);
+    int rc;
+
+    rc = qzip_sess_params_setup(qz_sess_params, NULL, mode);
+    assert(0 == rc);
+    qz_cookie->qz_sess = qzip_sess_get(qz_sess_params);
+    assert(qz_cookie->qz_sess != NULL);
+    // Both sides of `qzCompress` are staged in pinned memory
+    rc = qzip_cookie_init_dst(qz_cookie, 1);
+    assert(0 == rc);
+    rc = qzip_cookie_init_agg(qz_cookie, qz_sess_params->hw_buff_sz);
+    assert(0 == rc);
+
+    qzip_sink_init_fp(&(qz_cookie->sink), fp);
+    qz_cookie->sink.write_ns = &(qz_cookie->stats.write_ns);
+    qz_cookie->compress = qzip_cookie_compress;
+
+    FILE *cookie_fp = fopencookie(qz_cookie, mode, my_qzip_writes_funcs);
+
+    // Disable cookie_fp's stream buffer
+    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
+    assert(0 == rc);
+
+    rc = qzip_registry_add(cookie_fp, qz_cookie, qzip_cookie_flush, qzip_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
+}
+// \end qzip cookie
+
+// \begin qzip parallel cookie
+// Incoming data is cut into `block_sz` blocks which are compressed by a pool
+// of worker threads, each one owning a QAT session. Blocks are numbered as
+// they are filled and a writer thread emits them strictly in that order, so
+// the output is still a valid multi-member gzip stream.
+//
+// Hybrid cookies add a second pool of threads compressing with zlib. Each
+// block is routed when submitted to the path expected to finish it first:
+// the path's recent cost per byte, kept as a moving average, times the
+// rounds of work queued ahead of the block on that path. A path that hasn't
+// been picked for PROBE_EVERY blocks gets the next one if it's idle, so its
+// estimate doesn't go stale once the other path wins.
+#define PARBLOCK    (1024*1024)
+#define PROBE_EVERY 16
+
+enum {
+    PATH_HW = 0,    // QAT session
+    PATH_SW,        // zlib
+    NPATHS
+};
+
+enum {
+    JOB_FREE = 0,   // owned by the producer, being filled
+    JOB_READY,      // waiting for a worker
+    JOB_BUSY,       // being compressed
+    JOB_DONE        // waiting for the writer
+};
+
+typedef struct {
+    char              *in;
+    unsigned int      in_len;
+    char              *out;
+    unsigned int      out_len;
+    int               state;
+    int               path;
+} qzip_job_t;
+
+struct qzip_parallel_cookie_;
+
+typedef struct {
+    int                          path;
+    QzSession_T                  *qz_sess;      // PATH_HW only
+    QzSessionParams_T            qz_sess_params;
+    z_stream                     strm;          // PATH_SW only
+    pthread_t                    thread;
+    struct qzip_parallel_cookie_ *owner;
+} qzip_worker_t;
+
+typedef struct qzip_parallel_cookie_ {
+    qzip_worker_t     *workers;
+    unsigned int      nworkers;
+    qzip_job_t        *jobs;
+    unsigned int      njobs;
+    unsigned int      block_sz;
+    unsigned int      fill_len;     // bytes in the block being filled
+    unsigned long     next_fill;    // sequence of the block being filled
+    unsigned long     next_comp[NPATHS];  // no ready block of the path before this
+    unsigned long     next_write;   // sequence of the next block to write out
+    unsigned int      npath[NPATHS];      // workers per path
+    unsigned int      pending[NPATHS];    // blocks routed but not compressed yet
+    double            ns_per_byte[NPATHS];  // moving average, 0 until measured
+    unsigned long     last_pick[NPATHS];  // sequence last routed to the path
+    unsigned int      hw_delay_us;
+    int               stop;
+    int               error;
+    pthread_mutex_t   lock;
+    pthread_cond_t    job_ready;    // producer -> workers
+    pthread_cond_t    job_done;     // workers -> writer
+    pthread_cond_t    job_free;     // writer -> producer
+    pthread_t         writer;
+    FILE              *fp;
+    qzip_cookie_stats_t stats;      // counters under `lock`, histograms lock-free
+} qzip_parallel_cookie_t;
+
+#define JOB_OF(qz_cookie, seq) (&((qz_cookie)->jobs[(seq) % (qz_cookie)->njobs]))
+
+// Oldest block waiting for `path`, or NULL. Called under `lock`.
+static qzip_job_t *
+qzip_parallel_next(qzip_parallel_cookie_t *qz_cookie, int path)
+{
+    unsigned long seq;
+    qzip_job_t *job;
+
+    for (seq = qz_cookie->next_comp[path]; seq < qz_cookie->next_fill; seq++) {
+        job = JOB_OF(qz_cookie, seq);
+        if (JOB_READY == job->state && path == job->path) {
+            qz_cookie->next_comp[path] = seq + 1;
+            return job;
+        }
+    }
+    qz_cookie->next_comp[path] = seq;
+
+    return NULL;
+}
+
+// Pick the path for block `seq` of `len` bytes. Called under `lock`.
+static int
+qzip_parallel_route(qzip_parallel_cookie_t *qz_cookie, unsigned long seq, unsigned int len)
+{
+    double cost, best_cost = 0;
+    int path, best = -1;
+
+    for (path = 0; path < NPATHS; path++) {
+        unsigned int nw = qz_cookie->npath[path];
+        if (0 == nw) {
+            continue;
+        }
+
+        // Unmeasured and stale paths get a block as soon as they are idle
+        if (qz_cookie->pending[path] < nw &&
+            (0 == qz_cookie->ns_per_byte[path] ||
+             seq - qz_cookie->last_pick[path] >= PROBE_EVERY)) {
+            best = path;
+            break;
+        }
+
+        cost = (qz_cookie->pending[path] / nw + 1) * qz_cookie->ns_per_byte[path] * len;
+        if (0 == qz_cookie->ns_per_byte[path]) {
+            continue;   // busy and unmeasured, can't tell
+        }
+        if (best < 0 || cost < best_cost) {
+            best = path;
+            best_cost = cost;
+        }
+    }
+    if (best < 0) {
+        best = (qz_cookie->npath[PATH_HW] > 0) ? PATH_HW : PATH_SW;
+    }
+
+    qz_cookie->pending[best]++;
+    qz_cookie->last_pick[best] = seq;
+    return best;
+}
+
+// One gzip member per block, as `qzCompress` does
+static int
+qzip_parallel_deflate(qzip_worker_t *worker, qzip_job_t *job, unsigned int *dst_len)
+{
+    z_stream *strm = &(worker->strm);
+
+    if (Z_OK != deflateReset(strm)) {
+        return -1;
+    }
+    strm->next_in = (unsigned char *)job->in;
+    strm->avail_in = job->in_len;
+    strm->next_out = (unsigned char *)job->out;
+    strm->avail_out = *dst_len;
+    if (Z_STREAM_END != deflate(strm, Z_FINISH)) {
+        return -1;
+    }
+    *dst_len = strm->total_out;
+
+    return 0;
+}
+
+static void *
+qzip_parallel_worker(void *arg)
+{
+    qzip_worker_t *worker = (qzip_worker_t *)arg;
+    qzip_parallel_cookie_t *qz_cookie = worker->owner;
+    qzip_job_t *job;
+    unsigned int src_len, dst_len;
+    unsigned long long start, elapsed;
+    int rc;
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    while (1) {
+        while (NULL == (job = qzip_parallel_next(qz_cookie, worker->path)) &&
+               !qz_cookie->stop) {
+            pthread_cond_wait(&qz_cookie->job_ready, &qz_cookie->lock);
+        }
+        if (NULL == job) {
+            break;
+        }
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock(&qz_cookie->lock);
+
+        src_len = job->in_len;
+        dst_len = qzMaxCompressedLength(qz_cookie->block_sz);
+        start = qzip_now_ns();
+        if (PATH_SW == worker->path) {
+            rc = (0 == qzip_parallel_deflate(worker, job, &dst_len)) ? QZ_OK : QZ_FAIL;
+        } else {
+            if (qz_cookie->hw_delay_us > 0) {
+                usleep(qz_cookie->hw_delay_us);
+            }
+            rc = qzCompress(worker->qz_sess, job->in, &src_len, job->out, &dst_len, 1);
+        }
+        elapsed = qzip_now_ns() - start;
+        if (rc != QZ_OK || src_len != job->in_len) {
+            QC_ERROR("qzip_parallel_worker: failed with error: %d\n", rc);
+            QC_ERROR("qzip_parallel_worker: src_len %d of %d, dst_len %d\n",
+                     src_len, job->in_len, dst_len);
+        }
+
+        pthread_mutex_lock(&qz_cookie->lock);
+        if (rc != QZ_OK || src_len != job->in_len) {
+            qz_cookie->error = 1;
+            dst_len = 0;
+        } else {
+            double *avg = &(qz_cookie->ns_per_byte[worker->path]);
+            double sample = (double)elapsed / (src_len > 0 ? src_len : 1);
+            *avg = (0 == *avg) ? sample : (3 * *avg + sample) / 4;
+
+            qzip_stats_add(&(qz_cookie->stats), worker->qz_sess, &(worker->qz_sess_params),
+                           src_len, dst_len, elapsed);
+            if (PATH_SW == worker->path) {
+                qz_cookie->stats.route_sw_bytes += src_len;
+            } else {
+                qz_cookie->stats.route_hw_bytes += src_len;
+            }
+        }
+        qz_cookie->pending[worker->path]--;
+        job->out_len = dst_len;
+        job->state = JOB_DONE;
+        pthread_cond_signal(&qz_cookie->job_done);
+    }
+    pthread_mutex_unlock(&qz_cookie->lock);
+
+    return NULL;
+}
+
+static void *
+qzip_parallel_writer(void *arg)
+{
+    qzip_parallel_cookie_t *qz_cookie = (qzip_parallel_cookie_t *)arg;
+    qzip_job_t *job;
+    size_t bytes_written;
+    unsigned long long start;
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    while (1) {
+        job = JOB_OF(qz_cookie, qz_cookie->next_write);
+        while (job->state != JOB_DONE &&
+               !(qz_cookie->stop && qz_cookie->next_write == qz_cookie->next_fill)) {
+            pthread_cond_wait(&qz_cookie->job_done, &qz_cookie->lock);
+        }
+        if (job->state != JOB_DONE) {
+            break;
+        }
+        pthread_mutex_unlock(&qz_cookie->lock);
+
+        start = qzip_now_ns();
+        bytes_written = fwrite(job->out, 1, job->out_len, qz_cookie->fp);
+        qzip_hist_record(&(qz_cookie->stats.write_ns), qzip_now_ns() - start);
+
+        pthread_mutex_lock(&qz_cookie->lock);
+        if (bytes_written != job->out_len) {
+            QC_ERROR("qzip_parallel_writer: short write (%zu of %u)\n",
+                     bytes_written, job->out_len);
+            qz_cookie->error = 1;
+        }
+        job->state = JOB_FREE;
+        qz_cookie->next_write++;
+        pthread_cond_signal(&qz_cookie->job_free);
+    }
+    pthread_mutex_unlock(&qz_cookie->lock);
+
+    return NULL;
+}
+
+// Hand the block being filled over to the workers
+static inline void
+qzip_parallel_submit(qzip_parallel_cookie_t *qz_cookie)
+{
+    qzip_job_t *job = JOB_OF(qz_cookie, qz_cookie->next_fill);
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    job->in_len = qz_cookie->fill_len;
+    job->path = qzip_parallel_route(qz_cookie, qz_cookie->next_fill, job->in_len);
+    job->state = JOB_READY;
+    qz_cookie->fill_len = 0;
+    qz_cookie->next_fill++;
+    // Workers of both paths wait here
+    pthread_cond_broadcast(&qz_cookie->job_ready);
+    pthread_mutex_unlock(&qz_cookie->lock);
+}
+
+static ssize_t
+qzip_parallel_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    qzip_parallel_cookie_t *qz_cookie = (qzip_parallel_cookie_t *)cookie;
+    qzip_job_t *job;
+    size_t consumed = 0;
+    unsigned int n;
+
+    QC_DEBUG("qzip_parallel_cookie_write: new buf (%zu)\n", size);
+
+    while (consumed < size) {
+        job = JOB_OF(qz_cookie, qz_cookie->next_fill);
+
+        // Only the slot's first fill may have to wait for the writer
+        if (0 == qz_cookie->fill_len) {
+            pthread_mutex_lock(&qz_cookie->lock);
+            while (job->state != JOB_FREE && !qz_cookie->error) {
+                pthread_cond_wait(&qz_cookie->job_free, &qz_cookie->lock);
+            }
+            pthread_mutex_unlock(&qz_cookie->lock);
+        }
+        if (qz_cookie->error) {
+            break;
+        }
+
+        n = qz_cookie->block_sz - qz_cookie->fill_len;
+        n = (size - consumed < n) ? (size - consumed) : n;
+        memcpy(job->in + qz_cookie->fill_len, buf + consumed, n);
+        qz_cookie->fill_len += n;
+        consumed += n;
+
+        if (qz_cookie->fill_len == qz_cookie->block_sz) {
+            qzip_parallel_submit(qz_cookie);
+        }
+    }
+
+    return consumed;
+}
+
+static int
+qzip_parallel_cookie_release(qzip_parallel_cookie_t *qz_cookie)
+{
+    unsigned int i;
+    int error;
+
+    qzip_registry_del(qz_cookie);
+
+    // Submit the last partial block then let the pool run dry
+    if (qz_cookie->fill_len > 0) {
+        qzip_parallel_submit(qz_cookie);
+    }
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    qz_cookie->stop = 1;
+    pthread_cond_broadcast(&qz_cookie->job_ready);
+    pthread_cond_broadcast(&qz_cookie->job_done);
+    pthread_mutex_unlock(&qz_cookie->lock);
+
+    for (i = 0; i < qz_cookie->nworkers; i++) {
+        pthread_join(qz_cookie->workers[i].thread, NULL);
+    }
+    pthread_join(qz_cookie->writer, NULL);
+
+    if (0 == qz_cookie->stats.bytes_out) {
+        fwrite(gzip_empty_member, 1, sizeof(gzip_empty_member), qz_cookie->fp);
+        qz_cookie->stats.bytes_out += sizeof(gzip_empty_member);
+    }
+
+    for (i = 0; i < qz_cookie->nworkers; i++) {
+        if (PATH_SW == qz_cookie->workers[i].path) {
+            deflateEnd(&(qz_cookie->workers[i].strm));
+        } else {
+            qzip_sess_put(qz_cookie->workers[i].qz_sess);
+        }
+    }
+    for (i = 0; i < qz_cookie->njobs; i++) {
+        free(qz_cookie->jobs[i].in);
+        free(qz_cookie->jobs[i].out);
+    }
+    free(qz_cookie->workers);
+    free(qz_cookie->jobs);
+
+    pthread_mutex_destroy(&qz_cookie->lock);
+    pthread_cond_destroy(&qz_cookie->job_ready);
+    pthread_cond_destroy(&qz_cookie->job_done);
+    pthread_cond_destroy(&qz_cookie->job_free);
+
+    error = qz_cookie->error;
+    qzip_stats_retire(&(qz_cookie->stats));
+    free(qz_cookie);
+
+    return error ? EOF : 0;
+}
+
+static int
+qzip_parallel_cookie_close(void *cookie)
+{
+    qzip_parallel_cookie_t *qz_cookie = (qzip_parallel_cookie_t *)cookie;
+    FILE *fp = qz_cookie->fp;
+    int rc = qzip_parallel_cookie_release(qz_cookie);
+
+    fclose(fp);
+
+    return rc;
+}
+
+// Won't close the hooked file
+static int
+qzip_parallel_cookie_close2(void *cookie)
+{
+    return qzip_parallel_cookie_release((qzip_parallel_cookie_t *)cookie);
+}
+
+static void
+qzip_parallel_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    qzip_parallel_cookie_t *qz_cookie = (qzip_parallel_cookie_t *)cookie;
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    *stats = qz_cookie->stats;
+    pthread_mutex_unlock(&qz_cookie->lock);
+}
+
+static cookie_io_functions_t qzip_parallel_write_funcs = {
+    .write = qzip_parallel_cookie_write,
+    .close = qzip_parallel_cookie_close
+};
+
+static cookie_io_functions_t qzip_parallel_write2_funcs = {
+    .write = qzip_parallel_cookie_write,
+    .close = qzip_parallel_cookie_close2
+};
+
+static FILE *
+qzip_parallel_write_hook(FILE *fp, const char *mode, cookie_io_functions_t funcs,
+                         const qzip_hybrid_params_t *params)
+{
+    qzip_parallel_cookie_t *qz_cookie =
+        (qzip_parallel_cookie_t *)calloc(1, sizeof(qzip_parallel_cookie_t));
+    assert(qz_cookie != NULL);
+    unsigned int i, nworkers;
+    int rc;
+
+    qz_cookie->npath[PATH_HW] = params->nhw;
+    qz_cookie->npath[PATH_SW] = params->nsw;
+    if (0 == params->nhw + params->nsw) {
+        qz_cookie->npath[PATH_HW] = 1;
+    }
+    nworkers = qz_cookie->npath[PATH_HW] + qz_cookie->npath[PATH_SW];
+
+    qz_cookie->fp = fp;
+    qz_cookie->nworkers = nworkers;
+    qz_cookie->block_sz = PARBLOCK;
+    qz_cookie->hw_delay_us = params->hw_delay_us;
+    // Two blocks in flight per worker keeps every worker busy while the
+    // writer is catching up with the oldest block
+    qz_cookie->njobs = 2 * nworkers + 1;
+    pthread_mutex_init(&qz_cookie->lock, NULL);
+    pthread_cond_init(&qz_cookie->job_ready, NULL);
+    pthread_cond_init(&qz_cookie->job_done, NULL);
+    pthread_cond_init(&qz_cookie->job_free, NULL);
+
+    qz_cookie->jobs = (qzip_job_t *)calloc(qz_cookie->njobs, sizeof(qzip_job_t));
+    assert(qz_cookie->jobs != NULL);
+    for (i = 0; i < qz_cookie->njobs; i++) {
+        qz_cookie->jobs[i].in = (char *)malloc(qz_cookie->block_sz);
+        qz_cookie->jobs[i].out = (char *)malloc(qzMaxCompressedLength(qz_cookie->block_sz));
+        assert(qz_cookie->jobs[i].in != NULL && qz_cookie->jobs[i].out != NULL);
+    }
+
+    qz_cookie->workers = (qzip_worker_t *)calloc(nworkers, sizeof(qzip_worker_t));
+    assert(qz_cookie->workers != NULL);
+    for (i = 0; i < nworkers; i++) {
+        qzip_worker_t *worker = &(qz_cookie->workers[i]);
+
+        // Software workers only borrow the level from the session parameters
+        rc = qzip_sess_params_setup(&(worker->qz_sess_params), NULL, mode);
+        assert(0 == rc);
+        worker->path = (i < qz_cookie->npath[PATH_HW]) ? PATH_HW : PATH_SW;
+        if (PATH_HW == worker->path) {
+            worker->qz_sess = qzip_sess_get(&(worker->qz_sess_params));
+            assert(worker->qz_sess != NULL);
+        } else {
+            rc = deflateInit2(&(worker->strm), worker->qz_sess_params.comp_lvl, Z_DEFLATED,
+                              MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+            assert(Z_OK == rc);
+        }
+
+        worker->owner = qz_cookie;
+        rc = pthread_create(&(worker->thread), NULL, qzip_parallel_worker, worker);
+        assert(0 == rc);
+    }
+
+    rc = pthread_create(&qz_cookie->writer, NULL, qzip_parallel_writer, qz_cookie);
+    assert(0 == rc);
+
+    FILE *cookie_fp = fopencookie(qz_cookie, mode, funcs);
+
+    // Blocks are assembled by the cookie itself
+    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
+    assert(0 == rc);
+
+    rc = qzip_registry_add(cookie_fp, qz_cookie, NULL, qzip_parallel_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
+}
+
+// Reading falls back to the single-session read cookie
+FILE *
+qzip_hybrid_fopen(const char *fname, const char *mode, const qzip_hybrid_params_t *params)
+{
+    char fmode[16];
+    FILE *fp = fopen(fname, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+    assert(fp != NULL);
+
+    if (mode[0] == 'r') {
+        return qzip_read_hook(fp, mode, qzip_read_funcs, NULL);
+    }
+
+    return qzip_parallel_write_hook(fp, mode, qzip_parallel_write_funcs, params);
+}
+
+FILE *
+qzip_hybrid_hook(FILE *fp, const char *mode, const qzip_hybrid_params_t *params)
+{
+    if (mode[0] == 'r') {
+        return qzip_read_hook(fp, mode, qzip_read2_funcs, NULL);
+    }
+
+    return qzip_parallel_write_hook(fp, mode, qzip_parallel_write2_funcs, params);
+}
+
+FILE *
+qzip_parallel_fopen(const char *fname, const char *mode, unsigned int nworkers)
+{
+    qzip_hybrid_params_t params = { nworkers, 0, 0 };
+
+    return qzip_hybrid_fopen(fname, mode, &params);
+}
+
+FILE *
+qzip_parallel_hook(FILE *fp, const char *mode, unsigned int nworkers)
+{
+    qzip_hybrid_params_t params = { nworkers, 0, 0 };
+
+    return qzip_hybrid_hook(fp, mode, &params);
+}
+// \end qzip parallel cookie
+
+// \begin gzip parallel cookie
+// Software counterpart of the parallel cookie, after pigz. Blocks are raw
+// deflated by a pool of zlib workers, each primed with the last 32 KB of
+// the block before it so the ratio barely suffers, and ended with a sync
+// flush so they can be concatenated. A writer thread emits them in order
+// inside a single gzip member, combining the CRCs of the blocks as it goes.
+#define GZBLOCK (128*1024)
+#define GZDICT  (32*1024)
+
+static const unsigned char gzip_header[10] = {
+    0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+};
+
+typedef struct {
+    char              *in;
+    unsigned int      in_len;
+    char              *dict;        // tail of the previous block
+    unsigned int      dict_len;
+    char              *out;
+    unsigned int      out_len;
+    unsigned long     crc;          // of `in`
+    int               state;
+} gzip_job_t;
+
+struct gzip_parallel_cookie_;
+
+typedef struct {
+    z_stream                     strm;
+    pthread_t                    thread;
+    struct gzip_parallel_cookie_ *owner;
+} gzip_worker_t;
+
+typedef struct gzip_parallel_cookie_ {
+    gzip_worker_t     *workers;
+    unsigned int      nworkers;
+    gzip_job_t        *jobs;
+    unsigned int      njobs;
+    unsigned int      block_sz;
+    unsigned int      out_sz;       // room for a block that doesn't compress
+    unsigned int      fill_len;     // bytes in the block being filled
+    unsigned long     next_fill;    // sequence of the block being filled
+    unsigned long     next_comp;    // sequence of the next block to compress
+    unsigned long     next_write;   // sequence of the next block to write out
+    unsigned long     crc;          // of everything written so far
+    unsigned long     total;        // bytes in, modulo 2^32 in the trailer
+    int               level;
+    int               stop;
+    int               error;
+    pthread_mutex_t   lock;
+    pthread_cond_t    job_ready;    // producer -> workers
+    pthread_cond_t    job_done;     // workers -> writer
+    pthread_cond_t    job_free;     // writer -> producer
+    pthread_t         writer;
+    FILE              *fp;
+    qzip_cookie_stats_t stats;      // counters under `lock`, histograms lock-free
+} gzip_parallel_cookie_t;
+
+static int
+gzip_parallel_deflate(gzip_worker_t *worker, gzip_job_t *job, unsigned int out_sz)
+{
+    z_stream *strm = &(worker->strm);
+
+    if (Z_OK != deflateReset(strm)) {
+        return -1;
+    }
+    if (job->dict_len > 0 &&
+        Z_OK != deflateSetDictionary(strm, (unsigned char *)job->dict, job->dict_len)) {
+        return -1;
+    }
+    strm->next_in = (unsigned char *)job->in;
+    strm->avail_in = job->in_len;
+    strm->next_out = (unsigned char *)job->out;
+    strm->avail_out = out_sz;
+    // Room left over means the flush is complete
+    if (Z_OK != deflate(strm, Z_SYNC_FLUSH) || strm->avail_in > 0 || 0 == strm->avail_out) {
+        return -1;
+    }
+    job->out_len = out_sz - strm->avail_out;
+    job->crc = qzip_crc32(0, job->in, job->in_len);
+
+    return 0;
+}
+
+static void *
+gzip_parallel_worker(void *arg)
+{
+    gzip_worker_t *worker = (gzip_worker_t *)arg;
+    gzip_parallel_cookie_t *gz_cookie = worker->owner;
+    gzip_job_t *job;
+    unsigned long long start, elapsed;
+    int rc;
+
+    pthread_mutex_lock(&gz_cookie->lock);
+    while (1) {
+        while (gz_cookie->next_comp == gz_cookie->next_fill && !gz_cookie->stop) {
+            pthread_cond_wait(&gz_cookie->job_ready, &gz_cookie->lock);
+        }
+        if (gz_cookie->next_comp == gz_cookie->next_fill) {
+            break;
+        }
+        job = JOB_OF(gz_cookie, gz_cookie->next_comp);
+        gz_cookie->next_comp++;
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock(&gz_cookie->lock);
+
+        start = qzip_now_ns();
+        rc = gzip_parallel_deflate(worker, job, gz_cookie->out_sz);
+        elapsed = qzip_now_ns() - start;
+        if (rc != 0) {
+            QC_ERROR("gzip_parallel_worker: deflate failed (%s)\n",
+                     worker->strm.msg ? worker->strm.msg : "no room");
+        }
+
+        pthread_mutex_lock(&gz_cookie->lock);
+        if (rc != 0) {
+            gz_cookie->error = 1;
+            job->out_len = 0;
+        } else {
+            qzip_stats_add(&(gz_cookie->stats), NULL, NULL, job->in_len, job->out_len, elapsed);
+        }
+        job->state = JOB_DONE;
+        pthread_cond_signal(&gz_cookie->job_done);
+    }
+    pthread_mutex_unlock(&gz_cookie->lock);
+
+    return NULL;
+}
+
+static int
+gzip_parallel_emit(gzip_parallel_cookie_t *gz_cookie, const void *buf, size_t len)
+{
+    unsigned long long start = qzip_now_ns();
+    size_t bytes_written = fwrite(buf, 1, len, gz_cookie->fp);
+    qzip_hist_record(&(gz_cookie->stats.write_ns), qzip_now_ns() - start);
+
+    if (bytes_written != len) {
+        QC_ERROR("gzip_parallel_emit: short write (%zu of %zu)\n", bytes_written, len);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *
+gzip_parallel_writer(void *arg)
+{
+    gzip_parallel_cookie_t *gz_cookie = (gzip_parallel_cookie_t *)arg;
+    gzip_job_t *job;
+    int failed;
+    int rc = gzip_parallel_emit(gz_cookie, gzip_header, sizeof(gzip_header));
+
+    pthread_mutex_lock(&gz_cookie->lock);
+    gz_cookie->error |= (rc != 0);
+    while (1) {
+        job = JOB_OF(gz_cookie, gz_cookie->next_write);
+        while (job->state != JOB_DONE &&
+               !(gz_cookie->stop && gz_cookie->next_write == gz_cookie->next_fill)) {
+            pthread_cond_wait(&gz_cookie->job_done, &gz_cookie->lock);
+        }
+        if (job->state != JOB_DONE) {
+            break;
+        }
+        failed = gz_cookie->error;
+        pthread_mutex_unlock(&gz_cookie->lock);
+
+        // Nothing after a lost block can be decoded, so only recycle the job
+        rc = failed ? 0 : gzip_parallel_emit(gz_cookie, job->out, job->out_len);
+        gz_cookie->crc = qzip_crc32_combine(gz_cookie->crc, job->crc, job->in_len);
+        gz_cookie->total += job->in_len;
+
+        pthread_mutex_lock(&gz_cookie->lock);
+        gz_cookie->error |= (rc != 0);
+        job->state = JOB_FREE;
+        gz_cookie->next_write++;
+        pthread_cond_signal(&gz_cookie->job_free);
+    }
+    pthread_mutex_unlock(&gz_cookie->lock);
+
+    return NULL;
+}
+
+// Hand the block being filled over to the workers
+static inline void
+gzip_parallel_submit(gzip_parallel_cookie_t *gz_cookie)
+{
+    gzip_job_t *job = JOB_OF(gz_cookie, gz_cookie->next_fill);
+    gzip_job_t *prev;
+
+    // The previous slot may be refilled as soon as its block is written,
+    // which can be before this one is compressed, hence the copy
+    job->dict_len = 0;
+    if (gz_cookie->next_fill > 0) {
+        prev = JOB_OF(gz_cookie, gz_cookie->next_fill - 1);
+        job->dict_len = (prev->in_len < GZDICT) ? prev->in_len : GZDICT;
+        memcpy(job->dict, prev->in + prev->in_len - job->dict_len, job->dict_len);
+    }
+
+    pthread_mutex_lock(&gz_cookie->lock);
+    job->in_len = gz_cookie->fill_len;
+    job->state = JOB_READY;
+    gz_cookie->fill_len = 0;
+    gz_cookie->next_fill++;
+    pthread_cond_signal(&gz_cookie->job_ready);
+    pthread_mutex_unlock(&gz_cookie->lock);
+}
+
+static ssize_t
+gzip_parallel_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    gzip_parallel_cookie_t *gz_cookie = (gzip_parallel_cookie_t *)cookie;
+    gzip_job_t *job;
+    size_t consumed = 0;
+    unsigned int n;
+
+    QC_DEBUG("gzip_parallel_cookie_write: new buf (%zu)\n", size);
+
+    while (consumed < size) {
+        job = JOB_OF(gz_cookie, gz_cookie->next_fill);
+
+        // Only the slot's first fill may have to wait for the writer
+        if (0 == gz_cookie->fill_len) {
+            pthread_mutex_lock(&gz_cookie->lock);
+            while (job->state != JOB_FREE && !gz_cookie->error) {
+                pthread_cond_wait(&gz_cookie->job_free, &gz_cookie->lock);
+            }
+            pthread_mutex_unlock(&gz_cookie->lock);
+        }
+        if (gz_cookie->error) {
+            break;
+        }
+
+        n = gz_cookie->block_sz - gz_cookie->fill_len;
+        n = (size - consumed < n) ? (size - consumed) : n;
+        memcpy(job->in + gz_cookie->fill_len, buf + consumed, n);
+        gz_cookie->fill_len += n;
+        consumed += n;
+
+        if (gz_cookie->fill_len == gz_cookie->block_sz) {
+            gzip_parallel_submit(gz_cookie);
+        }
+    }
+
+    return consumed;
+}
+
+static int
+gzip_parallel_cookie_release(gzip_parallel_cookie_t *gz_cookie)
+{
+    // An empty final block then the gzip trailer
+    unsigned char trailer[10] = { 3, 0 };
+    unsigned int i;
+    int error;
+
+    qzip_registry_del(gz_cookie);
+
+    // Submit the last partial block then let the pool run dry
+    if (gz_cookie->fill_len > 0) {
+        gzip_parallel_submit(gz_cookie);
+    }
+
+    pthread_mutex_lock(&gz_cookie->lock);
+    gz_cookie->stop = 1;
+    pthread_cond_broadcast(&gz_cookie->job_ready);
+    pthread_cond_broadcast(&gz_cookie->job_done);
+    pthread_mutex_unlock(&gz_cookie->lock);
+
+    for (i = 0; i < gz_cookie->nworkers; i++) {
+        pthread_join(gz_cookie->workers[i].thread, NULL);
+    }
+    pthread_join(gz_cookie->writer, NULL);
+
+    put_le32(trailer + 2, gz_cookie->crc);
+    put_le32(trailer + 6, gz_cookie->total);
+    if (!gz_cookie->error && gzip_parallel_emit(gz_cookie, trailer, sizeof(trailer)) != 0) {
+        gz_cookie->error = 1;
+    }
+    gz_cookie->stats.bytes_out += sizeof(gzip_header) + sizeof(trailer);
+
+    for (i = 0; i < gz_cookie->nworkers; i++) {
+        deflateEnd(&(gz_cookie->workers[i].strm));
+    }
+    for (i = 0; i < gz_cookie->njobs; i++) {
+        free(gz_cookie->jobs[i].in);
+        free(gz_cookie->jobs[i].dict);
+        free(gz_cookie->jobs[i].out);
+    }
+    free(gz_cookie->workers);
+    free(gz_cookie->jobs);
+
+    pthread_mutex_destroy(&gz_cookie->lock);
+    pthread_cond_destroy(&gz_cookie->job_ready);
+    pthread_cond_destroy(&gz_cookie->job_done);
+    pthread_cond_destroy(&gz_cookie->job_free);
+
+    error = gz_cookie->error;
+    qzip_stats_retire(&(gz_cookie->stats));
+    free(gz_cookie);
+
+    return error ? EOF : 0;
+}
+
+static int
+gzip_parallel_cookie_close(void *cookie)
+{
+    gzip_parallel_cookie_t *gz_cookie = (gzip_parallel_cookie_t *)cookie;
+    FILE *fp = gz_cookie->fp;
+    int rc = gzip_parallel_cookie_release(gz_cookie);
+
+    fclose(fp);
+
+    return rc;
+}
+
+// Won't close the hooked file
+static int
+gzip_parallel_cookie_close2(void *cookie)
+{
+    return gzip_parallel_cookie_release((gzip_parallel_cookie_t *)cookie);
+}
+
+static void
+gzip_parallel_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    gzip_parallel_cookie_t *gz_cookie = (gzip_parallel_cookie_t *)cookie;
+
+    pthread_mutex_lock(&gz_cookie->lock);
+    *stats = gz_cookie->stats;
+    pthread_mutex_unlock(&gz_cookie->lock);
+}
+
+static cookie_io_functions_t gzip_parallel_write_funcs = {
+    .write = gzip_parallel_cookie_write,
+    .close = gzip_parallel_cookie_close
+};
+
+static cookie_io_functions_t gzip_parallel_write2_funcs = {
+    .write = gzip_parallel_cookie_write,
+    .close = gzip_parallel_cookie_close2
+};
+
+static FILE *
+gzip_parallel_write_hook(FILE *fp, const char *mode, cookie_io_functions_t funcs,
+                         unsigned int nworkers)
+{
+    gzip_parallel_cookie_t *gz_cookie =
+        (gzip_parallel_cookie_t *)calloc(1, sizeof(gzip_parallel_cookie_t));
+    assert(gz_cookie != NULL);
+    QzSessionParams_T qz_sess_params;
+    unsigned int i;
+    int rc;
+
+    // Same level syntax and default as the qzip cookies
+    rc = qzip_sess_params_setup(&qz_sess_params, NULL, mode);
+    assert(0 == rc);
+    gz_cookie->level = qz_sess_params.comp_lvl;
+
+    nworkers = (nworkers > 0) ? nworkers : 1;
+    gz_cookie->fp = fp;
+    gz_cookie->nworkers = nworkers;
+    gz_cookie->block_sz = GZBLOCK;
+    gz_cookie->out_sz = compressBound(GZBLOCK) + 16;    // plus the sync marker
+    gz_cookie->njobs = 2 * nworkers + 1;
+    pthread_mutex_init(&gz_cookie->lock, NULL);
+    pthread_cond_init(&gz_cookie->job_ready, NULL);
+    pthread_cond_init(&gz_cookie->job_done, NULL);
+    pthread_cond_init(&gz_cookie->job_free, NULL);
+
+    gz_cookie->jobs = (gzip_job_t *)calloc(gz_cookie->njobs, sizeof(gzip_job_t));
+    assert(gz_cookie->jobs != NULL);
+    for (i = 0; i < gz_cookie->njobs; i++) {
+        gz_cookie->jobs[i].in = (char *)malloc(gz_cookie->block_sz);
+        gz_cookie->jobs[i].dict = (char *)malloc(GZDICT);
+        gz_cookie->jobs[i].out = (char *)malloc(gz_cookie->out_sz);
+        assert(gz_cookie->jobs[i].in != NULL && gz_cookie->jobs[i].dict != NULL &&
+               gz_cookie->jobs[i].out != NULL);
+    }
+
+    gz_cookie->workers = (gzip_worker_t *)calloc(nworkers, sizeof(gzip_worker_t));
+    assert(gz_cookie->workers != NULL);
+    for (i = 0; i < nworkers; i++) {
+        gzip_worker_t *worker = &(gz_cookie->workers[i]);
+
+        rc = deflateInit2(&(worker->strm), gz_cookie->level, Z_DEFLATED, -MAX_WBITS, 8,
+                          Z_DEFAULT_STRATEGY);
+        assert(Z_OK == rc);
+
+        worker->owner = gz_cookie;
+        rc = pthread_create(&(worker->thread), NULL, gzip_parallel_worker, worker);
+        assert(0 == rc);
+    }
+
+    rc = pthread_create(&gz_cookie->writer, NULL, gzip_parallel_writer, gz_cookie);
+    assert(0 == rc);
+
+    FILE *cookie_fp = fopencookie(gz_cookie, mode, funcs);
+
+    // Blocks are assembled by the cookie itself
+    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
+    assert(0 == rc);
+
+    rc = qzip_registry_add(cookie_fp, gz_cookie, NULL, gzip_parallel_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
+}
+
+// Reading is single-threaded, inflate can't be split without an index.
+// Input comes through `fp` itself, so whatever it has buffered or skipped
+// already counts, and only gzip members are accepted: unlike gzread, which
+// copies anything else through, input that isn't gzip fails, as does a
+// member cut short.
+typedef struct {
+    z_stream          strm;
+    FILE              *fp;
+    unsigned char     *in;
+    int               eof;
+    int               ended;        // between two members
+    int               error;
+    qzip_cookie_stats_t stats;
+} gzip_read_cookie_t;
+
+static ssize_t
+gzip_read_cookie_read(void *cookie, char *buf, size_t size)
+{
+    gzip_read_cookie_t *gz_cookie = (gzip_read_cookie_t *)cookie;
+    z_stream *strm = &(gz_cookie->strm);
+    unsigned long long start;
+    uLong total_in, total_out;
+    int rc;
+
+    if (gz_cookie->error) {
+        return -1;
+    }
+
+    strm->next_out = (Bytef *)buf;
+    strm->avail_out = (size > (size_t)~0U) ? ~0U : (unsigned int)size;
+    while (strm->avail_out > 0) {
+        if (0 == strm->avail_in && !gz_cookie->eof) {
+            strm->next_in = gz_cookie->in;
+            strm->avail_in = fread(gz_cookie->in, 1, GZBLOCK, gz_cookie->fp);
+            if (0 == strm->avail_in) {
+                if (ferror(gz_cookie->fp)) {
+                    QC_ERROR("gzip_read_cookie_read: failed to read input\n");
+                    gz_cookie->error = 1;
+                    break;
+                }
+                gz_cookie->eof = 1;
+            }
+        }
+        if (0 == strm->avail_in && gz_cookie->eof && gz_cookie->ended) {
+            break;
+        }
+
+        start = qzip_now_ns();
+        total_in = strm->total_in;
+        total_out = strm->total_out;
+        rc = inflate(strm, Z_NO_FLUSH);
+        qzip_stats_add(&(gz_cookie->stats), NULL, NULL, strm->total_in - total_in,
+                       strm->total_out - total_out, qzip_now_ns() - start);
+        if (Z_STREAM_END == rc) {
+            // Another member may follow
+            gz_cookie->ended = 1;
+            inflateReset(strm);
+        } else if (Z_OK == rc) {
+            gz_cookie->ended = 0;
+        } else if (Z_BUF_ERROR != rc || gz_cookie->eof) {
+            QC_ERROR("gzip_read_cookie_read: %s\n", (Z_BUF_ERROR == rc) ?
+                     "truncated member" : (strm->msg ? strm->msg : "inflate failed"));
+            gz_cookie->error = 1;
+            break;
+        }
+    }
+
+    if (gz_cookie->error && strm->avail_out == size) {
+        return -1;
+    }
+    return size - strm->avail_out;
+}
+
+static int
+gzip_read_cookie_release(gzip_read_cookie_t *gz_cookie)
+{
+    qzip_registry_del(gz_cookie);
+    inflateEnd(&(gz_cookie->strm));
+    free(gz_cookie->in);
+    qzip_stats_retire(&(gz_cookie->stats));
+    free(gz_cookie);
+
+    return 0;
+}
+
+static int
+gzip_read_cookie_close(void *cookie)
+{
+    FILE *fp = ((gzip_read_cookie_t *)cookie)->fp;
+
+    gzip_read_cookie_release((gzip_read_cookie_t *)cookie);
+
+    return fclose(fp);
+}
+
+// Won't close the hooked file
+static int
+gzip_read_cookie_close2(void *cookie)
+{
+    return gzip_read_cookie_release((gzip_read_cookie_t *)cookie);
+}
+
+static void
+gzip_read_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    *stats = ((gzip_read_cookie_t *)cookie)->stats;
+}
+
+static cookie_io_functions_t gzip_parallel_read_funcs = {
+    .read  = gzip_read_cookie_read,
+    .close = gzip_read_cookie_close
+};
+
+static cookie_io_functions_t gzip_parallel_read2_funcs = {
+    .read  = gzip_read_cookie_read,
+    .close = gzip_read_cookie_close2
+};
+
+static FILE *
+gzip_parallel_read_hook(FILE *fp, const char *mode, cookie_io_functions_t funcs)
+{
+    gzip_read_cookie_t *gz_cookie =
+        (gzip_read_cookie_t *)calloc(1, sizeof(gzip_read_cookie_t));
+    assert(gz_cookie != NULL);
+    int rc;
+
+    gz_cookie->fp = fp;
+    gz_cookie->ended = 1;
+    gz_cookie->in = (unsigned char *)malloc(GZBLOCK);
+    assert(gz_cookie->in != NULL);
+
+    // gzip wrapper only, no zlib or raw deflate
+    rc = inflateInit2(&(gz_cookie->strm), 16 + MAX_WBITS);
+    assert(Z_OK == rc);
+
+    FILE *cookie_fp = fopencookie(gz_cookie, mode, funcs);
+    assert(cookie_fp != NULL);
+
+    rc = qzip_registry_add(cookie_fp, gz_cookie, NULL, gzip_read_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
+}
+
+FILE *
+gzip_parallel_fopen(const char *fname, const char *mode, unsigned int nworkers)
+{
+    char fmode[16];
+    FILE *fp = fopen(fname, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+    assert(fp != NULL);
+
+    if (mode[0] == 'r') {
+        return gzip_parallel_read_hook(fp, mode, gzip_parallel_read_funcs);
+    }
+
+    return gzip_parallel_write_hook(fp, mode, gzip_parallel_write_funcs, nworkers);
+}
+
+FILE *
+gzip_parallel_hook(FILE *fp, const char *mode, unsigned int nworkers)
+{
+    if (mode[0] == 'r') {
+        return gzip_parallel_read_hook(fp, mode, gzip_parallel_read2_funcs);
+    }
+
+    return gzip_parallel_write_hook(fp, mode, gzip_parallel_write2_funcs, nworkers);
+}
+// \end gzip parallel cookie
+
+// \begin qzip shared cookie
+// One compressed file written by many threads. Each thread attaches a FILE *
+// of its own, so stdio never serialises them, and every write on it becomes
+// a record pushed onto an intrusive multi-producer single-consumer queue
+// with one atomic exchange (Vyukov's). A compression thread drains the
+// queue, packs whole records into batches of up to SHARED_BATCH bytes and
+// emits each batch as one gzip member. A batch that stops growing is cut
+// after SHARED_LINGER_MS, so that a quiet writer isn't left unflushed.
+//
+// Producers only take a lock when the consumer is asleep, or when more
+// than SHARED_MAX_QUEUED bytes are waiting and they must back off. The
+// cookie is shared by all the streams and released with the last of them,
+// so the file is only finished then, whatever the order they're closed in.
+#define SHARED_BATCH        (1024*1024)
+#define SHARED_LINGER_MS    10
+#define SHARED_MAX_QUEUED   (64*1024*1024)
+
+typedef struct qzip_record_ {
+    struct qzip_record_ *next;
+    size_t              len;
+    char                data[];
+} qzip_record_t;
+
+typedef struct {
+    qzip_record_t     *head;        // producers exchange themselves in here
+    qzip_record_t     *tail;        // consumer only
+    qzip_record_t     stub;
+    size_t            queued;       // bytes pushed but not yet popped
+    int               sleeping;     // consumer waits on `wake`
+    int               stop;
+    int               flush_req;    // sequence of the last flush asked for
+    int               flush_done;
+    int               error;
+    int               refs;         // streams still open, attached or not
+    int               close_fp;     // fclose `fp` once they are all closed
+    pthread_mutex_t   lock;
+    pthread_cond_t    wake;         // producers -> consumer
+    pthread_cond_t    room;         // consumer -> producers held back
+    pthread_cond_t    flushed;      // consumer -> flushing thread
+    pthread_t         consumer;
+    QzSession_T       *qz_sess;
+    QzSessionParams_T qz_sess_params;
+    char              *batch;
+    size_t            batch_len;
+    char              *out;
+    unsigned int      out_sz;
+    FILE              *fp;
+    qzip_cookie_stats_t stats;      // consumer only, histograms lock-free
+} qzip_shared_cookie_t;
+
+typedef struct {
+    qzip_shared_cookie_t *owner;
+} qzip_producer_t;
+
+static void
+qzip_shared_push(qzip_shared_cookie_t *qz_cookie, qzip_record_t *rec)
+{
+    qzip_record_t *prev;
+
+    rec->next = NULL;
+    prev = __atomic_exchange_n(&qz_cookie->head, rec, __ATOMIC_SEQ_CST);
+    // The consumer sees the queue end at `prev` until this store lands
+    __atomic_store_n(&prev->next, rec, __ATOMIC_RELEASE);
+}
+
+// NULL if the queue is empty or a push is halfway through
+static qzip_record_t *
+qzip_shared_pop(qzip_shared_cookie_t *qz_cookie)
+{
+    qzip_record_t *tail = qz_cookie->tail;
+    qzip_record_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &qz_cookie->stub) {
+        if (NULL == next) {
+            return NULL;
+        }
+        qz_cookie->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (NULL != next) {
+        qz_cookie->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&qz_cookie->head, __ATOMIC_SEQ_CST)) {
+        return NULL;
+    }
+
+    // `tail` is the last record: put the stub behind it to take it out
+    qzip_shared_push(qz_cookie, &qz_cookie->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (NULL != next) {
+        qz_cookie->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+// Nothing queued, nor being pushed. Consumer only.
+static int
+qzip_shared_empty(qzip_shared_cookie_t *qz_cookie)
+{
+    return qz_cookie->tail == &qz_cookie->stub &&
+           &qz_cookie->stub == __atomic_load_n(&qz_cookie->head, __ATOMIC_SEQ_CST);
+}
+
+// Output has been lost: producers see it on their next write, and those
+// held back for room are let go
+static void
+qzip_shared_fail(qzip_shared_cookie_t *qz_cookie)
+{
+    pthread_mutex_lock(&qz_cookie->lock);
+    __atomic_store_n(&qz_cookie->error, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&qz_cookie->room);
+    pthread_mutex_unlock(&qz_cookie->lock);
+}
+
+static inline int
+qzip_shared_failed(qzip_shared_cookie_t *qz_cookie)
+{
+    return __atomic_load_n(&qz_cookie->error, __ATOMIC_RELAXED);
+}
+
+// Compress `len` bytes into one member and write it out, unless output was
+// lost already: whatever follows a gap would be misplaced. Consumer only.
+static void
+qzip_shared_emit(qzip_shared_cookie_t *qz_cookie, const char *src, size_t len)
+{
+    unsigned int src_len, dst_len;
+    unsigned long long start, elapsed;
+    size_t bytes_written;
+    int rc;
+
+    while (len > 0 && !qzip_shared_failed(qz_cookie)) {
+        src_len = (len < SHARED_BATCH) ? len : SHARED_BATCH;
+        dst_len = qz_cookie->out_sz;
+        start = qzip_now_ns();
+        rc = qzCompress(qz_cookie->qz_sess, src, &src_len, qz_cookie->out, &dst_len, 1);
+        elapsed = qzip_now_ns() - start;
+        if (rc != QZ_OK || 0 == src_len) {
+            QC_ERROR("qzip_shared_emit: failed with error: %d\n", rc);
+            qzip_shared_fail(qz_cookie);
+            return;
+        }
+        qzip_stats_add(&(qz_cookie->stats), qz_cookie->qz_sess, &(qz_cookie->qz_sess_params),
+                       src_len, dst_len, elapsed);
+
+        start = qzip_now_ns();
+        bytes_written = fwrite(qz_cookie->out, 1, dst_len, qz_cookie->fp);
+        qzip_hist_record(&(qz_cookie->stats.write_ns), qzip_now_ns() - start);
+        if (bytes_written != dst_len) {
+            QC_ERROR("qzip_shared_emit: short write (%zu of %u)\n", bytes_written, dst_len);
+            qzip_shared_fail(qz_cookie);
+            return;
+        }
+
+        src += src_len;
+        len -= src_len;
+    }
+}
+
+static void
+qzip_shared_cut(qzip_shared_cookie_t *qz_cookie)
+{
+    qzip_shared_emit(qz_cookie, qz_cookie->batch, qz_cookie->batch_len);
+    qz_cookie->batch_len = 0;
+}
+
+static void
+qzip_shared_take(qzip_shared_cookie_t *qz_cookie, qzip_record_t *rec)
+{
+    size_t queued;
+
+    if (qz_cookie->batch_len + rec->len > SHARED_BATCH) {
+        qzip_shared_cut(qz_cookie);
+    }
+    // Records are only drained once output is lost, to let producers go
+    if (qzip_shared_failed(qz_cookie)) {
+        qz_cookie->batch_len = 0;
+    } else if (rec->len > SHARED_BATCH) {
+        // Records too big for a batch go out on their own, uncopied
+        qzip_shared_emit(qz_cookie, rec->data, rec->len);
+    } else {
+        memcpy(qz_cookie->batch + qz_cookie->batch_len, rec->data, rec->len);
+        qz_cookie->batch_len += rec->len;
+    }
+
+    queued = __atomic_sub_fetch(&qz_cookie->queued, rec->len, __ATOMIC_SEQ_CST);
+    if (queued + rec->len > SHARED_MAX_QUEUED && queued <= SHARED_MAX_QUEUED) {
+        pthread_mutex_lock(&qz_cookie->lock);
+        pthread_cond_broadcast(&qz_cookie->room);
+        pthread_mutex_unlock(&qz_cookie->lock);
+    }
+    free(rec);
+}
+
+static void *
+qzip_shared_consumer(void *arg)
+{
+    qzip_shared_cookie_t *qz_cookie = (qzip_shared_cookie_t *)arg;
+    qzip_record_t *rec;
+    struct timespec deadline;
+    int stop, flush_req, timed_out;
+
+    while (1) {
+        while (NULL != (rec = qzip_shared_pop(qz_cookie))) {
+            qzip_shared_take(qz_cookie, rec);
+        }
+
+        pthread_mutex_lock(&qz_cookie->lock);
+        stop = qz_cookie->stop;
+        flush_req = qz_cookie->flush_req;
+        pthread_mutex_unlock(&qz_cookie->lock);
+
+        // Producers are all gone once `stop` is set, so the queue is
+        // really empty unless a push was halfway through
+        if (stop && !qzip_shared_empty(qz_cookie)) {
+            continue;
+        }
+        if (stop || flush_req != qz_cookie->flush_done) {
+            qzip_shared_cut(qz_cookie);
+            pthread_mutex_lock(&qz_cookie->lock);
+            if (fflush(qz_cookie->fp) != 0) {
+                __atomic_store_n(&qz_cookie->error, 1, __ATOMIC_RELAXED);
+                pthread_cond_broadcast(&qz_cookie->room);
+            }
+            qz_cookie->flush_done = flush_req;
+            pthread_cond_broadcast(&qz_cookie->flushed);
+            pthread_mutex_unlock(&qz_cookie->lock);
+            if (stop) {
+                break;
+            }
+            continue;
+        }
+
+        // Announce the nap first, then look again: a producer either sees
+        // the flag or pushed before the second look
+        pthread_mutex_lock(&qz_cookie->lock);
+        __atomic_store_n(&qz_cookie->sleeping, 1, __ATOMIC_SEQ_CST);
+        timed_out = 0;
+        if (qzip_shared_empty(qz_cookie) && !qz_cookie->stop &&
+            qz_cookie->flush_req == qz_cookie->flush_done) {
+            if (qz_cookie->batch_len > 0) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += SHARED_LINGER_MS * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+                timed_out = (ETIMEDOUT == pthread_cond_timedwait(&qz_cookie->wake,
+                                                                 &qz_cookie->lock, &deadline));
+            } else {
+                pthread_cond_wait(&qz_cookie->wake, &qz_cookie->lock);
+            }
+        }
+        __atomic_store_n(&qz_cookie->sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&qz_cookie->lock);
+
+        if (timed_out && qzip_shared_empty(qz_cookie)) {
+            qzip_shared_cut(qz_cookie);
+        }
+    }
+
+    return NULL;
+}
+
+static inline void
+qzip_shared_wake(qzip_shared_cookie_t *qz_cookie)
+{
+    pthread_mutex_lock(&qz_cookie->lock);
+    pthread_cond_signal(&qz_cookie->wake);
+    pthread_mutex_unlock(&qz_cookie->lock);
+}
+
+// Each call is one record, kept whole within a member
+static ssize_t
+qzip_shared_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    qzip_shared_cookie_t *qz_cookie = ((qzip_producer_t *)cookie)->owner;
+    qzip_record_t *rec;
+
+    QC_DEBUG("qzip_shared_cookie_write: new buf (%zu)\n", size);
+
+    if (qzip_shared_failed(qz_cookie)) {
+        return 0;
+    }
+    if (__atomic_load_n(&qz_cookie->queued, __ATOMIC_RELAXED) > SHARED_MAX_QUEUED) {
+        pthread_mutex_lock(&qz_cookie->lock);
+        while (__atomic_load_n(&qz_cookie->queued, __ATOMIC_SEQ_CST) > SHARED_MAX_QUEUED &&
+               !qz_cookie->error) {
+            pthread_cond_signal(&qz_cookie->wake);
+            pthread_cond_wait(&qz_cookie->room, &qz_cookie->lock);
+        }
+        pthread_mutex_unlock(&qz_cookie->lock);
+    }
+
+    rec = (qzip_record_t *)malloc(sizeof(qzip_record_t) + size);
+    if (NULL == rec) {
+        return 0;
+    }
+    rec->len = size;
+    memcpy(rec->data, buf, size);
+
+    __atomic_add_fetch(&qz_cookie->queued, size, __ATOMIC_SEQ_CST);
+    qzip_shared_push(qz_cookie, rec);
+    if (__atomic_load_n(&qz_cookie->sleeping, __ATOMIC_SEQ_CST)) {
+        qzip_shared_wake(qz_cookie);
+    }
+
+    return size;
+}
+
+// Cut the batch and push it to the file, records queued so far included
+static int
+qzip_shared_cookie_flush(void *cookie)
+{
+    qzip_shared_cookie_t *qz_cookie = ((qzip_producer_t *)cookie)->owner;
+    int seq, error;
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    seq = ++qz_cookie->flush_req;
+    pthread_cond_signal(&qz_cookie->wake);
+    while (qz_cookie->flush_done - seq < 0 && !qz_cookie->stop) {
+        pthread_cond_wait(&qz_cookie->flushed, &qz_cookie->lock);
+    }
+    error = qz_cookie->error;
+    pthread_mutex_unlock(&qz_cookie->lock);
+
+    return error ? -1 : 0;
+}
+
+static void
+qzip_shared_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    qzip_shared_cookie_t *qz_cookie = ((qzip_producer_t *)cookie)->owner;
+
+    // Counters are the consumer's, a copy may be slightly torn
+    *stats = qz_cookie->stats;
+}
+
+// Finish the file once the last stream, attached or not, is closed
+static int
+qzip_shared_cookie_release(qzip_shared_cookie_t *qz_cookie)
+{
+    int error;
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    qz_cookie->stop = 1;
+    pthread_cond_signal(&qz_cookie->wake);
+    pthread_mutex_unlock(&qz_cookie->lock);
+    pthread_join(qz_cookie->consumer, NULL);
+
+    if (0 == qz_cookie->stats.bytes_out && !qz_cookie->error) {
+        if (fwrite(gzip_empty_member, 1, sizeof(gzip_empty_member), qz_cookie->fp) !=
+            sizeof(gzip_empty_member)) {
+            qz_cookie->error = 1;
+        }
+        qz_cookie->stats.bytes_out += sizeof(gzip_empty_member);
+    }
+    if (qz_cookie->close_fp && fclose(qz_cookie->fp) != 0) {
+        qz_cookie->error = 1;
+    }
+
+    qzip_sess_put(qz_cookie->qz_sess);
+    free(qz_cookie->batch);
+    free(qz_cookie->out);
+    pthread_mutex_destroy(&qz_cookie->lock);
+    pthread_cond_destroy(&qz_cookie->wake);
+    pthread_cond_destroy(&qz_cookie->room);
+    pthread_cond_destroy(&qz_cookie->flushed);
+
+    error = qz_cookie->error;
+    qzip_stats_retire(&(qz_cookie->stats));
+    free(qz_cookie);
+
+    return error ? EOF : 0;
+}
+
+static int
+qzip_producer_close(void *cookie)
+{
+    qzip_producer_t *producer = (qzip_producer_t *)cookie;
+    qzip_shared_cookie_t *qz_cookie = producer->owner;
+    int refs;
+
+    qzip_registry_del(producer);
+    free(producer);
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    refs = --qz_cookie->refs;
+    pthread_mutex_unlock(&qz_cookie->lock);
+
+    return (0 == refs) ? qzip_shared_cookie_release(qz_cookie) : 0;
+}
+
+static int
+qzip_shared_cookie_close(void *cookie)
+{
+    qzip_shared_cookie_t *qz_cookie = ((qzip_producer_t *)cookie)->owner;
+
+    pthread_mutex_lock(&qz_cookie->lock);
+    qz_cookie->close_fp = 1;
+    pthread_mutex_unlock(&qz_cookie->lock);
+
+    return qzip_producer_close(cookie);
+}
+
+// Won't close the hooked file
+static int
+qzip_shared_cookie_close2(void *cookie)
+{
+    return qzip_producer_close(cookie);
+}
+
+static cookie_io_functions_t qzip_shared_write_funcs = {
+    .write = qzip_shared_cookie_write,
+    .close = qzip_shared_cookie_close
+};
+
+static cookie_io_functions_t qzip_shared_write2_funcs = {
+    .write = qzip_shared_cookie_write,
+    .close = qzip_shared_cookie_close2
+};
+
+static cookie_io_functions_t qzip_producer_funcs = {
+    .write = qzip_shared_cookie_write,
+    .close = qzip_producer_close
+};
+
+// A stream writing into `qz_cookie`, each one with its own stdio lock
+static FILE *
+qzip_producer_open(qzip_shared_cookie_t *qz_cookie, cookie_io_functions_t funcs)
+{
+    qzip_producer_t *producer = (qzip_producer_t *)malloc(sizeof(qzip_producer_t));
+    assert(producer != NULL);
+    int rc;
+
+    producer->owner = qz_cookie;
+
+    FILE *cookie_fp = fopencookie(producer, "w", funcs);
+    assert(cookie_fp != NULL);
+
+    // Records are whatever a single fwrite or fprintf hands over
+    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
+    assert(0 == rc);
 
-    QC_DEBUG("qzip_cookie_write: new buf at %x (%d Bytes)\n", buf, size);
+    rc = qzip_registry_add(cookie_fp, producer, qzip_shared_cookie_flush,
+                           qzip_shared_cookie_stats);
+    assert(0 == rc);
 
-    while (!done) {
-        run_time_list_node_t *run_time_node = LIST_NEW();
-        assert(run_time_node != NULL);
+    return cookie_fp;
+}
 
-        gettimeofday(&(run_time_node->rtime.time_s), NULL);
-        rc = qzCompress(qz_sess, src, &src_len, dst, &dst_len, 1);
-        gettimeofday(&(run_time_node->rtime.time_e), NULL);
+static FILE *
+qzip_shared_write_hook(FILE *fp, const char *mode, cookie_io_functions_t funcs)
+{
+    qzip_shared_cookie_t *qz_cookie =
+        (qzip_shared_cookie_t *)calloc(1, sizeof(qzip_shared_cookie_t));
+    assert(qz_cookie != NULL);
+    int rc;
 
-        LIST_ADD(run_time_list_head, run_time_node);
+    qz_cookie->fp = fp;
+    qz_cookie->refs = 1;
+    qz_cookie->head = qz_cookie->tail = &qz_cookie->stub;
+    pthread_mutex_init(&qz_cookie->lock, NULL);
+    pthread_cond_init(&qz_cookie->wake, NULL);
+    pthread_cond_init(&qz_cookie->room, NULL);
+    pthread_cond_init(&qz_cookie->flushed, NULL);
 
-        if (rc != QZ_OK &&
-            rc != QZ_BUF_ERROR &&
-            rc != QZ_DATA_ERROR) {
-            QC_ERROR("qzip_cookie_write: failed with error: %d\n", rc);
-            QC_ERROR("qzip_cookie_write: src_len %d, dst_len %d\n", src_len, dst_len);
-            break;
-        }
+    rc = qzip_sess_params_setup(&(qz_cookie->qz_sess_params), NULL, mode);
+    assert(0 == rc);
+    qz_cookie->qz_sess = qzip_sess_get(&(qz_cookie->qz_sess_params));
+    assert(qz_cookie->qz_sess != NULL);
 
-        bytes_written = fwrite(dst, 1, dst_len, qz_cookie->fp);
-        assert(bytes_written == dst_len);
+    qz_cookie->out_sz = qzMaxCompressedLength(SHARED_BATCH);
+    qz_cookie->batch = (char *)malloc(SHARED_BATCH);
+    qz_cookie->out = (char *)malloc(qz_cookie->out_sz);
+    assert(qz_cookie->batch != NULL && qz_cookie->out != NULL);
 
-        buf_processed += src_len;
-        buf_remaining -= src_len;
-        if (buf_remaining == 0) {
-            done = 1;
-        }
-        src += src_len;
-        src_len = buf_remaining;
-        dst_len = valid_dst_len;
-    }
+    rc = pthread_create(&qz_cookie->consumer, NULL, qzip_shared_consumer, qz_cookie);
+    assert(0 == rc);
 
-    return buf_processed;
+    return qzip_producer_open(qz_cookie, funcs);
 }
 
-static int
-qzip_cookie_close(void *cookie)
+// Reading falls back to the single-session read cookie
+FILE *
+qzip_shared_fopen(const char *fname, const char *mode)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
-    QzSession_T *qz_sess = &(qz_cookie->qz_sess);
+    char fmode[16];
+    FILE *fp = fopen(fname, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+    assert(fp != NULL);
 
-    fclose(qz_cookie->fp);
-    qzTeardownSession(qz_sess);
-    qzClose(qz_sess);
-    free(qz_cookie);
+    if (mode[0] == 'r') {
+        return qzip_read_hook(fp, mode, qzip_read_funcs, NULL);
+    }
 
-    return 0;
+    return qzip_shared_write_hook(fp, mode, qzip_shared_write_funcs);
 }
 
-// This API is used for pipe-like program where input/output file is
-// stdio/stdout seperatly.
-static int
-qzip_cookie_close2(void *cookie)
+FILE *
+qzip_shared_hook(FILE *fp, const char *mode)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)(cookie);
-    QzSession_T *qz_sess = &(qz_cookie->qz_sess);
-
-    // Won't close stdout
-    //fclose(qz_cookie->fp);
-    qzTeardownSession(qz_sess);
-    qzClose(qz_sess);
-    free(qz_cookie);
+    if (mode[0] == 'r') {
+        return qzip_read_hook(fp, mode, qzip_read2_funcs, NULL);
+    }
 
-    return 0;
+    return qzip_shared_write_hook(fp, mode, qzip_shared_write2_funcs);
 }
 
-static cookie_io_functions_t qzip_write_funcs = {
-    .write = qzip_cookie_write,
-    .close = qzip_cookie_close
-};
+FILE *
+qzip_shared_attach(FILE *fp)
+{
+    qzip_registry_entry_t *entry = qzip_registry_find(fp);
+    qzip_shared_cookie_t *qz_cookie;
+
+    if (NULL == entry || entry->stats != qzip_shared_cookie_stats) {
+        if (NULL != entry) {
+            qzip_registry_put(entry);
+        }
+        errno = EBADF;
+        return NULL;
+    }
+    qz_cookie = ((qzip_producer_t *)entry->cookie)->owner;
 
+    pthread_mutex_lock(&qz_cookie->lock);
+    qz_cookie->refs++;
+    pthread_mutex_unlock(&qz_cookie->lock);
+    qzip_registry_put(entry);
 
-static cookie_io_functions_t qzip_write2_funcs = {
-    .write = qzip_cookie_write,
-    .close = qzip_cookie_close2
-};
+    return qzip_producer_open(qz_cookie, qzip_producer_funcs);
+}
+// \end qzip shared cookie
 
-FILE *
-qzip_fopen(const char *fname, const char *mode)
+// \begin qzip stream read cookie
+// Read-side counterpart of the stream cookie. Compressed input is fed to
+// `qzDecompressStream` in slices and inflated data is staged in `qz_strm_bufm`,
+// so only a bounded window of the stream is held in memory.
+typedef struct {
+    QzSession_T       *qz_sess;
+    QzSessionParams_T qz_sess_params;
+    QzStream_T        qz_strm;
+    bufm_t            qz_strm_bufm;
+    bufm_t            qz_strm_inbufm;
+    int               eof;
+    int               done;
+    int               error;        // sticky, the stream is corrupt or cut short
+    FILE              *fp;
+    qzip_cookie_stats_t stats;
+} qzip_stream_read_cookie_t;
+
+static ssize_t
+qzip_stream_cookie_read(void *cookie, char *buf, size_t size)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)calloc(1, sizeof(qzip_cookie_t));
+    qzip_stream_read_cookie_t *qz_stream_cookie =
+        (qzip_stream_read_cookie_t *)cookie;
+    QzSession_T *qz_sess    = qz_stream_cookie->qz_sess;
+    QzStream_T *qz_strm     = &(qz_stream_cookie->qz_strm);
+    bufm_t *qz_strm_bufm    = &(qz_stream_cookie->qz_strm_bufm);
+    bufm_t *qz_strm_inbufm  = &(qz_stream_cookie->qz_strm_inbufm);
+    unsigned int slice_sz   = (qz_stream_cookie->qz_sess_params).hw_buff_sz / 4;
+    unsigned int input_left;
+    unsigned int last;
+    size_t copied = 0;
+    unsigned long long start, elapsed;
     int rc;
 
-    // \begin initialization and setup for QAT's compression service
-    QzSession_T   *qz_sess = &(qz_cookie->qz_sess);
-    QzSessionParams_T *qz_sess_params = &(qz_cookie->qz_sess_params);
+    QC_DEBUG("qzip_stream_cookie_read: new buf (%zu)\n", size);
 
-    // For simplicity, initializations and setup function calls are not required
-    // to obtain compression services. If the initialization and setup functions
-    // are not called before compression or decompression requests, then they
-    // will be called with default arguments from within the compression or
-    // decompression functions. This results in serveral legal calling scenarios,
-    // see QATzip/include/qatzip.h for more details. For better understanding,
-    // we use scenario 1 here, described blow.
-    //
-    // Scenario 1 - all functions explicilty invoked by caller, with all arguments
-    // provided
-    //
-    // qzInit(&sess_c, sw_backup);
-    // qzSetupSession(&sess_c, &params);
-    // qzCompress(&sess, src, &src_len, dest, &dest_len, 1);
-    // qzDecompress(&sess, src, &src_len, dest, &dest_len);
-    // qzTeardownSession(&sess);
-    // qzClose(&sess);
+    if (qz_stream_cookie->error) {
+        return -1;
+    }
 
-    // 1 means use software as backup when QAT hardware is unavailable
-    rc = qzInit(qz_sess, 1);
-    assert(QZ_OK == rc);
+    while (copied < size) {
+        if (qz_strm_bufm->consumed > qz_strm_bufm->offset) {
+            copied += bufm_drain(qz_strm_bufm, buf + copied, size - copied);
+            continue;
+        }
+        if (qz_stream_cookie->done) {
+            break;
+        }
 
-    // Default parameters:
-    // - dynamic or static huffman headers: fully dynamic
-    // - compression or decompression: both
-    // - deflate, deflate with GZip or deflate with GZip ext: Gzip ext
-    // - Compression level 1..9: 1 that is twice faster than others and a little
-    //   compression ratio loss
-    // - Nanosleep between poll [0..100] (0 means no sleep): 10
-    // - Maximum forks permitted in current thread (0 means no forking permitted): 3
-    // - Use software as backup or not: yes
-    // - Default buffer size (power of 2 - 4K, 8K, 16K, 32K, 64K, 128K): 64KB
-    // - Stream buffer size (1K..2M-5K): 64KB
-    // - Default threshold of compression service's input size: 1KB. For SW
-    //   failover, if the size of input request less than the threshold, QATzip
-    //   will route the request to software.
-    // - req_cnt_thrshold (1..4): 4 as default
-    // - wait_cnt_thrshold: when previous try (call icp_sal_userStartProcess in qzInit)
-    //   failed, wait for specific number of call before retry device open. Default is 8.
-    rc = qzGetDefaults(qz_sess_params);
-    assert(QZ_OK == rc);
+        if (qz_strm_inbufm->consumed == qz_strm_inbufm->offset &&
+            !qz_stream_cookie->eof) {
+            if (0 == bufm_fill(qz_strm_inbufm, qz_stream_cookie->fp)) {
+                if (ferror(qz_stream_cookie->fp)) {
+                    QC_ERROR("qzip_stream_cookie_read: failed to read input\n");
+                    qz_stream_cookie->error = 1;
+                    return (copied > 0) ? copied : -1;
+                }
+                qz_stream_cookie->eof = 1;
+            }
+        }
 
-    rc = qzSetupSession(qz_sess, qz_sess_params);
-    assert(QZ_OK == rc);
-    // \end initialization and setup for QAT's compression service
+        input_left = qz_strm_inbufm->consumed - qz_strm_inbufm->offset;
+
+        qz_strm->in     = qz_strm_inbufm->buf + qz_strm_inbufm->offset;
+        qz_strm->out    = qz_strm_bufm->buf;
+        qz_strm->in_sz  = (input_left > slice_sz) ? slice_sz : input_left;
+        qz_strm->out_sz = qz_strm_bufm->size;
+        last = (qz_stream_cookie->eof && qz_strm->in_sz == input_left) ? 1 : 0;
 
-    qz_cookie->fp = fopen(fname, mode);
-    assert(qz_cookie->fp != NULL);
+        QC_DEBUG("qzip_stream_cookie_read: before: to_in %7d (%7d pending), remain %7d (%7d pending)\n",
+                qz_strm->in_sz, qz_strm->pending_in, qz_strm->out_sz, qz_strm->pending_out);
 
-    FILE *cookie_fp = fopencookie(qz_cookie, mode, qzip_write_funcs);
+        start = qzip_now_ns();
+        rc = qzDecompressStream(qz_sess, qz_strm, last);
+        elapsed = qzip_now_ns() - start;
+        if (rc != QZ_OK) {
+            QC_ERROR("qzip_stream_cookie_read: failed with error: %d\n", rc);
+            QC_ERROR("qzip_stream_cookie_read: input_left %d\n", input_left);
+            qz_stream_cookie->error = 1;
+            return (copied > 0) ? copied : -1;
+        }
 
-    // Disable cookie_fp's stream buffer
-    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
-    assert(0 == rc);
+        QC_DEBUG("qzip_stream_cookie_read:  after: in_ed %7d (%7d pending), output %7d (%7d pending)\n",
+                qz_strm->in_sz, qz_strm->pending_in, qz_strm->out_sz, qz_strm->pending_out);
 
-    return cookie_fp;
+        qz_strm_inbufm->offset  += qz_strm->in_sz;
+        qz_strm_bufm->offset     = 0;
+        qz_strm_bufm->consumed   = qz_strm->out_sz;
+
+        if (qz_strm->in_sz > 0 || qz_strm->out_sz > 0) {
+            qzip_stats_add(&(qz_stream_cookie->stats), qz_sess,
+                           &(qz_stream_cookie->qz_sess_params),
+                           qz_strm->in_sz, qz_strm->out_sz, elapsed);
+            continue;
+        }
+
+        // Nothing moved: the stream either wants a bigger piece of input
+        // or has been drained completely. It only ends cleanly between two
+        // members, i.e. with no partial member held back in `pending_in`
+        // and nothing left over that the stream won't take.
+        if (!qz_stream_cookie->eof) {
+            if (0 == bufm_fill(qz_strm_inbufm, qz_stream_cookie->fp)) {
+                qz_stream_cookie->eof = 1;
+            }
+        } else if (0 == qz_strm->pending_out) {
+            qz_stream_cookie->done = 1;
+            if (qz_strm->pending_in > 0 || input_left > 0) {
+                QC_ERROR("qzip_stream_cookie_read: truncated member (%d pending), "
+                         "%d bytes of trailing data\n", qz_strm->pending_in, input_left);
+                qz_stream_cookie->error = 1;
+                return (copied > 0) ? copied : -1;
+            }
+        }
+    }
+
+    return copied;
 }
 
-FILE *
-qzip_hook(FILE *fp, const char *mode)
+static int
+qzip_stream_read_cookie_close(void *cookie)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)calloc(1, sizeof(qzip_cookie_t));
-    QzSession_T   *qz_sess = &(qz_cookie->qz_sess);
-    QzSessionParams_T *qz_sess_params = &(qz_cookie->qz_sess_params);
-    int rc;
+    qzip_stream_read_cookie_t *qz_stream_cookie =
+        (qzip_stream_read_cookie_t *)cookie;
+    QzSession_T *qz_sess    = qz_stream_cookie->qz_sess;
 
-    rc = qzInit(qz_sess, 1);
-    assert(QZ_OK == rc);
-    rc = qzGetDefaults(qz_sess_params);
-    assert(QZ_OK == rc);
-    rc = qzSetupSession(qz_sess, qz_sess_params);
-    assert(QZ_OK == rc);
+    qzip_registry_del(qz_stream_cookie);
+    fclose(qz_stream_cookie->fp);
+    bufm_destor(&(qz_stream_cookie->qz_strm_bufm));
+    bufm_destor(&(qz_stream_cookie->qz_strm_inbufm));
 
-    qz_cookie->fp = fp;
+    qzEndStream(qz_sess, &(qz_stream_cookie->qz_strm));
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_stream_cookie->stats));
+    free(qz_stream_cookie);
+
+    return 0;
+}
 
-    FILE *cookie_fp = fopencookie(qz_cookie, mode, qzip_write2_funcs);
+// Won't close the hooked file
+static int
+qzip_stream_read_cookie_close2(void *cookie)
+{
+    qzip_stream_read_cookie_t *qz_stream_cookie =
+        (qzip_stream_read_cookie_t *)cookie;
+    QzSession_T *qz_sess    = qz_stream_cookie->qz_sess;
 
-    // Disable cookie_fp's stream buffer
-    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
-    assert(0 == rc);
+    qzip_registry_del(qz_stream_cookie);
+    bufm_destor(&(qz_stream_cookie->qz_strm_bufm));
+    bufm_destor(&(qz_stream_cookie->qz_strm_inbufm));
 
-    return cookie_fp;
+    qzEndStream(qz_sess, &(qz_stream_cookie->qz_strm));
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_stream_cookie->stats));
+    free(qz_stream_cookie);
+
+    return 0;
 }
 
-static cookie_io_functions_t my_qzip_writes_funcs = {
-    .write = my_qzip_cookie_write,
-    .close = qzip_cookie_close2
+static void
+qzip_stream_read_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    *stats = ((qzip_stream_read_cookie_t *)cookie)->stats;
+}
+
+static cookie_io_functions_t qzip_stream_read_funcs = {
+    .read  = qzip_stream_cookie_read,
+    .close = qzip_stream_read_cookie_close
 };
 
-FILE *
-my_qzip_hook(FILE *fp, const char *mode)
+static cookie_io_functions_t qzip_stream_read2_funcs = {
+    .read  = qzip_stream_cookie_read,
+    .close = qzip_stream_read_cookie_close2
+};
+
+static FILE *
+qzip_stream_read_hook(FILE *fp, const char *mode, cookie_io_functions_t funcs)
 {
-    qzip_cookie_t *qz_cookie = (qzip_cookie_t *)calloc(1, sizeof(qzip_cookie_t));
-    QzSession_T   *qz_sess = &(qz_cookie->qz_sess);
-    QzSessionParams_T *qz_sess_params = &(qz_cookie->qz_sess_params);
+    qzip_stream_read_cookie_t *qz_stream_cookie =
+        (qzip_stream_read_cookie_t *)calloc(1, sizeof(qzip_stream_read_cookie_t));
+    assert(qz_stream_cookie != NULL);
+
+    QzSessionParams_T *qz_sess_params = &(qz_stream_cookie->qz_sess_params);
     int rc;
 
-    rc = qzInit(qz_sess, 1);
-    assert(QZ_OK == rc);
-    rc = qzGetDefaults(qz_sess_params);
-    assert(QZ_OK == rc);
-    rc = qzSetupSession(qz_sess, qz_sess_params);
-    assert(QZ_OK == rc);
+    rc = qzip_sess_params_setup(qz_sess_params, NULL, mode);
+    assert(rc == 0);
+    qz_stream_cookie->qz_sess = qzip_sess_get(qz_sess_params);
+    assert(qz_stream_cookie->qz_sess != NULL);
 
-    qz_cookie->fp = fp;
+    // Allocate internal buffers to stage stream's input and output
+    rc = bufm_init(&(qz_stream_cookie->qz_strm_inbufm), HUGEPAGE);
+    assert(rc == 0);
+    rc = bufm_init(&(qz_stream_cookie->qz_strm_bufm), HUGEPAGE);
+    assert(rc == 0);
 
-    FILE *cookie_fp = fopencookie(qz_cookie, mode, my_qzip_writes_funcs);
+    qz_stream_cookie->fp = fp;
 
-    // Disable cookie_fp's stream buffer
-    rc = setvbuf(cookie_fp, NULL, _IONBF, 0);
-    assert(0 == rc);
+    FILE *cookie_fp = fopencookie(qz_stream_cookie, mode, funcs);
 
-    data_buf_pinned = qzMalloc(128*1024, NODE_0, PINNED_MEM);
-    assert(NULL != data_buf_pinned);
+    rc = qzip_registry_add(cookie_fp, qz_stream_cookie, NULL, qzip_stream_read_cookie_stats);
+    assert(0 == rc);
 
     return cookie_fp;
 }
-// \end qzip cookie
+// \end qzip stream read cookie
 
 // \begin qzip stream cookie
 // Refer to test/main.c:qzCompressStreamAndDecompress
 typedef struct {
-    QzSession_T       qz_sess;
+    QzSession_T       *qz_sess;
     QzSessionParams_T qz_sess_params;
     QzStream_T        qz_strm;
     bufm_t            qz_strm_bufm;
-    FILE              *fp;
+    qzip_sink_t       sink;
+    int               error;        // sticky, output was lost
+    qzip_cookie_stats_t stats;
 } qzip_stream_cookie_t;
 
+// Hand the staged output to the sink. Returns -1 once any of it was lost.
+static int
+qzip_stream_cookie_flush_out(qzip_stream_cookie_t *qz_stream_cookie)
+{
+    bufm_t *qz_strm_bufm = &(qz_stream_cookie->qz_strm_bufm);
+
+    if (0 == qz_strm_bufm->consumed || qz_stream_cookie->error) {
+        return qz_stream_cookie->error ? -1 : 0;
+    }
+
+    if (0 != qzip_sink_write(&(qz_stream_cookie->sink), qz_strm_bufm->buf,
+                             qz_strm_bufm->consumed)) {
+        QC_ERROR("qzip_stream_cookie_write: failed to write %u bytes\n",
+                 qz_strm_bufm->consumed);
+        qz_stream_cookie->error = 1;
+        errno = EIO;
+    }
+    qz_strm_bufm->consumed = 0;
+
+    return qz_stream_cookie->error ? -1 : 0;
+}
+
 static ssize_t
 qzip_stream_cookie_write(void *cookie, const char *buf, size_t size)
 {
     qzip_stream_cookie_t *qz_stream_cookie =
         (qzip_stream_cookie_t *)cookie;
-    QzSession_T *qz_sess    = &(qz_stream_cookie->qz_sess);
+    QzSession_T *qz_sess    = qz_stream_cookie->qz_sess;
     QzStream_T *qz_strm     = &(qz_stream_cookie->qz_strm);
     bufm_t *qz_strm_bufm    = &(qz_stream_cookie->qz_strm_bufm);
     const char *src         = buf;
@@ -397,10 +5281,16 @@ qzip_stream_cookie_write(void *cookie, const char *buf, size_t size)
     unsigned int consumed   = 0;
     unsigned int input_left = src_len - consumed;
     unsigned int bytes_written;
+    unsigned long long start, elapsed;
     int rc;
 
     QC_DEBUG("qzip_stream_cookie_write: new buf (%d)\n", size);
 
+    // Short counts, as glibc can't take -1 from an unbuffered cookie's fwrite
+    if (qz_stream_cookie->error) {
+        return 0;
+    }
+
     do {
         qz_strm->in     = src + consumed;
         qz_strm->out    = qz_strm_bufm->buf + qz_strm_bufm->consumed;
@@ -410,7 +5300,9 @@ qzip_stream_cookie_write(void *cookie, const char *buf, size_t size)
         QC_DEBUG("qzip_stream_cookie_write: before: to_in %7d (%7d pending), remain %7d (%7d pending)\n",
                 qz_strm->in_sz, qz_strm->pending_in, qz_strm->out_sz, qz_strm->pending_out);
 
+        start = qzip_now_ns();
         rc = qzCompressStream(qz_sess, qz_strm, 0);
+        elapsed = qzip_now_ns() - start;
         if (rc != QZ_OK) {
             QC_ERROR("qzip_stream_cookie_write: failed with error: %d\n", rc);
             QC_ERROR("qzip_stream_cookie_write: input_left %d, output_left %d\n",
@@ -421,6 +5313,9 @@ qzip_stream_cookie_write(void *cookie, const char *buf, size_t size)
         {
             consumed                += qz_strm->in_sz;
             qz_strm_bufm->consumed  += qz_strm->out_sz;
+            qzip_stats_add(&(qz_stream_cookie->stats), qz_sess,
+                           &(qz_stream_cookie->qz_sess_params),
+                           qz_strm->in_sz, qz_strm->out_sz, elapsed);
 
             input_left = src_len - consumed;
         }
@@ -431,30 +5326,33 @@ qzip_stream_cookie_write(void *cookie, const char *buf, size_t size)
                 consumed, input_left);
 
         // When internal buffer is full, do data flush then reset buffer cursor
-        if (qz_strm_bufm->consumed == qz_strm_bufm->size) {
-            bufm_flush(qz_strm_bufm, qz_stream_cookie->fp);
+        if (qz_strm_bufm->consumed == qz_strm_bufm->size &&
+            0 != qzip_stream_cookie_flush_out(qz_stream_cookie)) {
+            break;
         }
     } while (input_left);
 
     QC_DEBUG("qzip_stream_cookie_write: end buf\n");
 
-    return consumed;
+    return qz_stream_cookie->error ? 0 : consumed;
 }
 
+// Drain the stream and release the cookie. The file under it is closed only
+// with `owned` set.
 static int
-qzip_stream_cookie_close(void *cookie)
+qzip_stream_cookie_release(qzip_stream_cookie_t *qz_stream_cookie, int owned)
 {
-    qzip_stream_cookie_t *qz_stream_cookie =
-        (qzip_stream_cookie_t *)cookie;
-    QzSession_T *qz_sess    = &(qz_stream_cookie->qz_sess);
+    QzSession_T *qz_sess    = qz_stream_cookie->qz_sess;
     QzStream_T *qz_strm     = &(qz_stream_cookie->qz_strm);
     bufm_t *qz_strm_bufm    = &(qz_stream_cookie->qz_strm_bufm);
+    int error;
 
+    qzip_registry_del(qz_stream_cookie);
     // Flush data buffer to make room
-    bufm_flush(qz_strm_bufm, qz_stream_cookie->fp);
+    qzip_stream_cookie_flush_out(qz_stream_cookie);
     // Flush pendding data in QAT stream, then flush data buffer
     int done = (0 == qz_strm->pending_in && 0 == qz_strm->pending_out) ? 1 : 0;
-    while (!done) {
+    while (!done && !qz_stream_cookie->error) {
         qz_strm->in = NULL;
         qz_strm->out = qz_strm_bufm->buf + qz_strm_bufm->consumed;
         qz_strm->in_sz = 0;
@@ -466,6 +5364,7 @@ qzip_stream_cookie_close(void *cookie)
         int rc = qzCompressStream(qz_sess, qz_strm, 1);
         if (rc != QZ_OK) {
             QC_ERROR("qzip_stream_cookie_close: failed with error: %d\n", rc);
+            qz_stream_cookie->error = 1;
             break;
         }
 
@@ -473,21 +5372,40 @@ qzip_stream_cookie_close(void *cookie)
                 qz_strm->in_sz, qz_strm->pending_in, qz_strm->out_sz, qz_strm->pending_out);
 
         qz_strm_bufm->consumed  += qz_strm->out_sz;
+        qz_stream_cookie->stats.bytes_out += qz_strm->out_sz;
 
         done = (0 == qz_strm->pending_in && 0 == qz_strm->pending_out) ? 1 : 0;
     } {
-        bufm_flush(qz_strm_bufm, qz_stream_cookie->fp);
+        if (0 == qz_stream_cookie->stats.bytes_out) {
+            memcpy(qz_strm_bufm->buf, gzip_empty_member, sizeof(gzip_empty_member));
+            qz_strm_bufm->consumed = sizeof(gzip_empty_member);
+            qz_stream_cookie->stats.bytes_out += sizeof(gzip_empty_member);
+        }
+        qzip_stream_cookie_flush_out(qz_stream_cookie);
     }
 
-    fclose(qz_stream_cookie->fp);
+    error = qz_stream_cookie->error;
+    error |= qzip_sink_close(&(qz_stream_cookie->sink), owned);
     bufm_destor(qz_strm_bufm);
 
     qzEndStream(qz_sess, qz_strm);
-    qzTeardownSession(qz_sess);
-    qzClose(qz_sess);
+    qzip_sess_put(qz_sess);
+    qzip_stats_retire(&(qz_stream_cookie->stats));
     free(qz_stream_cookie);
 
-    return 0;
+    return error ? EOF : 0;
+}
+
+static int
+qzip_stream_cookie_close(void *cookie)
+{
+    return qzip_stream_cookie_release((qzip_stream_cookie_t *)cookie, 1);
+}
+
+static void
+qzip_stream_cookie_stats(void *cookie, qzip_cookie_stats_t *stats)
+{
+    *stats = ((qzip_stream_cookie_t *)cookie)->stats;
 }
 
 static cookie_io_functions_t qzip_stream_write_funcs = {
@@ -498,6 +5416,14 @@ static cookie_io_functions_t qzip_stream_write_funcs = {
 FILE *
 qzip_stream_fopen(const char *fname, const char *mode)
 {
+    char fmode[16];
+
+    if (mode[0] == 'r') {
+        FILE *fp = fopen(fname, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+        assert(fp != NULL);
+        return qzip_stream_read_hook(fp, mode, qzip_stream_read_funcs);
+    }
+
     qzip_stream_cookie_t *qz_stream_cookie =
         (qzip_stream_cookie_t *)calloc(1, sizeof(qzip_stream_cookie_t));
     assert(qz_stream_cookie != NULL);
@@ -506,8 +5432,10 @@ qzip_stream_fopen(const char *fname, const char *mode)
     QzSessionParams_T *qz_sess_params = &(qz_stream_cookie->qz_sess_params);
     int rc;
 
-    rc = qzGetDefaults(qz_sess_params);
-    assert(rc == QZ_OK);
+    rc = qzip_sess_params_setup(qz_sess_params, NULL, mode);
+    assert(rc == 0);
+    qz_stream_cookie->qz_sess = qzip_sess_get(qz_sess_params);
+    assert(qz_stream_cookie->qz_sess != NULL);
 
     bufm_t *qz_strm_bufm = &(qz_stream_cookie->qz_strm_bufm);
     // Allocate an internal buffer to save stream's output
@@ -515,59 +5443,24 @@ qzip_stream_fopen(const char *fname, const char *mode)
     assert(rc == 0);
 
     // Open specific file to save compressed data
-    qz_stream_cookie->fp = fopen(fname, mode);
-    assert(qz_stream_cookie->fp != NULL);
+    FILE *fp = fopen(fname, qzip_fopen_mode(mode, fmode, sizeof(fmode)));
+    assert(fp != NULL);
+    qzip_sink_init_fp(&(qz_stream_cookie->sink), fp);
+    qz_stream_cookie->sink.write_ns = &(qz_stream_cookie->stats.write_ns);
+
+    FILE *cookie_fp = fopencookie(qz_stream_cookie, mode, qzip_stream_write_funcs);
+
+    rc = qzip_registry_add(cookie_fp, qz_stream_cookie, NULL, qzip_stream_cookie_stats);
+    assert(0 == rc);
 
-    return fopencookie(qz_stream_cookie, mode, qzip_stream_write_funcs);
+    return cookie_fp;
 }
 
+// Won't close the hooked file
 static int
 qzip_stream_cookie_close2(void *cookie)
 {
-    qzip_stream_cookie_t *qz_stream_cookie =
-        (qzip_stream_cookie_t *)cookie;
-    QzSession_T *qz_sess    = &(qz_stream_cookie->qz_sess);
-    QzStream_T *qz_strm     = &(qz_stream_cookie->qz_strm);
-    bufm_t *qz_strm_bufm    = &(qz_stream_cookie->qz_strm_bufm);
-
-    // Flush data buffer to make room
-    bufm_flush(qz_strm_bufm, qz_stream_cookie->fp);
-    // Flush pendding data in QAT stream, then flush data buffer
-    int done = (0 == qz_strm->pending_in && 0 == qz_strm->pending_out) ? 1 : 0;
-    while (!done) {
-        qz_strm->in = NULL;
-        qz_strm->out = qz_strm_bufm->buf + qz_strm_bufm->consumed;
-        qz_strm->in_sz = 0;
-        qz_strm->out_sz = qz_strm_bufm->size - qz_strm_bufm->consumed;
-
-        QC_DEBUG("qzip_stream_cookie_close: before: to_in %7d (%7d pending), remain %7d (%7d pending)\n",
-                qz_strm->in_sz, qz_strm->pending_in, qz_strm->out_sz, qz_strm->pending_out);
-
-        int rc = qzCompressStream(qz_sess, qz_strm, 1);
-        if (rc != QZ_OK) {
-            QC_ERROR("qzip_stream_cookie_close: failed with error: %d\n", rc);
-            break;
-        }
-
-        QC_DEBUG("qzip_stream_cookie_close:  after: in_ed %7d (%7d pending), output %7d (%7d pending)\n",
-                qz_strm->in_sz, qz_strm->pending_in, qz_strm->out_sz, qz_strm->pending_out);
-
-        qz_strm_bufm->consumed  += qz_strm->out_sz;
-
-        done = (0 == qz_strm->pending_in && 0 == qz_strm->pending_out) ? 1 : 0;
-    } {
-        bufm_flush(qz_strm_bufm, qz_stream_cookie->fp);
-    }
-
-    //fclose(qz_stream_cookie->fp);
-    bufm_destor(qz_strm_bufm);
-
-    qzEndStream(qz_sess, qz_strm);
-    qzTeardownSession(qz_sess);
-    qzClose(qz_sess);
-    free(qz_stream_cookie);
-
-    return 0;
+    return qzip_stream_cookie_release((qzip_stream_cookie_t *)cookie, 0);
 }
 
 static cookie_io_functions_t qzip_stream_write2_funcs = {
@@ -578,6 +5471,10 @@ static cookie_io_functions_t qzip_stream_write2_funcs = {
 FILE *
 qzip_stream_hook(FILE *fp, const char *mode)
 {
+    if (mode[0] == 'r') {
+        return qzip_stream_read_hook(fp, mode, qzip_stream_read2_funcs);
+    }
+
     qzip_stream_cookie_t *qz_stream_cookie =
         (qzip_stream_cookie_t *)calloc(1, sizeof(qzip_stream_cookie_t));
     assert(qz_stream_cookie != NULL);
@@ -586,18 +5483,24 @@ qzip_stream_hook(FILE *fp, const char *mode)
     QzSessionParams_T *qz_sess_params = &(qz_stream_cookie->qz_sess_params);
     int rc;
 
-    rc = qzGetDefaults(qz_sess_params);
-    assert(rc == QZ_OK);
+    rc = qzip_sess_params_setup(qz_sess_params, NULL, mode);
+    assert(rc == 0);
+    qz_stream_cookie->qz_sess = qzip_sess_get(qz_sess_params);
+    assert(qz_stream_cookie->qz_sess != NULL);
 
     bufm_t *qz_strm_bufm = &(qz_stream_cookie->qz_strm_bufm);
     // Allocate an internal buffer to save stream's output
     rc = bufm_init(qz_strm_bufm, HUGEPAGE);
     assert(rc == 0);
 
-    //qz_stream_cookie->fp = fopen(fname, mode);
-    //assert(qz_stream_cookie->fp != NULL);
-    qz_stream_cookie->fp = fp;
+    qzip_sink_init_fp(&(qz_stream_cookie->sink), fp);
+    qz_stream_cookie->sink.write_ns = &(qz_stream_cookie->stats.write_ns);
 
-    return fopencookie(qz_stream_cookie, mode, qzip_stream_write2_funcs);
+    FILE *cookie_fp = fopencookie(qz_stream_cookie, mode, qzip_stream_write2_funcs);
+
+    rc = qzip_registry_add(cookie_fp, qz_stream_cookie, NULL, qzip_stream_cookie_stats);
+    assert(0 == rc);
+
+    return cookie_fp;
 }
 // \end qzip stream cookie
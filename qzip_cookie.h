@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <sys/time.h>
 
+#include "qatzip.h"
+
 #define QC_MAXDATA  (512*1024*1024)
 
 #ifdef QZ_COOKIE_DEBUG
@@ -21,29 +23,173 @@ typedef struct {
     struct timeval time_e;
 } run_time_t;
 
-typedef struct run_time_list_node_ {
-    run_time_t                 rtime;
-    struct run_time_list_node_ *next;
-} run_time_list_node_t;
+// Allocator for large buffers. It tries explicitly reserved huge pages
+// (MAP_HUGETLB) first, then transparent huge pages (MADV_HUGEPAGE), then
+// malloc. Requests under 2 MB always use malloc. `kind`, if not NULL,
+// receives the backing used; pass it back to `qzip_huge_free`.
+enum {
+    QC_HUGE_HUGETLB,
+    QC_HUGE_THP,
+    QC_HUGE_MALLOC,
+};
+
+void * qzip_huge_alloc(size_t sz, int *kind);
+void   qzip_huge_free(void *m, size_t sz, int kind);
+const char * qzip_huge_kind_str(int kind);
+
+// QAT sessions are shared by all cookies through a process-wide pool keyed
+// by session parameters. Warm-up pre-initialises `count` sessions with
+// `params` (NULL for QATzip's defaults) so that later opens hit the pool.
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long idle;
+} qzip_sess_pool_stats_t;
+
+int  qzip_sess_pool_warmup(const QzSessionParams_T *params, unsigned int count);
+void qzip_sess_pool_get_stats(qzip_sess_pool_stats_t *stats);
+void qzip_sess_pool_drain(void);
 
-#define LIST_NEW() \
-    (run_time_list_node_t *)calloc(1, sizeof(run_time_list_node_t));
+// Per-cookie tunables. Start from `qzip_params_init`, which fills in
+// QATzip's defaults, then override what matters. A level digit in the mode
+// string, as in "w6", overrides `comp_lvl`.
+typedef struct {
+    unsigned int comp_lvl;          // 1..9
+    unsigned int hw_buff_sz;        // power of 2, 4 KB..512 KB
+    unsigned int poll_sleep;        // nanosleep between polls, 0..100, 0 to busy-poll
+    unsigned int input_sz_thrshold; // smaller requests go to software
+    unsigned int nslots;            // ring depth for pipelined writes, up to 64, 0 to disable
+    unsigned int pinned;            // stage requests in pinned memory
+    unsigned int coalesce_sz;       // batch smaller writes up to this size, 0 to disable
+    unsigned int direct;            // O_DIRECT output, qzip_fdopen_ex only
+    unsigned int uring;             // io_uring queue depth, qzip_fdopen_ex only, 0 to disable
+    unsigned int seekable;          // append a seek index, see below
+    unsigned int passthrough;       // store chunks that look incompressible uncompressed
+} qzip_params_t;
 
-#define LIST_ADD(list_head, list_node)                          \
-{                                                               \
-    list_node->next = (list_head == NULL) ? NULL : list_head;   \
-    list_head = list_node;                                      \
-}
+int qzip_params_init(qzip_params_t *params);
 
-#define LIST_FOR(list_head, list_node)  \
-    for (list_node = list_head; list_node != NULL; list_node = list_node->next)
+// CRC-32 as in gzip, same results as zlib's `crc32` and `crc32_combine`.
+// Large buffers are folded with VPCLMULQDQ or PCLMULQDQ, whichever the CPU
+// has, and the rest goes to zlib. QZIP_CRC32_IMPL=pclmulqdq or scalar in
+// the environment caps the kernel used.
+unsigned long qzip_crc32(unsigned long crc, const void *buf, size_t len);
+unsigned long qzip_crc32_combine(unsigned long crc1, unsigned long crc2, unsigned long long len2);
+const char * qzip_crc32_impl(void);  // "vpclmulqdq", "pclmulqdq" or "scalar"
 
 FILE * gzip_fopen(const char *fname, const char *mode);
+// zlib on `nworkers` threads, as pigz does, for hosts without QAT and as a
+// fair baseline. Output is a single gzip member. Reading is single-threaded.
+FILE * gzip_parallel_fopen(const char *fname, const char *mode, unsigned int nworkers);
+FILE * gzip_parallel_hook(FILE *fp, const char *mode, unsigned int nworkers);
 
 FILE * qzip_fopen(const char *fname, const char *mode);
 FILE * qzip_hook(FILE *fp, const char *mode);
+// Return NULL with errno set to EINVAL when `params` are out of range, or to
+// ENOMEM when the cookie's buffers or ring can't be set up.
+//
+// With `params->seekable` set, output ends with an index of member offsets,
+// stored in empty gzip members so that gzip(1) still reads it. Read cookies
+// of these constructors pick the index up from a seekable file and jump
+// straight to the member holding the target of fseeko; SEEK_END works too.
+// Without an index, fseeko decompresses from the start or the current
+// position up to the target.
+FILE * qzip_fopen_ex(const char *fname, const char *mode, const qzip_params_t *params);
+FILE * qzip_hook_ex(FILE *fp, const char *mode, const qzip_params_t *params);
+// Write straight to `fd` with `writev`, bypassing stdio. Pipelined cookies
+// gather every finished ring slot into one call. With `params->uring` set,
+// output is queued to io_uring as asynchronous writes instead, falling back
+// to `writev` if the kernel doesn't allow it. Pipelined cookies on a pipe
+// move output pages into the pipe with `vmsplice` rather than copying them.
+// fclose closes `fd`, which is left open if the call fails.
+FILE * qzip_fdopen_ex(int fd, const char *mode, const qzip_params_t *params);
 FILE * my_qzip_hook(FILE *fp, const char *mode);
 
+// Counters kept by every qzip cookie. `bytes_in` is what the cookie was fed
+// and `bytes_out` what it produced, so they are uncompressed and compressed
+// bytes respectively for writers, and the other way around for readers.
+// QATzip doesn't report where a request ran, so the split of input between
+// hardware and software is estimated from the session's hardware status and
+// its SW-failover threshold.
+//
+// Each request is also recorded in fixed-size histograms with power-of-two
+// buckets: bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeros.
+// Recording is a handful of atomic adds, so it's always on. Times come from
+// CLOCK_MONOTONIC in nanoseconds. `p50`, `p99` and `p999` are interpolated
+// within their bucket by `qzip_cookie_get_stats`, so they are estimates.
+#define QC_HIST_BUCKETS 64
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long buckets[QC_HIST_BUCKETS];
+} qzip_hist_t;
+
+typedef struct {
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long hw_bytes;
+    unsigned long long sw_bytes;
+    unsigned long long requests;
+    unsigned long long stored_bytes;    // input stored as-is, see `passthrough`
+    unsigned long long route_hw_bytes;  // input a parallel cookie sent to QAT sessions
+    unsigned long long route_sw_bytes;  // input a hybrid cookie sent to zlib threads
+    qzip_hist_t        comp_ns;     // per (de)compression request
+    qzip_hist_t        write_ns;    // per write of output to the underlying file
+    qzip_hist_t        req_bytes;   // input bytes per request
+} qzip_cookie_stats_t;
+
+// Counters of an open cookie, or with `fp` NULL the sum over every cookie
+// closed so far, final output included. Return -1 with errno set to EBADF
+// if `fp` isn't a qzip cookie.
+int qzip_cookie_get_stats(FILE *fp, qzip_cookie_stats_t *stats);
+
+// qzip cookies batch small writes into one hardware buffer before
+// compressing them, see `coalesce_sz`. fflush only reaches the cookie, so use
+// this to push batched data down to the underlying file. Returns 0, or EOF
+// with errno set to EBADF if `fp` isn't a qzip cookie and to ENOTSUP if it
+// is one that can't be flushed.
+int qzip_flush(FILE *fp);
+
+// Pipelined variants: compressed data is written out by a background thread
+// through a ring of `nslots` buffers, so compression overlaps with IO.
+// fclose waits for the ring to drain. Return NULL if it can't be set up.
+FILE * qzip_fopen_async(const char *fname, const char *mode, unsigned int nslots);
+FILE * qzip_hook_async(FILE *fp, const char *mode, unsigned int nslots);
+
+// Parallel variants: writes are cut into fixed-size blocks compressed by
+// `nworkers` threads with one QAT session each. Blocks are written out in
+// input order as a multi-member gzip stream.
+FILE * qzip_parallel_fopen(const char *fname, const char *mode, unsigned int nworkers);
+FILE * qzip_parallel_hook(FILE *fp, const char *mode, unsigned int nworkers);
+
+// A parallel cookie with `nsw` more workers compressing with zlib. Each block
+// goes to whichever of the two pools is expected to finish it first, given
+// their recent latency and how much work is queued on them.
+typedef struct {
+    unsigned int nhw;           // workers owning a QAT session
+    unsigned int nsw;           // workers compressing with zlib
+    unsigned int hw_delay_us;   // added to each QAT request, to simulate a busy device
+} qzip_hybrid_params_t;
+
+FILE * qzip_hybrid_fopen(const char *fname, const char *mode, const qzip_hybrid_params_t *params);
+FILE * qzip_hybrid_hook(FILE *fp, const char *mode, const qzip_hybrid_params_t *params);
+
+// A file many threads write to at once. Each thread gets a FILE * of its
+// own with `qzip_shared_attach`, so they don't contend for one stdio lock,
+// and each fwrite or fprintf on it is a record, kept whole. Records are
+// queued without locking and packed into members by a compression thread.
+// The file ends when the last of the streams, attached or not, is closed;
+// errors of the whole file are then reported by that fclose.
+FILE * qzip_shared_fopen(const char *fname, const char *mode);
+FILE * qzip_shared_hook(FILE *fp, const char *mode);
+// Return NULL with errno set to EBADF if `fp` isn't a shared cookie.
+FILE * qzip_shared_attach(FILE *fp);
+
 FILE * qzip_stream_fopen(const char *fname, const char *mode);
 FILE * qzip_stream_hook(FILE *fp, const char *mode);
 
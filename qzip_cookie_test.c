@@ -1,6 +1,7 @@
 // vim: set sw=4 ts=4 sts=4 et tw=78
 //
 // ATTENTION: Just check if API is runnable but not check it's correctness.
+// Correctness is covered by qzip_cookie_verify.c, see `make test`.
 //
 
 #include "qzip_cookie.h"
@@ -15,17 +16,26 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
+#include <zlib.h>
 #include "qatzip.h"
 
 #define MAXDATA QC_MAXDATA
 #define MAXPATH (1024)
 
 static char fpath_buf[MAXPATH];
-static char fdata_buf[MAXDATA];
+static char *fdata_buf;
 
 static run_time_t run_time;
 
+// Session knobs given on the commandline, used by the qzip_fopen/qzip_hook
+// based cases
+static qzip_params_t qz_params;
+
+void test_qzip_stream(const char *fpath);
+
 // Refer to QATzip/utils/qzip.c:displayStats
 void display_stats(run_time_t *run_time, unsigned int insize)
 {
@@ -89,13 +99,28 @@ static void def(FILE *fin, FILE *fout)
     } while (bytes_read == MAXDATA);
 }
 
+static size_t inf(FILE *fin)
+{
+    size_t bytes_read = 0;
+    size_t total_read = 0;
+
+    do {
+        bytes_read = fread(fdata_buf, 1, MAXDATA, fin);
+        total_read += bytes_read;
+    } while (bytes_read == MAXDATA);
+
+    assert(!ferror(fin));
+    return total_read;
+}
+
 void test_gzip(const char *fpath)
 {
     FILE *fin = fopen(fpath, "r");
     assert(fin != NULL);
 
+    // zlib on every online CPU, the baseline the other cookies are held to
     sprintf(fpath_buf, "%s.gz", fpath);
-    FILE *gz_fout = gzip_fopen(fpath_buf, "w");
+    FILE *gz_fout = gzip_parallel_fopen(fpath_buf, "w", sysconf(_SC_NPROCESSORS_ONLN));
     assert(gz_fout != NULL);
 
     gettimeofday(&run_time.time_s, NULL);
@@ -115,7 +140,7 @@ void test_qzip(const char *fpath)
     assert(fin != NULL);
 
     sprintf(fpath_buf, "%s.qz", fpath);
-    FILE *qz_fout = qzip_fopen(fpath_buf, "w");
+    FILE *qz_fout = qzip_fopen_ex(fpath_buf, "w", &qz_params);
     assert(qz_fout != NULL);
 
     gettimeofday(&run_time.time_s, NULL);
@@ -129,6 +154,66 @@ void test_qzip(const char *fpath)
     display_stats(&run_time, file_size(fpath));
 }
 
+// Decompress `zpath` with gzread as baseline, then with the read cookie
+// returned by `qz_open`
+static void bench_decomp(const char *zpath, size_t fsize,
+                         FILE *(*qz_open)(const char *, const char *))
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    size_t bytes_read;
+
+    FILE *gz_fin = gzip_fopen(zpath, "r");
+    assert(gz_fin != NULL);
+
+    gettimeofday(&base_run_time.time_s, NULL);
+    bytes_read = inf(gz_fin);
+    gettimeofday(&base_run_time.time_e, NULL);
+
+    fclose(gz_fin);
+    assert(bytes_read == fsize);
+
+    printf("Test gzread done\n");
+    display_stats(&base_run_time, fsize);
+
+    FILE *qz_fin = qz_open(zpath, "r");
+    assert(qz_fin != NULL);
+
+    gettimeofday(&my_run_time.time_s, NULL);
+    bytes_read = inf(qz_fin);
+    gettimeofday(&my_run_time.time_e, NULL);
+
+    fclose(qz_fin);
+    assert(bytes_read == fsize);
+
+    display_stats(&my_run_time, fsize);
+    display_speedup(&base_run_time, &my_run_time);
+}
+
+// Decompress `<fpath>.qz` produced by `test_qzip`
+void test_qzip_decomp(const char *fpath)
+{
+    sprintf(fpath_buf, "%s.qz", fpath);
+    if (access(fpath_buf, R_OK) != 0) {
+        test_qzip(fpath);
+    }
+
+    printf("Test qzip decompression\n");
+    bench_decomp(fpath_buf, file_size(fpath), qzip_fopen);
+}
+
+// Decompress `<fpath>.qz_s` produced by `test_qzip_stream`
+void test_qzip_stream_decomp(const char *fpath)
+{
+    sprintf(fpath_buf, "%s.qz_s", fpath);
+    if (access(fpath_buf, R_OK) != 0) {
+        test_qzip_stream(fpath);
+    }
+
+    printf("Test qzip stream decompression\n");
+    bench_decomp(fpath_buf, file_size(fpath), qzip_stream_fopen);
+}
+
 // This function will write compressed data to stderr
 void bench_qzip(const char *fpath, int chunk_size)
 {
@@ -179,21 +264,709 @@ void bench_qzip(const char *fpath, int chunk_size)
     display_speedup(&base_run_time, &my_run_time);
 }
 
-extern run_time_list_node_t *run_time_list_head;
+// \begin slow sink
+// Discard data at a bounded bandwidth to mimic a slow disk
+static ssize_t
+slow_sink_write(void *cookie, const char *buf, size_t size)
+{
+    unsigned long mbps = *(unsigned long *)cookie;
 
-void display_stats_chained(run_time_list_node_t *rtime_list_head, unsigned int insize)
+    usleep(size / mbps);    // bytes / (MB/s) gives microseconds
+    return size;
+}
+
+static int
+slow_sink_close(void *cookie)
 {
+    free(cookie);
+    return 0;
+}
 
-    unsigned long us_begin = 0;
-    unsigned long us_end   = 0;
-    double us_diff         = 0;
-    run_time_list_node_t *curr_tnode = NULL;
+static FILE *slow_sink_fopen(unsigned long mbps)
+{
+    static cookie_io_functions_t slow_sink_funcs = {
+        .write = slow_sink_write,
+        .close = slow_sink_close
+    };
+    unsigned long *cookie = malloc(sizeof(unsigned long));
+    assert(cookie != NULL);
+    *cookie = mbps;
+
+    FILE *fp = fopencookie(cookie, "w", slow_sink_funcs);
+    assert(fp != NULL);
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    return fp;
+}
+// \end slow sink
+
+// Compare blocking writes with the pipelined writer on a sink limited to
+// `mbps` MB/s
+void bench_async(const char *fpath, int chunk_size, unsigned long mbps)
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
 
-    LIST_FOR(run_time_list_head, curr_tnode) {
-        us_begin = curr_tnode->rtime.time_s.tv_sec * 1e6 + curr_tnode->rtime.time_s.tv_usec;
-        us_end   = curr_tnode->rtime.time_e.tv_sec * 1e6 + curr_tnode->rtime.time_e.tv_usec;
-        us_diff += (us_end - us_begin);
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    // \begin bench baseline
+    FILE *sink = slow_sink_fopen(mbps);
+    qz_params.nslots = 0;
+    FILE *fout = qzip_hook_ex(sink, "w", &qz_params);
+    assert(fout != NULL);
+    gettimeofday(&base_run_time.time_s, NULL);
+    for (off = 0; off < fsize; off += chunk_size) {
+        bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+        bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+        assert(bytes_written == bytes_to_write);
     }
+    fclose(fout);
+    gettimeofday(&base_run_time.time_e, NULL);
+    fclose(sink);
+    printf("Test qzip with blocking writes done\n");
+    display_stats(&base_run_time, fsize);
+    // \end bench baseline
+
+    // \begin bench pipelined version
+    sink = slow_sink_fopen(mbps);
+    qz_params.nslots = 4;
+    fout = qzip_hook_ex(sink, "w", &qz_params);
+    assert(fout != NULL);
+    gettimeofday(&my_run_time.time_s, NULL);
+    for (off = 0; off < fsize; off += chunk_size) {
+        bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+        bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+        assert(bytes_written == bytes_to_write);
+    }
+    fclose(fout);
+    gettimeofday(&my_run_time.time_e, NULL);
+    fclose(sink);
+    printf("Test qzip with pipelined writes done\n");
+    display_stats(&my_run_time, fsize);
+    // \end bench pipelined version
+
+    display_speedup(&base_run_time, &my_run_time);
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Scale the parallel cookie from one worker up to `max_workers`, against
+// zlib on as many threads. This function will write compressed data to stderr
+void bench_parallel(const char *fpath, int chunk_size, int max_workers)
+{
+    run_time_t base_run_time;
+    run_time_t gz_run_time;
+    run_time_t my_run_time;
+    int nworkers;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    for (nworkers = 1; nworkers <= max_workers; nworkers *= 2) {
+        FILE *gz_fout = gzip_parallel_hook(stderr, "w", nworkers);
+        assert(gz_fout != NULL);
+        gettimeofday(&gz_run_time.time_s, NULL);
+        for (off = 0; off < fsize; off += chunk_size) {
+            bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            bytes_written  = fwrite(addr + off, 1, bytes_to_write, gz_fout);
+            assert(bytes_written == bytes_to_write);
+        }
+        fclose(gz_fout);
+        gettimeofday(&gz_run_time.time_e, NULL);
+
+        printf("Test gzip parallel with %d workers done\n", nworkers);
+        display_stats(&gz_run_time, fsize);
+
+        FILE *fout = qzip_parallel_hook(stderr, "w", nworkers);
+        assert(fout != NULL);
+        gettimeofday(&my_run_time.time_s, NULL);
+        for (off = 0; off < fsize; off += chunk_size) {
+            bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+            assert(bytes_written == bytes_to_write);
+        }
+        fclose(fout);
+        gettimeofday(&my_run_time.time_e, NULL);
+
+        printf("Test qzip parallel with %d workers done\n", nworkers);
+        display_stats(&my_run_time, fsize);
+        display_speedup(&gz_run_time, &my_run_time);
+        if (nworkers == 1) {
+            base_run_time = my_run_time;
+        } else {
+            display_speedup(&base_run_time, &my_run_time);
+        }
+    }
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Compare QAT workers alone with QAT and zlib workers side by side, while
+// each QAT request is delayed more and more to mimic a device shared with
+// other tenants. This function will write compressed data to stderr
+void bench_hybrid(const char *fpath, int chunk_size, int max_workers)
+{
+    static const unsigned int delays_us[] = { 0, 1000, 10000 };
+    qzip_cookie_stats_t before, after;
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    unsigned int i, nsw;
+    int rc;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    for (i = 0; i < sizeof(delays_us) / sizeof(delays_us[0]); i++) {
+        for (nsw = 0; nsw <= (unsigned int)max_workers; nsw += max_workers) {
+            qzip_hybrid_params_t params = { max_workers, nsw, delays_us[i] };
+            rc = qzip_cookie_get_stats(NULL, &before);
+            assert(rc == 0);
+            FILE *fout = qzip_hybrid_hook(stderr, "w", &params);
+            assert(fout != NULL);
+            gettimeofday(&my_run_time.time_s, NULL);
+            for (off = 0; off < fsize; off += chunk_size) {
+                bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+                bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+                assert(bytes_written == bytes_to_write);
+            }
+            fclose(fout);
+            gettimeofday(&my_run_time.time_e, NULL);
+            // Counters of a cookie move to the totals once it's closed
+            rc = qzip_cookie_get_stats(NULL, &after);
+            assert(rc == 0);
+
+            printf("Test qzip hybrid with %d+%u workers, %u us QAT delay done\n",
+                   max_workers, nsw, delays_us[i]);
+            printf("Routed %llu bytes to QAT and %llu bytes to zlib\n",
+                   after.route_hw_bytes - before.route_hw_bytes,
+                   after.route_sw_bytes - before.route_sw_bytes);
+            display_stats(&my_run_time, fsize);
+            if (nsw == 0) {
+                base_run_time = my_run_time;
+            } else {
+                display_speedup(&base_run_time, &my_run_time);
+            }
+        }
+    }
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// CRC32 of the file in `chunk_size` pieces with zlib then with the folding
+// kernel, followed by the cost of combining the CRCs of 1 MB blocks
+void bench_crc32(const char *fpath, int chunk_size)
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    unsigned long base_crc = 0, my_crc = 0, comb_crc = 0;
+    int i, passes = 8;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t n, off;
+
+    gettimeofday(&base_run_time.time_s, NULL);
+    for (i = 0; i < passes; i++) {
+        for (base_crc = 0, off = 0; off < fsize; off += n) {
+            n = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            base_crc = crc32(base_crc, (unsigned char *)addr + off, n);
+        }
+    }
+    gettimeofday(&base_run_time.time_e, NULL);
+    printf("Test zlib crc32 done\n");
+    display_stats(&base_run_time, fsize * passes);
+
+    gettimeofday(&my_run_time.time_s, NULL);
+    for (i = 0; i < passes; i++) {
+        for (my_crc = 0, off = 0; off < fsize; off += n) {
+            n = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            my_crc = qzip_crc32(my_crc, addr + off, n);
+        }
+    }
+    gettimeofday(&my_run_time.time_e, NULL);
+    printf("Test qzip_crc32 (%s) done\n", qzip_crc32_impl());
+    display_stats(&my_run_time, fsize * passes);
+    display_speedup(&base_run_time, &my_run_time);
+
+    // As the parallel cookies do, one block at a time
+    gettimeofday(&my_run_time.time_s, NULL);
+    for (off = 0; off < fsize; off += n) {
+        n = ((fsize - off) < (1 << 20)) ? (fsize - off) : (1 << 20);
+        comb_crc = qzip_crc32_combine(comb_crc, qzip_crc32(0, addr + off, n), n);
+    }
+    gettimeofday(&my_run_time.time_e, NULL);
+    printf("Test qzip_crc32 by 1 MB blocks with qzip_crc32_combine done\n");
+    display_stats(&my_run_time, fsize);
+
+    assert(base_crc == my_crc && base_crc == comb_crc);
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+typedef struct {
+    FILE        *fout;      // NULL to attach a stream of the thread's own
+    FILE        *shared;
+    const char  *addr;
+    size_t      fsize;
+    int         chunk_size;
+    int         id;
+    int         nthreads;
+} writer_arg_t;
+
+// Write every `nthreads`-th record of the file, starting at record `id`
+static void *writer_thread(void *arg)
+{
+    writer_arg_t *w = (writer_arg_t *)arg;
+    FILE *fout = w->fout;
+    size_t bytes_to_write, bytes_written, off;
+
+    if (NULL == fout) {
+        fout = qzip_shared_attach(w->shared);
+        assert(fout != NULL);
+    }
+    for (off = (size_t)w->id * w->chunk_size; off < w->fsize;
+         off += (size_t)w->nthreads * w->chunk_size) {
+        bytes_to_write = ((w->fsize - off) < w->chunk_size) ? (w->fsize - off) : w->chunk_size;
+        bytes_written  = fwrite(w->addr + off, 1, bytes_to_write, fout);
+        assert(bytes_written == bytes_to_write);
+    }
+    if (NULL == w->fout) {
+        fclose(fout);
+    }
+
+    return NULL;
+}
+
+// From 1 up to 64 threads writing `chunk_size` records to one compressed
+// file: all through one qzip FILE *, then each through a stream attached to
+// a shared cookie. This function will write compressed data to stderr
+void bench_shared(const char *fpath, int chunk_size)
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    writer_arg_t args[64];
+    pthread_t threads[64];
+    int i, nthreads, rc;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    for (nthreads = 1; nthreads <= 64; nthreads *= 2) {
+        FILE *fout = qzip_hook(stderr, "w");
+        assert(fout != NULL);
+        gettimeofday(&base_run_time.time_s, NULL);
+        for (i = 0; i < nthreads; i++) {
+            args[i] = (writer_arg_t){ fout, NULL, addr, fsize, chunk_size, i, nthreads };
+            rc = pthread_create(&threads[i], NULL, writer_thread, &args[i]);
+            assert(rc == 0);
+        }
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        fclose(fout);
+        gettimeofday(&base_run_time.time_e, NULL);
+
+        printf("Test qzip with %d writers on one stream done\n", nthreads);
+        display_stats(&base_run_time, fsize);
+
+        FILE *shared = qzip_shared_hook(stderr, "w");
+        assert(shared != NULL);
+        gettimeofday(&my_run_time.time_s, NULL);
+        for (i = 0; i < nthreads; i++) {
+            args[i] = (writer_arg_t){ NULL, shared, addr, fsize, chunk_size, i, nthreads };
+            rc = pthread_create(&threads[i], NULL, writer_thread, &args[i]);
+            assert(rc == 0);
+        }
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        fclose(shared);
+        gettimeofday(&my_run_time.time_e, NULL);
+
+        printf("Test qzip shared with %d attached writers done\n", nthreads);
+        display_stats(&my_run_time, fsize);
+        display_speedup(&base_run_time, &my_run_time);
+    }
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Open, write and close many small compressed files in a row, which is
+// where per-open session setup used to dominate
+void bench_sess_pool(const char *fpath, int nfiles)
+{
+    qzip_sess_pool_stats_t stats;
+    run_time_t pool_run_time;
+    int i;
+
+    FILE *fin = fopen(fpath, "r");
+    assert(fin != NULL);
+    size_t bytes_read = fread(fdata_buf, 1, 4096, fin);
+    fclose(fin);
+
+    int rc = qzip_sess_pool_warmup(NULL, 1);
+    assert(rc == 0);
+
+    sprintf(fpath_buf, "%s.qz_p", fpath);
+    gettimeofday(&pool_run_time.time_s, NULL);
+    for (i = 0; i < nfiles; i++) {
+        FILE *qz_fout = qzip_fopen_ex(fpath_buf, "w", &qz_params);
+        assert(qz_fout != NULL);
+        size_t bytes_written = fwrite(fdata_buf, 1, bytes_read, qz_fout);
+        assert(bytes_written == bytes_read);
+        fclose(qz_fout);
+    }
+    gettimeofday(&pool_run_time.time_e, NULL);
+    unlink(fpath_buf);
+
+    qzip_sess_pool_get_stats(&stats);
+    printf("Test qzip session pool with %d files done\n", nfiles);
+    printf("Pool hits:      %9lu\n", stats.hits);
+    printf("Pool misses:    %9lu\n", stats.misses);
+    display_stats(&pool_run_time, bytes_read * nfiles);
+}
+
+// Compare requests bounced through QATzip's internal buffers with requests
+// staged in pinned memory by the cookie. This function will write
+// compressed data to stderr
+void bench_pinned(const char *fpath, int chunk_size)
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    run_time_t *run_time_p;
+    int pinned;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    for (pinned = 0; pinned <= 1; pinned++) {
+        run_time_p = pinned ? &my_run_time : &base_run_time;
+        qz_params.pinned = pinned;
+
+        FILE *fout = qzip_hook_ex(stderr, "w", &qz_params);
+        assert(fout != NULL);
+        gettimeofday(&run_time_p->time_s, NULL);
+        for (off = 0; off < fsize; off += chunk_size) {
+            bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+            assert(bytes_written == bytes_to_write);
+        }
+        fclose(fout);
+        gettimeofday(&run_time_p->time_e, NULL);
+
+        printf("Test qzip with %s buffers done\n", pinned ? "pinned" : "unpinned");
+        display_stats(run_time_p, fsize);
+    }
+    qz_params.pinned = 0;
+
+    display_speedup(&base_run_time, &my_run_time);
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Sweep write sizes from 64 B to 1 MB with and without the cookie's
+// aggregation buffer. With it, throughput should hardly depend on the write
+// size. This function will write compressed data to stderr
+void bench_coalesce(const char *fpath)
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    run_time_t *run_time_p;
+    unsigned int coalesce_sz = qz_params.coalesce_sz;
+    size_t chunk_size;
+    int coalesce;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    for (chunk_size = 64; chunk_size <= 1024 * 1024; chunk_size *= 4) {
+        for (coalesce = 0; coalesce <= 1; coalesce++) {
+            run_time_p = coalesce ? &my_run_time : &base_run_time;
+            qz_params.coalesce_sz = coalesce ? coalesce_sz : 0;
+
+            FILE *fout = qzip_hook_ex(stderr, "w", &qz_params);
+            assert(fout != NULL);
+            gettimeofday(&run_time_p->time_s, NULL);
+            for (off = 0; off < fsize; off += chunk_size) {
+                bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+                bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+                assert(bytes_written == bytes_to_write);
+            }
+            fclose(fout);
+            gettimeofday(&run_time_p->time_e, NULL);
+
+            printf("Test qzip with %zu B writes %s coalescing done\n", chunk_size,
+                   coalesce ? "w/" : "w/o");
+            display_stats(run_time_p, fsize);
+        }
+        display_speedup(&base_run_time, &my_run_time);
+    }
+    qz_params.coalesce_sz = coalesce_sz;
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Compare output through the inner FILE * with output through a raw file
+// descriptor, with and without O_DIRECT. Compressed data is written to a
+// file next to the input by a pipelined cookie, so that finished buffers
+// can be batched.
+void bench_fd(const char *fpath, int chunk_size)
+{
+    static const char *backends[] = { "stdio", "fd", "fd+O_DIRECT" };
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    run_time_t *run_time_p;
+    qzip_params_t params = qz_params;
+    FILE *fout;
+    int backend;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    sprintf(fpath_buf, "%s.qz_fd", fpath);
+    params.nslots = 4;
+    for (backend = 0; backend < 3; backend++) {
+        run_time_p = (0 == backend) ? &base_run_time : &my_run_time;
+        params.direct = (2 == backend);
+
+        gettimeofday(&run_time_p->time_s, NULL);
+        if (0 == backend) {
+            fout = qzip_fopen_ex(fpath_buf, "w", &params);
+        } else {
+            int out_fd = open(fpath_buf, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            assert(out_fd >= 0);
+            fout = qzip_fdopen_ex(out_fd, "w", &params);
+        }
+        assert(fout != NULL);
+        for (off = 0; off < fsize; off += chunk_size) {
+            bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+            assert(bytes_written == bytes_to_write);
+        }
+        fclose(fout);
+        gettimeofday(&run_time_p->time_e, NULL);
+
+        printf("Test qzip with %s output done\n", backends[backend]);
+        display_stats(run_time_p, fsize);
+        if (backend > 0) {
+            display_speedup(&base_run_time, &my_run_time);
+        }
+    }
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Compare stdio output with io_uring output, both on tmpfs and next to the
+// input, which is expected to be disk-backed
+void bench_uring(const char *fpath, int chunk_size)
+{
+    const char *dirs[] = { "/dev/shm", NULL };
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    run_time_t *run_time_p;
+    qzip_params_t params = qz_params;
+    const char *name;
+    FILE *fout;
+    int d, uring;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, off;
+
+    name = strrchr(fpath, '/');
+    name = (NULL == name) ? fpath : name + 1;
+    params.uring = 16;
+    for (d = 0; d < 2; d++) {
+        if (NULL == dirs[d]) {
+            sprintf(fpath_buf, "%s.qz_u", fpath);
+        } else {
+            sprintf(fpath_buf, "%s/%s.qz_u", dirs[d], name);
+        }
+
+        for (uring = 0; uring <= 1; uring++) {
+            run_time_p = uring ? &my_run_time : &base_run_time;
+
+            gettimeofday(&run_time_p->time_s, NULL);
+            if (!uring) {
+                fout = qzip_fopen_ex(fpath_buf, "w", &qz_params);
+            } else {
+                int out_fd = open(fpath_buf, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                assert(out_fd >= 0);
+                fout = qzip_fdopen_ex(out_fd, "w", &params);
+            }
+            assert(fout != NULL);
+            for (off = 0; off < fsize; off += chunk_size) {
+                bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+                bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+                assert(bytes_written == bytes_to_write);
+            }
+            fclose(fout);
+            gettimeofday(&run_time_p->time_e, NULL);
+
+            printf("Test qzip with %s output to %s done\n", uring ? "io_uring" : "stdio",
+                   fpath_buf);
+            display_stats(run_time_p, fsize);
+        }
+        display_speedup(&base_run_time, &my_run_time);
+        unlink(fpath_buf);
+    }
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+// Read `chunk_size` bytes at 100 random offsets, from output written with and
+// without a seek index
+void bench_seek(const char *fpath, int chunk_size)
+{
+    run_time_t base_run_time;
+    run_time_t my_run_time;
+    run_time_t *run_time_p;
+    qzip_params_t params = qz_params;
+    FILE *fout, *fin;
+    int seekable, i;
+
+    int fd = open(fpath, O_RDONLY);
+    assert(fd >= 0);
+
+    size_t fsize = file_size(fpath);
+    assert(fsize > 0);
+
+    char *addr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(addr != MAP_FAILED);
+
+    size_t bytes_to_write, bytes_written, bytes_read, off;
+
+    assert(chunk_size <= MAXDATA);
+
+    sprintf(fpath_buf, "%s.qz_x", fpath);
+    for (seekable = 0; seekable <= 1; seekable++) {
+        run_time_p = seekable ? &my_run_time : &base_run_time;
+        params.seekable = seekable;
+
+        fout = qzip_fopen_ex(fpath_buf, "w", &params);
+        assert(fout != NULL);
+        for (off = 0; off < fsize; off += chunk_size) {
+            bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            bytes_written  = fwrite(addr + off, 1, bytes_to_write, fout);
+            assert(bytes_written == bytes_to_write);
+        }
+        fclose(fout);
+
+        fin = qzip_fopen_ex(fpath_buf, "r", NULL);
+        assert(fin != NULL);
+
+        srand(1);
+        gettimeofday(&run_time_p->time_s, NULL);
+        for (i = 0; i < 100; i++) {
+            off = ((size_t)rand() * RAND_MAX + rand()) % fsize;
+            bytes_to_write = ((fsize - off) < chunk_size) ? (fsize - off) : chunk_size;
+            assert(0 == fseeko(fin, off, SEEK_SET));
+            bytes_read = fread(fdata_buf, 1, bytes_to_write, fin);
+            assert(bytes_read == bytes_to_write);
+            assert(0 == memcmp(fdata_buf, addr + off, bytes_read));
+        }
+        gettimeofday(&run_time_p->time_e, NULL);
+        fclose(fin);
+
+        printf("Test qzip random reads %s seek index done\n", seekable ? "with" : "without");
+        display_stats(run_time_p, 100 * chunk_size);
+    }
+    display_speedup(&base_run_time, &my_run_time);
+    unlink(fpath_buf);
+
+    munmap(addr, fsize);
+    close(fd);
+}
+
+static void display_hist(const char *name, const qzip_hist_t *hist, const char *unit)
+{
+    printf("%-12s n %8llu  p50 %9llu  p99 %9llu  p999 %9llu  max %9llu %s\n", name,
+           hist->count, hist->p50, hist->p99, hist->p999, hist->max, unit);
+}
+
+// Throughput over the time spent in qzCompress only, followed by the
+// distribution of request latency, output write latency and request size
+void display_stats_chained(const qzip_cookie_stats_t *stats, unsigned int insize)
+{
+    double us_diff = (double)stats->comp_ns.sum / 1000;
 
     assert(0 != us_diff);
     assert(0 != insize);
@@ -201,6 +974,9 @@ void display_stats_chained(run_time_list_node_t *rtime_list_head, unsigned int i
 
     printf("Time taken:     %9.3lf ms\n", us_diff / 1000);
     printf("Throughput:     %9.3lf Mbit/s\n", throughput);
+    display_hist("Compress", &stats->comp_ns, "ns");
+    display_hist("Write", &stats->write_ns, "ns");
+    display_hist("Request", &stats->req_bytes, "B");
 }
 
 // This function will write compressed data to stderr
@@ -230,7 +1006,11 @@ void test_my_qzip(const char *fpath, int chunk_size)
     fclose(my_fout);
     gettimeofday(&my_run_time.time_e, NULL);
     display_stats(&my_run_time, fsize);
-    display_stats_chained(run_time_list_head, fsize);
+
+    qzip_cookie_stats_t stats;
+    int rc = qzip_cookie_get_stats(NULL, &stats);
+    assert(0 == rc);
+    display_stats_chained(&stats, fsize);
 }
 
 void test_qzip_stream(const char *fpath)
@@ -259,6 +1039,13 @@ void print_usage(const char *progname)
     printf("Program options:\n");
     printf("    -c  --case <INT>    Test specified cookie API (default 0 that means all)\n");
     printf("    -s  --chunksz <INT> Size to write (default 64)\n");
+    printf("    -r  --rate <INT>    Bandwidth of the slow sink in MB/s (default 200)\n");
+    printf("    -w  --workers <INT> Maximum number of parallel workers (default 4)\n");
+    printf("    -l  --level <INT>   Compression level 1..9 (default 1)\n");
+    printf("    -b  --hwbufsz <INT> QAT hardware buffer size (default 65536)\n");
+    printf("    -p  --poll <INT>    Nanosleep between polls (default 10)\n");
+    printf("    -t  --swthrsh <INT> Requests smaller than this go to software (default 1024)\n");
+    printf("    -g  --coalesce <INT> Batch smaller writes up to this size, 0 to disable (default 65536)\n");
     printf("    -h  --help          This message\n");
 }
 
@@ -266,6 +1053,11 @@ int main(int argc, char **argv)
 {
     int  test_case  = 0;
     int  chunk_size = (64*1024);    // 64 KB
+    unsigned long sink_rate = 200;  // MB/s
+    int  max_workers = 4;
+
+    int rc = qzip_params_init(&qz_params);
+    assert(rc == 0);
     char *fin_path  = NULL;
 
     // \begin parse commandline args
@@ -274,11 +1066,18 @@ int main(int argc, char **argv)
     static struct option long_options[] = {
         {"case",    required_argument, 0, 'c'},
         {"chunksz", required_argument, 0, 's'},
+        {"rate",    required_argument, 0, 'r'},
+        {"workers", required_argument, 0, 'w'},
+        {"level",   required_argument, 0, 'l'},
+        {"hwbufsz", required_argument, 0, 'b'},
+        {"poll",    required_argument, 0, 'p'},
+        {"swthrsh", required_argument, 0, 't'},
+        {"coalesce", required_argument, 0, 'g'},
         {"help",    no_argument,       0, 'h'},
         {0,         0,                 0,  0 }
     };
 
-    while ((opt = getopt_long(argc, argv, "f:c:s:h", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "f:c:s:r:w:l:b:p:t:g:h", long_options, NULL)) != -1) {
 
         switch (opt) {
             case 'c':
@@ -288,6 +1087,29 @@ int main(int argc, char **argv)
                 chunk_size = atoi(optarg);
                 assert(chunk_size > 0);
                 break;
+            case 'r':
+                sink_rate = atol(optarg);
+                assert(sink_rate > 0);
+                break;
+            case 'w':
+                max_workers = atoi(optarg);
+                assert(max_workers > 0);
+                break;
+            case 'l':
+                qz_params.comp_lvl = atoi(optarg);
+                break;
+            case 'b':
+                qz_params.hw_buff_sz = atoi(optarg);
+                break;
+            case 'p':
+                qz_params.poll_sleep = atoi(optarg);
+                break;
+            case 't':
+                qz_params.input_sz_thrshold = atoi(optarg);
+                break;
+            case 'g':
+                qz_params.coalesce_sz = atoi(optarg);
+                break;
             case 'h':
             case '?':
             default:
@@ -304,8 +1126,25 @@ int main(int argc, char **argv)
     }
     // \end parse commandline args
 
+    int fdata_kind;
+    fdata_buf = (char *)qzip_huge_alloc(MAXDATA, &fdata_kind);
+    assert(fdata_buf != NULL);
+    printf("Data buffer backed by %s\n", qzip_huge_kind_str(fdata_kind));
+
     // case 1..3: read from file and write into file at the same directory
     // case 4..5: read from mmapped file and write into stderr
+    // case 6..7: decompress file written by case 2..3
+    // case 8: read from mmapped file and write into a slow sink
+    // case 9: read from mmapped file and write into stderr with 1..N workers, gzip and qzip
+    // case 10: write the first 4 KB of file into 1000 short-lived files
+    // case 11: read from mmapped file and write into stderr w/ and w/o pinned buffers
+    // case 12: read from mmapped file and write into stderr in 64 B..1 MB writes
+    // case 13: read from mmapped file and write into file via stdio, fd and O_DIRECT
+    // case 14: read from mmapped file and write into files on tmpfs and disk via io_uring
+    // case 15: read random ranges of compressed file w/ and w/o seek index
+    // case 16: read from mmapped file and write into stderr with QAT and zlib workers
+    // case 17: CRC32 of mmapped file with zlib and qzip_crc32
+    // case 18: read from mmapped file and write into stderr from 1..64 threads
     switch (test_case) {
         case 1:
             test_gzip(fin_path);
@@ -322,13 +1161,56 @@ int main(int argc, char **argv)
         case 5:
             bench_qzip(fin_path, chunk_size);
             break;
+        case 6:
+            test_qzip_decomp(fin_path);
+            break;
+        case 7:
+            test_qzip_stream_decomp(fin_path);
+            break;
+        case 8:
+            bench_async(fin_path, chunk_size, sink_rate);
+            break;
+        case 9:
+            bench_parallel(fin_path, chunk_size, max_workers);
+            break;
+        case 10:
+            bench_sess_pool(fin_path, 1000);
+            break;
+        case 11:
+            bench_pinned(fin_path, chunk_size);
+            break;
+        case 12:
+            bench_coalesce(fin_path);
+            break;
+        case 13:
+            bench_fd(fin_path, chunk_size);
+            break;
+        case 14:
+            bench_uring(fin_path, chunk_size);
+            break;
+        case 15:
+            bench_seek(fin_path, chunk_size);
+            break;
+        case 16:
+            bench_hybrid(fin_path, chunk_size, max_workers);
+            break;
+        case 17:
+            bench_crc32(fin_path, chunk_size);
+            break;
+        case 18:
+            bench_shared(fin_path, chunk_size);
+            break;
         case 0:
         default:
             test_gzip(fin_path);
             test_qzip(fin_path);
+            test_qzip_decomp(fin_path);
             test_qzip_stream(fin_path);
+            test_qzip_stream_decomp(fin_path);
             break;
     }
 
+    qzip_huge_free(fdata_buf, MAXDATA, fdata_kind);
+
     return 0;
 }
@@ -0,0 +1,686 @@
+// vim: set sw=4 ts=4 sts=4 et tw=78
+//
+// Round-trip check of every write cookie. Deterministic data of edge sizes
+// is written through each variant in writes of varying size, then read back
+// with zlib and compared byte for byte and by CRC32 against the same data
+// generated again. Compression throughput of each variant is reported as
+// well. The CRC32 kernel is checked against zlib first, since it's what the
+// parallel cookies put in their trailers. Sessions are opened with software
+// backup, so this runs on machines without QAT hardware.
+//
+// Read cookies are checked the same way, on files from their write
+// counterparts: read back in reads of varying size, and, for files with a
+// seek index, at random offsets too. The same files cut in half must then
+// fail to read rather than come out short.
+//
+
+#include "qzip_cookie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#define BLOCK   (64*1024)
+#define IOBUF   (1024*1024)
+
+// \begin source
+// Data at any offset only depends on the seed, however it's read. Each
+// block is either text-like or random, mostly the former, so both the
+// compressible and incompressible paths are taken.
+typedef struct {
+    unsigned long long seed;
+    unsigned long long block;   // index of the block in `buf`
+    size_t             offset;  // read position in `buf`
+    unsigned char      buf[BLOCK];
+} source_t;
+
+static inline unsigned long long rng(unsigned long long *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void source_fill(source_t *src)
+{
+    unsigned long long state = (src->seed ^ (src->block * 0x9E3779B97F4A7C15ULL)) | 1;
+    int random = (rng(&state) % 4 == 0);
+    size_t i;
+
+    for (i = 0; i < BLOCK; i++) {
+        unsigned long long r = rng(&state);
+        src->buf[i] = random ? (r & 0xff) : "etaoin shrdlu\n"[r % 14];
+    }
+    src->offset = 0;
+}
+
+static void source_init(source_t *src, unsigned long long seed)
+{
+    src->seed = seed;
+    src->block = 0;
+    source_fill(src);
+}
+
+// Position `src` at byte `off` of its data
+static void source_seek(source_t *src, size_t off)
+{
+    src->block = off / BLOCK;
+    source_fill(src);
+    src->offset = off % BLOCK;
+}
+
+static void source_read(source_t *src, unsigned char *buf, size_t size)
+{
+    size_t n;
+
+    while (size > 0) {
+        if (BLOCK == src->offset) {
+            src->block++;
+            source_fill(src);
+        }
+        n = (BLOCK - src->offset < size) ? BLOCK - src->offset : size;
+        memcpy(buf, src->buf + src->offset, n);
+        src->offset += n;
+        buf += n;
+        size -= n;
+    }
+}
+// \end source
+
+// \begin variants
+typedef struct {
+    const char *name;
+    // Open `path` for writing. Hook variants store the file under the
+    // cookie in `raw`, which is closed after the cookie.
+    FILE *(*open)(const char *path, FILE **raw);
+} variant_t;
+
+static FILE *open_gzip(const char *path, FILE **raw)
+{
+    return gzip_fopen(path, "w");
+}
+
+static FILE *open_qzip(const char *path, FILE **raw)
+{
+    return qzip_fopen(path, "w");
+}
+
+static FILE *open_qzip_hook(const char *path, FILE **raw)
+{
+    return (NULL != (*raw = fopen(path, "w"))) ? qzip_hook(*raw, "w") : NULL;
+}
+
+static FILE *open_my_qzip_hook(const char *path, FILE **raw)
+{
+    return (NULL != (*raw = fopen(path, "w"))) ? my_qzip_hook(*raw, "w") : NULL;
+}
+
+static FILE *open_async(const char *path, FILE **raw)
+{
+    return qzip_fopen_async(path, "w", 4);
+}
+
+static FILE *open_fdopen(const char *path, FILE **raw)
+{
+    qzip_params_t params;
+    int rc = qzip_params_init(&params);
+    assert(rc == 0);
+    params.nslots = 4;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return (fd >= 0) ? qzip_fdopen_ex(fd, "w", &params) : NULL;
+}
+
+static FILE *open_seekable(const char *path, FILE **raw)
+{
+    qzip_params_t params;
+    int rc = qzip_params_init(&params);
+    assert(rc == 0);
+    params.seekable = 1;
+
+    return qzip_fopen_ex(path, "w", &params);
+}
+
+static FILE *open_passthrough(const char *path, FILE **raw)
+{
+    qzip_params_t params;
+    int rc = qzip_params_init(&params);
+    assert(rc == 0);
+    params.passthrough = 1;
+
+    return qzip_fopen_ex(path, "w", &params);
+}
+
+static FILE *open_parallel(const char *path, FILE **raw)
+{
+    return qzip_parallel_fopen(path, "w", 4);
+}
+
+static FILE *open_gzip_parallel(const char *path, FILE **raw)
+{
+    return gzip_parallel_fopen(path, "w", 4);
+}
+
+// A slow device pushes blocks onto both paths, so both get checked
+static FILE *open_hybrid(const char *path, FILE **raw)
+{
+    qzip_hybrid_params_t params = { 2, 2, 2000 };
+
+    return qzip_hybrid_fopen(path, "w", &params);
+}
+
+// Written through an attached stream, closed before the shared one
+static FILE *open_shared(const char *path, FILE **raw)
+{
+    return (NULL != (*raw = qzip_shared_fopen(path, "w"))) ? qzip_shared_attach(*raw) : NULL;
+}
+
+static FILE *open_stream(const char *path, FILE **raw)
+{
+    return qzip_stream_fopen(path, "w");
+}
+
+static FILE *open_stream_hook(const char *path, FILE **raw)
+{
+    return (NULL != (*raw = fopen(path, "w"))) ? qzip_stream_hook(*raw, "w") : NULL;
+}
+
+static const variant_t variants[] = {
+    { "gzip_fopen",        open_gzip },
+    { "gzip_parallel",     open_gzip_parallel },
+    { "qzip_fopen",        open_qzip },
+    { "qzip_hook",         open_qzip_hook },
+    { "my_qzip_hook",      open_my_qzip_hook },
+    { "qzip_fopen_async",  open_async },
+    { "qzip_fdopen_ex",    open_fdopen },
+    { "qzip_fopen_ex+idx", open_seekable },
+    { "qzip_fopen_ex+raw", open_passthrough },
+    { "qzip_parallel",     open_parallel },
+    { "qzip_hybrid",       open_hybrid },
+    { "qzip_shared",       open_shared },
+    { "qzip_stream_fopen", open_stream },
+    { "qzip_stream_hook",  open_stream_hook },
+};
+
+#define NVARIANTS (sizeof(variants) / sizeof(variants[0]))
+// \end variants
+
+// \begin readers
+typedef struct {
+    const char *name;
+    variant_t  write;           // writes the file being read
+    FILE *(*open)(const char *path);
+    int seek;                   // check random seeks as well
+} reader_t;
+
+static FILE *read_qzip(const char *path)
+{
+    return qzip_fopen(path, "r");
+}
+
+static FILE *read_stream(const char *path)
+{
+    return qzip_stream_fopen(path, "r");
+}
+
+static FILE *read_gzip_parallel(const char *path)
+{
+    return gzip_parallel_fopen(path, "r", 1);
+}
+
+static const reader_t readers[] = {
+    { "qzip_fopen:r",        { "qzip_fopen",        open_qzip },          read_qzip,          0 },
+    { "qzip_fopen:r+idx",    { "qzip_fopen_ex+idx", open_seekable },      read_qzip,          1 },
+    { "qzip_stream_fopen:r", { "qzip_stream_fopen", open_stream },        read_stream,        0 },
+    { "gzip_parallel:r",     { "gzip_parallel",     open_gzip_parallel }, read_gzip_parallel, 0 },
+};
+
+#define NREADERS (sizeof(readers) / sizeof(readers[0]))
+// \end readers
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write `size` bytes of seed `seed` through `variant` into `path`. Returns
+// the elapsed time, or a negative value on failure.
+static double write_variant(const variant_t *variant, const char *path, size_t size,
+                            unsigned long long seed, unsigned long *crc)
+{
+    // Cycle through write sizes around the cookies' internal boundaries
+    static const size_t chunks[] = { 1, 7, 4096, 65535, 65536, IOBUF + 3 };
+    unsigned char *buf = (unsigned char *)malloc(IOBUF + 3);
+    FILE *raw = NULL, *fout;
+    source_t *src = (source_t *)malloc(sizeof(source_t));
+    size_t off, n;
+    double start;
+    int i = 0, rc = 0;
+
+    assert(buf != NULL && src != NULL);
+    source_init(src, seed);
+    *crc = crc32(0L, Z_NULL, 0);
+
+    start = now();
+    if (NULL == (fout = variant->open(path, &raw))) {
+        rc = -1;
+    }
+    for (off = 0; 0 == rc && off < size; off += n) {
+        n = chunks[i++ % (sizeof(chunks) / sizeof(chunks[0]))];
+        n = (size - off < n) ? size - off : n;
+        source_read(src, buf, n);
+        *crc = crc32(*crc, buf, n);
+        if (fwrite(buf, 1, n, fout) != n) {
+            rc = -1;
+        }
+    }
+    if (NULL != fout && fclose(fout) != 0) {
+        rc = -1;
+    }
+    if (NULL != raw && fclose(raw) != 0) {
+        rc = -1;
+    }
+
+    free(src);
+    free(buf);
+    return (0 == rc) ? now() - start : -1;
+}
+
+// Inflate `path` with zlib and compare it to `size` bytes of seed `seed`
+static int verify_zlib(const char *path, size_t size, unsigned long long seed, unsigned long crc)
+{
+    unsigned char *buf = (unsigned char *)malloc(IOBUF);
+    unsigned char *exp = (unsigned char *)malloc(IOBUF);
+    source_t *src = (source_t *)malloc(sizeof(source_t));
+    unsigned long out_crc = crc32(0L, Z_NULL, 0);
+    size_t total = 0;
+    int n, errnum, rc = 0;
+
+    assert(buf != NULL && exp != NULL && src != NULL);
+    source_init(src, seed);
+
+    // zlib passes through data that isn't gzip, so check the magic first
+    FILE *fp = fopen(path, "r");
+    if (NULL == fp || fgetc(fp) != 0x1f || fgetc(fp) != 0x8b) {
+        fprintf(stderr, "  %s isn't gzip\n", path);
+        rc = -1;
+    }
+    if (NULL != fp) {
+        fclose(fp);
+    }
+
+    gzFile gz = (0 == rc) ? gzopen(path, "r") : NULL;
+    if (0 == rc && NULL == gz) {
+        fprintf(stderr, "  can't open %s\n", path);
+        rc = -1;
+    }
+    while (0 == rc && (n = gzread(gz, buf, IOBUF)) > 0) {
+        if (total + n > size) {
+            fprintf(stderr, "  longer than %zu bytes\n", size);
+            rc = -1;
+            break;
+        }
+        source_read(src, exp, n);
+        if (0 != memcmp(buf, exp, n)) {
+            fprintf(stderr, "  differs within bytes %zu..%zu\n", total, total + n);
+            rc = -1;
+        }
+        out_crc = qzip_crc32(out_crc, buf, n);
+        total += n;
+    }
+    if (0 == rc) {
+        gzerror(gz, &errnum);
+        if (n < 0 || (errnum != Z_OK && errnum != Z_BUF_ERROR)) {
+            fprintf(stderr, "  zlib error: %s\n", gzerror(gz, &errnum));
+            rc = -1;
+        } else if (total != size) {
+            fprintf(stderr, "  %zu bytes instead of %zu\n", total, size);
+            rc = -1;
+        } else if (out_crc != crc) {
+            fprintf(stderr, "  CRC32 %08lx instead of %08lx\n", out_crc, crc);
+            rc = -1;
+        }
+    }
+    if (NULL != gz) {
+        gzclose(gz);
+    }
+
+    free(src);
+    free(exp);
+    free(buf);
+    return rc;
+}
+
+// Read `path` through `reader` and compare it to `size` bytes of seed
+// `seed`. Returns the elapsed time, or a negative value on failure.
+static double verify_read(const reader_t *reader, const char *path, size_t size,
+                          unsigned long long seed, unsigned long crc)
+{
+    static const size_t chunks[] = { 1, 7, 4096, 65535, 65536, IOBUF };
+    unsigned char *buf = (unsigned char *)malloc(IOBUF);
+    unsigned char *exp = (unsigned char *)malloc(IOBUF);
+    source_t *src = (source_t *)malloc(sizeof(source_t));
+    unsigned long out_crc = crc32(0L, Z_NULL, 0);
+    size_t total = 0, n;
+    double start;
+    int i = 0, rc = 0;
+    FILE *fin;
+
+    assert(buf != NULL && exp != NULL && src != NULL);
+    source_init(src, seed);
+
+    start = now();
+    if (NULL == (fin = reader->open(path))) {
+        fprintf(stderr, "  can't open %s\n", path);
+        rc = -1;
+    }
+    while (0 == rc && (n = fread(buf, 1, chunks[i++ % (sizeof(chunks) / sizeof(chunks[0]))],
+                                 fin)) > 0) {
+        if (total + n > size) {
+            fprintf(stderr, "  longer than %zu bytes\n", size);
+            rc = -1;
+            break;
+        }
+        source_read(src, exp, n);
+        if (0 != memcmp(buf, exp, n)) {
+            fprintf(stderr, "  differs within bytes %zu..%zu\n", total, total + n);
+            rc = -1;
+        }
+        out_crc = qzip_crc32(out_crc, buf, n);
+        total += n;
+    }
+    if (0 == rc) {
+        if (ferror(fin)) {
+            fprintf(stderr, "  read error after %zu bytes\n", total);
+            rc = -1;
+        } else if (total != size) {
+            fprintf(stderr, "  %zu bytes instead of %zu\n", total, size);
+            rc = -1;
+        } else if (out_crc != crc) {
+            fprintf(stderr, "  CRC32 %08lx instead of %08lx\n", out_crc, crc);
+            rc = -1;
+        }
+    }
+    if (NULL != fin) {
+        fclose(fin);
+    }
+
+    free(src);
+    free(exp);
+    free(buf);
+    return (0 == rc) ? now() - start : -1;
+}
+
+// Seek `path` to random offsets of its `size` bytes of seed `seed` from
+// each origin, and compare what is read there
+static int verify_seek(const reader_t *reader, const char *path, size_t size,
+                       unsigned long long seed)
+{
+    static const int whences[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+    unsigned char *buf = (unsigned char *)malloc(IOBUF);
+    unsigned char *exp = (unsigned char *)malloc(IOBUF);
+    source_t *src = (source_t *)malloc(sizeof(source_t));
+    unsigned long long state = seed;
+    size_t target, len, want, n;
+    off_t offset;
+    int i, whence, rc = 0;
+    FILE *fin;
+
+    assert(buf != NULL && exp != NULL && src != NULL);
+    source_init(src, seed);
+
+    if (NULL == (fin = reader->open(path))) {
+        fprintf(stderr, "  can't open %s\n", path);
+        rc = -1;
+    }
+    for (i = 0; i < 64 && 0 == rc; i++) {
+        whence = whences[i % 3];
+        target = rng(&state) % (size + 1);
+        len = rng(&state) % IOBUF;
+        offset = (SEEK_SET == whence) ? (off_t)target :
+                 (SEEK_CUR == whence) ? (off_t)target - ftello(fin) :
+                 (off_t)target - (off_t)size;
+        if (fseeko(fin, offset, whence) != 0 || ftello(fin) != (off_t)target) {
+            fprintf(stderr, "  can't seek to %zu from origin %d\n", target, whence);
+            rc = -1;
+            break;
+        }
+
+        want = (size - target < len) ? size - target : len;
+        n = fread(buf, 1, len, fin);
+        source_seek(src, target);
+        source_read(src, exp, want);
+        if (n != want || 0 != memcmp(buf, exp, n)) {
+            fprintf(stderr, "  %zu bytes at %zu don't match (%zu read)\n", want, target, n);
+            rc = -1;
+        }
+    }
+    if (NULL != fin) {
+        fclose(fin);
+    }
+
+    free(src);
+    free(exp);
+    free(buf);
+    return rc;
+}
+
+// Cut `path` in half, which must make reading it fail
+static int verify_truncated(const reader_t *reader, const char *path)
+{
+    unsigned char *buf = (unsigned char *)malloc(IOBUF);
+    struct stat st;
+    int rc = -1;
+    FILE *fin;
+
+    assert(buf != NULL);
+    if (0 != stat(path, &st) || 0 != truncate(path, st.st_size / 2) ||
+        NULL == (fin = reader->open(path))) {
+        fprintf(stderr, "  can't truncate %s\n", path);
+        free(buf);
+        return -1;
+    }
+    while (fread(buf, 1, IOBUF, fin) > 0);
+    if (ferror(fin)) {
+        rc = 0;
+    } else {
+        fprintf(stderr, "  %s cut to %lld bytes reads without error\n", path,
+                (long long)st.st_size / 2);
+    }
+    fclose(fin);
+
+    free(buf);
+    return rc;
+}
+
+// `qzip_crc32` and `qzip_crc32_combine` against zlib, at every alignment and
+// length around the kernels' block sizes, and for a large buffer split at
+// random points
+static int verify_crc32(void)
+{
+    size_t size = 4 * 1024 * 1024 + 1;
+    unsigned char *buf = (unsigned char *)malloc(size);
+    unsigned long long state = 1;
+    unsigned long crc, exp, part;
+    size_t off, len, cut;
+    int i, rc = 0;
+
+    assert(buf != NULL);
+    for (off = 0; off < size; off++) {
+        buf[off] = rng(&state) >> 56;
+    }
+
+    for (off = 0; off < 16 && 0 == rc; off++) {
+        for (len = 0; len <= 1024 && 0 == rc; len++) {
+            exp = crc32(0x12345678, buf + off, len);
+            if ((crc = qzip_crc32(0x12345678, buf + off, len)) != exp) {
+                fprintf(stderr, "  CRC32 of %zu bytes at %zu: %08lx instead of %08lx\n",
+                        len, off, crc, exp);
+                rc = -1;
+            }
+        }
+    }
+
+    exp = crc32(0L, buf, size);
+    for (i = 0; i < 64 && 0 == rc; i++) {
+        cut = (0 == i) ? 0 : rng(&state) % size;
+        part = qzip_crc32(0L, buf + cut, size - cut);
+        crc = qzip_crc32_combine(qzip_crc32(0L, buf, cut), part, size - cut);
+        if (crc != exp) {
+            fprintf(stderr, "  CRC32 combined at %zu: %08lx instead of %08lx\n", cut, crc, exp);
+            rc = -1;
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [options]\n", progname);
+    printf("Program options:\n");
+    printf("    -d  --dir <PATH>      Directory for compressed files (default /tmp)\n");
+    printf("    -v  --variant <NAME>  Only check this variant, reader or crc32\n");
+    printf("    -q  --quick           Skip sizes over 512 MB\n");
+    printf("    -h  --help            This message\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir     = "/tmp";
+    const char *only    = NULL;
+    int quick           = 0;
+    char path[4096];
+    qzip_params_t params;
+    size_t sizes[8];
+    unsigned int i, j, nsizes = 0, failed = 0, checked = 0;
+    unsigned long crc;
+    double elapsed;
+
+    // \begin parse commandline args
+    int opt;
+
+    static struct option long_options[] = {
+        {"dir",     required_argument, 0, 'd'},
+        {"variant", required_argument, 0, 'v'},
+        {"quick",   no_argument,       0, 'q'},
+        {"help",    no_argument,       0, 'h'},
+        {0,         0,                 0,  0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "d:v:qh", long_options, NULL)) != -1) {
+
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'v':
+                only = optarg;
+                break;
+            case 'q':
+                quick = 1;
+                break;
+            case 'h':
+            case '?':
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    // \end parse commandline args
+
+    int rc = qzip_params_init(&params);
+    assert(rc == 0);
+
+    sizes[nsizes++] = 0;
+    sizes[nsizes++] = 1;
+    sizes[nsizes++] = params.hw_buff_sz - 1;
+    sizes[nsizes++] = params.hw_buff_sz;
+    sizes[nsizes++] = params.hw_buff_sz + 1;
+    sizes[nsizes++] = 4 * 1024 * 1024 + 1;      // one past a compression slice
+    if (!quick) {
+        sizes[nsizes++] = QC_MAXDATA + 1;
+    }
+
+    printf("%-20s %10s  %-6s %10s\n", "variant", "size", "result", "MB/s");
+    if (NULL == only || 0 == strcmp(only, "crc32")) {
+        rc = verify_crc32();
+        checked++;
+        failed += (0 != rc);
+        printf("%-20s %10s  %-6s %10s\n", "crc32", qzip_crc32_impl(), rc ? "FAIL" : "ok", "-");
+    }
+    for (i = 0; i < NVARIANTS; i++) {
+        if (NULL != only && 0 != strcmp(only, variants[i].name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/qzip_cookie_verify.%d.gz", dir, (int)getpid());
+
+        for (j = 0; j < nsizes; j++) {
+            unsigned long long seed = 1 + j;
+
+            elapsed = write_variant(&variants[i], path, sizes[j], seed, &crc);
+            rc = (elapsed < 0) ? -1 : verify_zlib(path, sizes[j], seed, crc);
+            unlink(path);
+
+            checked++;
+            failed += (0 != rc);
+            printf("%-20s %10zu  %-6s ", variants[i].name, sizes[j], rc ? "FAIL" : "ok");
+            if (0 == rc && sizes[j] >= params.hw_buff_sz && elapsed > 0) {
+                printf("%10.2f\n", sizes[j] / elapsed / (1024 * 1024));
+            } else {
+                printf("%10s\n", "-");
+            }
+            fflush(stdout);
+        }
+    }
+
+    for (i = 0; i < NREADERS; i++) {
+        if (NULL != only && 0 != strcmp(only, readers[i].name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/qzip_cookie_verify.%d.gz", dir, (int)getpid());
+
+        for (j = 0; j < nsizes; j++) {
+            unsigned long long seed = 1 + j;
+
+            elapsed = write_variant(&readers[i].write, path, sizes[j], seed, &crc);
+            if (elapsed >= 0) {
+                elapsed = verify_read(&readers[i], path, sizes[j], seed, crc);
+            }
+            rc = (elapsed < 0) ? -1 : 0;
+            if (0 == rc && readers[i].seek) {
+                rc = verify_seek(&readers[i], path, sizes[j], seed);
+            }
+            if (0 == rc) {
+                rc = verify_truncated(&readers[i], path);
+            }
+            unlink(path);
+
+            checked++;
+            failed += (0 != rc);
+            printf("%-20s %10zu  %-6s ", readers[i].name, sizes[j], rc ? "FAIL" : "ok");
+            if (0 == rc && sizes[j] >= params.hw_buff_sz && elapsed > 0) {
+                printf("%10.2f\n", sizes[j] / elapsed / (1024 * 1024));
+            } else {
+                printf("%10s\n", "-");
+            }
+            fflush(stdout);
+        }
+    }
+
+    printf("%u of %u checks failed\n", failed, checked);
+    return (0 == failed && checked > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
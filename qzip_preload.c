@@ -0,0 +1,783 @@
+// vim: set sw=4 ts=4 sts=4 et tw=78
+//
+// LD_PRELOAD shim that moves gzip output of unmodified binaries onto the
+// qzip cookies:
+//
+//     LD_PRELOAD=./libqzip_preload.so QZIP_PRELOAD=engine=parallel tool ...
+//
+// gzopen and gzdopen in write or append mode return a handle of ours
+// wrapping a cookie, and every gz* call taking a gzFile recognises it. Calls
+// for reading answer as zlib does for a file opened for writing, and gzseek
+// only moves forward, writing zeros. Reading and transparent ('T') mode go
+// to zlib untouched. With a suffix configured, fopen and fopen64 of matching
+// names for writing return a cookie as well.
+//
+// QZIP_PRELOAD is a comma separated list of
+//     engine=qzip|parallel|gzip|off   cookie to use (default qzip)
+//     level=N                         when the caller doesn't give one
+//     workers=N                       for the parallel engines (default 4)
+//     suffix=.gz                      also intercept fopen of such names
+//     passthrough                     store incompressible chunks, qzip only
+//     stats                           print counters on stderr at exit
+//
+// Calls made by the cookies themselves, such as their own fopen, are
+// passed through by a per-thread guard.
+//
+
+#include "qzip_cookie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#define QP_EXPORT __attribute__((visibility("default")))
+
+enum { ENGINE_QZIP, ENGINE_PARALLEL, ENGINE_GZIP, ENGINE_OFF };
+
+static const char *engine_names[] = { "qzip", "parallel", "gzip", "off" };
+
+static struct {
+    int          engine;
+    int          level;         // 0 keeps the caller's or the library default
+    unsigned int nworkers;
+    char         suffix[32];    // empty to leave fopen alone
+    int          passthrough;
+    int          stats;
+} config = { ENGINE_QZIP, 0, 4, "", 0, 0 };
+
+// \begin real functions
+static struct {
+    gzFile (*gzopen)(const char *, const char *);
+    gzFile (*gzdopen)(int, const char *);
+    int    (*gzwrite)(gzFile, voidpc, unsigned);
+    size_t (*gzfwrite)(voidpc, size_t, size_t, gzFile);
+    int    (*gzputs)(gzFile, const char *);
+    int    (*gzputc)(gzFile, int);
+    int    (*gzvprintf)(gzFile, const char *, va_list);
+    int    (*gzflush)(gzFile, int);
+    z_off_t (*gztell)(gzFile);
+    const char * (*gzerror)(gzFile, int *);
+    int    (*gzbuffer)(gzFile, unsigned);
+    int    (*gzsetparams)(gzFile, int, int);
+    int    (*gzclose)(gzFile);
+    int    (*gzclose_w)(gzFile);
+    int    (*gzread)(gzFile, voidp, unsigned);
+    size_t (*gzfread)(voidp, size_t, size_t, gzFile);
+    char * (*gzgets)(gzFile, char *, int);
+    int    (*gzgetc)(gzFile);
+    int    (*gzgetc_)(gzFile);
+    int    (*gzungetc)(int, gzFile);
+    int    (*gzdirect)(gzFile);
+    int    (*gzeof)(gzFile);
+    z_off_t (*gzseek)(gzFile, z_off_t, int);
+    int    (*gzrewind)(gzFile);
+    z_off_t (*gzoffset)(gzFile);
+    void   (*gzclearerr)(gzFile);
+    int    (*gzclose_r)(gzFile);
+    FILE * (*fopen)(const char *, const char *);
+    FILE * (*fopen64)(const char *, const char *);
+} real;
+
+static pthread_once_t real_once = PTHREAD_ONCE_INIT;
+
+static void
+real_setup(void)
+{
+#define RESOLVE(name) (*(void **)&real.name = dlsym(RTLD_NEXT, #name))
+    RESOLVE(gzopen);
+    RESOLVE(gzdopen);
+    RESOLVE(gzwrite);
+    RESOLVE(gzfwrite);
+    RESOLVE(gzputs);
+    RESOLVE(gzputc);
+    RESOLVE(gzvprintf);
+    RESOLVE(gzflush);
+    RESOLVE(gztell);
+    RESOLVE(gzerror);
+    RESOLVE(gzbuffer);
+    RESOLVE(gzsetparams);
+    RESOLVE(gzclose);
+    RESOLVE(gzclose_w);
+    RESOLVE(gzread);
+    RESOLVE(gzfread);
+    RESOLVE(gzgets);
+    RESOLVE(gzgetc);
+    RESOLVE(gzgetc_);
+    RESOLVE(gzungetc);
+    RESOLVE(gzdirect);
+    RESOLVE(gzeof);
+    RESOLVE(gzseek);
+    RESOLVE(gzrewind);
+    RESOLVE(gzoffset);
+    RESOLVE(gzclearerr);
+    RESOLVE(gzclose_r);
+    RESOLVE(fopen);
+    RESOLVE(fopen64);
+#undef RESOLVE
+}
+
+#define REAL(name) (pthread_once(&real_once, real_setup), real.name)
+// \end real functions
+
+// \begin configuration
+static void
+config_parse(const char *spec)
+{
+    char buf[256], *tok, *save = NULL, *val;
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (NULL != (val = strchr(tok, '='))) {
+            *val++ = '\0';
+        }
+
+        if (0 == strcmp(tok, "engine") && NULL != val) {
+            for (i = ENGINE_OFF; i >= 0 && 0 != strcmp(val, engine_names[i]); i--);
+            if (i < 0) {
+                QC_ERROR("qzip_preload: unknown engine %s\n", val);
+            } else {
+                config.engine = i;
+            }
+        } else if (0 == strcmp(tok, "level") && NULL != val) {
+            config.level = (atoi(val) >= 1 && atoi(val) <= 9) ? atoi(val) : 0;
+        } else if (0 == strcmp(tok, "workers") && NULL != val) {
+            config.nworkers = (atoi(val) > 0) ? atoi(val) : 1;
+        } else if (0 == strcmp(tok, "suffix") && NULL != val) {
+            snprintf(config.suffix, sizeof(config.suffix), "%s", val);
+        } else if (0 == strcmp(tok, "passthrough")) {
+            config.passthrough = 1;
+        } else if (0 == strcmp(tok, "stats")) {
+            config.stats = 1;
+        } else {
+            QC_ERROR("qzip_preload: unknown option %s\n", tok);
+        }
+    }
+}
+
+static void __attribute__((constructor))
+qzip_preload_init(void)
+{
+    const char *spec = getenv("QZIP_PRELOAD");
+
+    if (NULL != spec) {
+        config_parse(spec);
+    }
+}
+
+static void __attribute__((destructor))
+qzip_preload_fini(void)
+{
+    qzip_cookie_stats_t st;
+
+    if (!config.stats || qzip_cookie_get_stats(NULL, &st) != 0) {
+        return;
+    }
+    fprintf(stderr, "qzip_preload: engine %s, %llu bytes in, %llu bytes out, "
+            "%llu requests, p99 %.1f us\n", engine_names[config.engine],
+            st.bytes_in, st.bytes_out, st.requests, st.comp_ns.p99 / 1e3);
+}
+// \end configuration
+
+// \begin handles
+// A gzFile of ours. The public part of zlib's state comes first so that
+// the gzgetc macro, should it be used on a handle, sees an empty buffer and
+// calls the function, which reports an error for a write-only file.
+typedef struct qp_handle_ {
+    struct gzFile_s   gz;
+    FILE              *fp;      // the cookie
+    FILE              *raw;     // under a hook cookie, closed after it
+    z_off_t           pos;      // uncompressed bytes written
+    int               error;
+    struct qp_handle_ *next;
+} qp_handle_t;
+
+static struct {
+    qp_handle_t     *head;
+    pthread_mutex_t lock;
+} handles = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Set while the shim itself is calling into stdio or the cookies
+static __thread int in_shim;
+
+static qp_handle_t *
+qp_find(gzFile file)
+{
+    qp_handle_t *h;
+
+    if (NULL == file) {
+        return NULL;
+    }
+    pthread_mutex_lock(&handles.lock);
+    for (h = handles.head; h != NULL && (gzFile)h != file; h = h->next);
+    pthread_mutex_unlock(&handles.lock);
+
+    return h;
+}
+
+static void
+qp_del(qp_handle_t *target)
+{
+    qp_handle_t **pp;
+
+    pthread_mutex_lock(&handles.lock);
+    for (pp = &handles.head; *pp != NULL; pp = &((*pp)->next)) {
+        if (*pp == target) {
+            *pp = target->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handles.lock);
+}
+
+// Writes and appends, unless transparent or the shim is off. Fills `mode`
+// with what the cookies understand: the first letter and a level digit.
+static int
+qp_wants(const char *zmode, char *mode, size_t size)
+{
+    const char *p;
+    int level = config.level;
+
+    if (ENGINE_OFF == config.engine || in_shim || NULL == zmode ||
+        (zmode[0] != 'w' && zmode[0] != 'a') || NULL != strpbrk(zmode, "+T")) {
+        return 0;
+    }
+
+    for (p = zmode; *p != '\0'; p++) {
+        if (*p >= '1' && *p <= '9') {
+            level = *p - '0';
+        }
+    }
+    if (level > 0) {
+        snprintf(mode, size, "%c%d", zmode[0], level);
+    } else {
+        snprintf(mode, size, "%c", zmode[0]);
+    }
+
+    return 1;
+}
+
+// The file itself is opened here so that failures reach the caller as a
+// NULL return with errno set, like zlib's, rather than tripping the
+// cookies' asserts
+static int
+qp_open_path(const char *path, const char *mode)
+{
+    int flags = O_WRONLY | O_CREAT | ((mode[0] == 'a') ? O_APPEND : O_TRUNC);
+
+    return open(path, flags, 0666);
+}
+
+// Open a cookie on `fd`, or on `path` if given, in which case `fd` was
+// opened on it by `qp_open_path`. fclose of the cookie closes `fd` except
+// for hook cookies, which return the FILE * under them in `raw`. Those sit
+// on a duplicate of `fd`, so that it's still open for zlib if hooking fails.
+static FILE *
+qp_open(const char *path, int fd, const char *mode, FILE **raw)
+{
+    qzip_params_t params;
+    FILE *fp = NULL;
+    int rc, dup_fd;
+
+    *raw = NULL;
+    in_shim++;
+    switch (config.engine) {
+        case ENGINE_QZIP:
+            rc = qzip_params_init(&params);
+            assert(0 == rc);
+            params.passthrough = config.passthrough;
+            if (NULL == (fp = qzip_fdopen_ex(fd, mode, &params)) && NULL != path) {
+                close(fd);
+            }
+            break;
+        case ENGINE_PARALLEL:
+        case ENGINE_GZIP:
+            if (NULL != path) {
+                close(fd);
+                fp = (ENGINE_PARALLEL == config.engine)
+                         ? qzip_parallel_fopen(path, mode, config.nworkers)
+                         : gzip_parallel_fopen(path, mode, config.nworkers);
+                break;
+            }
+            if ((dup_fd = dup(fd)) < 0) {
+                break;
+            }
+            if (NULL == (*raw = fdopen(dup_fd, (mode[0] == 'a') ? "a" : "w"))) {
+                close(dup_fd);
+                break;
+            }
+            fp = (ENGINE_PARALLEL == config.engine)
+                     ? qzip_parallel_hook(*raw, mode, config.nworkers)
+                     : gzip_parallel_hook(*raw, mode, config.nworkers);
+            if (NULL == fp) {
+                fclose(*raw);
+                *raw = NULL;
+            } else {
+                close(fd);
+            }
+            break;
+    }
+    in_shim--;
+
+    return fp;
+}
+
+static gzFile
+qp_handle_new(FILE *fp, FILE *raw)
+{
+    qp_handle_t *h = (qp_handle_t *)calloc(1, sizeof(qp_handle_t));
+    assert(h != NULL);
+
+    h->fp = fp;
+    h->raw = raw;
+
+    pthread_mutex_lock(&handles.lock);
+    h->next = handles.head;
+    handles.head = h;
+    pthread_mutex_unlock(&handles.lock);
+
+    return (gzFile)h;
+}
+
+static int
+qp_write(qp_handle_t *h, const void *buf, size_t len)
+{
+    size_t n;
+
+    if (0 == len) {
+        return 0;
+    }
+    in_shim++;
+    n = fwrite(buf, 1, len, h->fp);
+    in_shim--;
+    if (n != len) {
+        h->error = Z_ERRNO;
+    }
+    h->pos += n;
+
+    return n;
+}
+
+static int
+qp_close(qp_handle_t *h)
+{
+    int rc;
+
+    qp_del(h);
+    in_shim++;
+    rc = fclose(h->fp);
+    if (NULL != h->raw && fclose(h->raw) != 0) {
+        rc = EOF;
+    }
+    in_shim--;
+    free(h);
+
+    return (0 == rc) ? Z_OK : Z_ERRNO;
+}
+// \end handles
+
+// \begin zlib entry points
+QP_EXPORT gzFile
+gzopen(const char *path, const char *zmode)
+{
+    char mode[4];
+    FILE *fp, *raw;
+    int fd;
+
+    if (!qp_wants(zmode, mode, sizeof(mode))) {
+        return REAL(gzopen)(path, zmode);
+    }
+    if ((fd = qp_open_path(path, mode)) < 0) {
+        return NULL;
+    }
+    if (NULL == (fp = qp_open(path, fd, mode, &raw))) {
+        return NULL;
+    }
+
+    return qp_handle_new(fp, raw);
+}
+
+QP_EXPORT gzFile
+gzopen64(const char *path, const char *zmode)
+{
+    return gzopen(path, zmode);
+}
+
+QP_EXPORT gzFile
+gzdopen(int fd, const char *zmode)
+{
+    char mode[4];
+    FILE *fp, *raw;
+
+    if (qp_wants(zmode, mode, sizeof(mode)) && NULL != (fp = qp_open(NULL, fd, mode, &raw))) {
+        return qp_handle_new(fp, raw);
+    }
+
+    return REAL(gzdopen)(fd, zmode);
+}
+
+QP_EXPORT int
+gzwrite(gzFile file, voidpc buf, unsigned len)
+{
+    qp_handle_t *h = qp_find(file);
+
+    if (NULL == h) {
+        return REAL(gzwrite)(file, buf, len);
+    }
+
+    return qp_write(h, buf, len);
+}
+
+QP_EXPORT size_t
+gzfwrite(voidpc buf, size_t size, size_t nitems, gzFile file)
+{
+    qp_handle_t *h = qp_find(file);
+
+    if (NULL == h) {
+        return REAL(gzfwrite)(buf, size, nitems, file);
+    }
+    if (0 == size) {
+        return 0;
+    }
+
+    return qp_write(h, buf, size * nitems) / size;
+}
+
+QP_EXPORT int
+gzputs(gzFile file, const char *s)
+{
+    qp_handle_t *h = qp_find(file);
+    size_t len;
+
+    if (NULL == h) {
+        return REAL(gzputs)(file, s);
+    }
+
+    len = strlen(s);
+    return (qp_write(h, s, len) == (int)len) ? (int)len : -1;
+}
+
+QP_EXPORT int
+gzputc(gzFile file, int c)
+{
+    qp_handle_t *h = qp_find(file);
+    unsigned char ch = c;
+
+    if (NULL == h) {
+        return REAL(gzputc)(file, c);
+    }
+
+    return (qp_write(h, &ch, 1) == 1) ? ch : -1;
+}
+
+QP_EXPORT int
+gzvprintf(gzFile file, const char *format, va_list va)
+{
+    qp_handle_t *h = qp_find(file);
+    char *buf = NULL;
+    int len;
+
+    if (NULL == h) {
+        return REAL(gzvprintf)(file, format, va);
+    }
+
+    if ((len = vasprintf(&buf, format, va)) < 0) {
+        h->error = Z_MEM_ERROR;
+        return Z_MEM_ERROR;
+    }
+    len = (qp_write(h, buf, len) == len) ? len : Z_ERRNO;
+    free(buf);
+
+    return len;
+}
+
+QP_EXPORT int
+gzprintf(gzFile file, const char *format, ...)
+{
+    va_list va;
+    int rc;
+
+    va_start(va, format);
+    rc = gzvprintf(file, format, va);
+    va_end(va);
+
+    return rc;
+}
+
+// Every flush ends the current member, so Z_SYNC_FLUSH and stronger all
+// become `qzip_flush`, falling back to fflush for cookies without one
+QP_EXPORT int
+gzflush(gzFile file, int flush)
+{
+    qp_handle_t *h = qp_find(file);
+    int rc;
+
+    if (NULL == h) {
+        return REAL(gzflush)(file, flush);
+    }
+    if (Z_NO_FLUSH == flush) {
+        return Z_OK;
+    }
+
+    in_shim++;
+    rc = qzip_flush(h->fp);
+    if (0 != rc && EBADF == errno) {
+        rc = fflush(h->fp);
+    }
+    in_shim--;
+    if (0 != rc) {
+        h->error = Z_ERRNO;
+    }
+
+    return (0 == rc) ? Z_OK : Z_ERRNO;
+}
+
+QP_EXPORT z_off_t
+gztell(gzFile file)
+{
+    qp_handle_t *h = qp_find(file);
+
+    return (NULL == h) ? REAL(gztell)(file) : h->pos;
+}
+
+QP_EXPORT const char *
+gzerror(gzFile file, int *errnum)
+{
+    qp_handle_t *h = qp_find(file);
+
+    if (NULL == h) {
+        return REAL(gzerror)(file, errnum);
+    }
+    if (NULL != errnum) {
+        *errnum = h->error;
+    }
+
+    return (Z_OK == h->error) ? "" : strerror(EIO);
+}
+
+// Cookies size their buffers themselves
+QP_EXPORT int
+gzbuffer(gzFile file, unsigned size)
+{
+    return (NULL == qp_find(file)) ? REAL(gzbuffer)(file, size) : 0;
+}
+
+// The level is fixed once a cookie is open
+QP_EXPORT int
+gzsetparams(gzFile file, int level, int strategy)
+{
+    return (NULL == qp_find(file)) ? REAL(gzsetparams)(file, level, strategy) : Z_OK;
+}
+
+QP_EXPORT int
+gzclose(gzFile file)
+{
+    qp_handle_t *h = qp_find(file);
+
+    return (NULL == h) ? REAL(gzclose)(file) : qp_close(h);
+}
+
+QP_EXPORT int
+gzclose_w(gzFile file)
+{
+    qp_handle_t *h = qp_find(file);
+
+    return (NULL == h) ? REAL(gzclose_w)(file) : qp_close(h);
+}
+
+// zlib only seeks forward when writing, by compressing zeros
+QP_EXPORT z_off_t
+gzseek(gzFile file, z_off_t offset, int whence)
+{
+    static const char zeros[4096];
+    qp_handle_t *h = qp_find(file);
+    size_t n;
+
+    if (NULL == h) {
+        return REAL(gzseek)(file, offset, whence);
+    }
+    if (SEEK_SET == whence) {
+        offset -= h->pos;
+    } else if (SEEK_CUR != whence) {
+        return -1;
+    }
+    if (offset < 0 || Z_OK != h->error) {
+        return -1;
+    }
+
+    for (; offset > 0; offset -= n) {
+        n = (offset < (z_off_t)sizeof(zeros)) ? (size_t)offset : sizeof(zeros);
+        if (qp_write(h, zeros, n) != (int)n) {
+            return -1;
+        }
+    }
+
+    return h->pos;
+}
+
+QP_EXPORT z_off_t
+gzseek64(gzFile file, z_off_t offset, int whence)
+{
+    return gzseek(file, offset, whence);
+}
+
+QP_EXPORT z_off_t
+gztell64(gzFile file)
+{
+    return gztell(file);
+}
+
+// Compressed bytes produced so far
+QP_EXPORT z_off_t
+gzoffset(gzFile file)
+{
+    qp_handle_t *h = qp_find(file);
+    qzip_cookie_stats_t st;
+
+    if (NULL == h) {
+        return REAL(gzoffset)(file);
+    }
+
+    return (0 == qzip_cookie_get_stats(h->fp, &st)) ? (z_off_t)st.bytes_out : -1;
+}
+
+QP_EXPORT z_off_t
+gzoffset64(gzFile file)
+{
+    return gzoffset(file);
+}
+
+QP_EXPORT void
+gzclearerr(gzFile file)
+{
+    qp_handle_t *h = qp_find(file);
+
+    if (NULL == h) {
+        REAL(gzclearerr)(file);
+        return;
+    }
+    h->error = Z_OK;
+    clearerr(h->fp);
+}
+
+// Below are the calls for reading, which fail on our handles with the
+// values zlib returns for a file opened for writing
+QP_EXPORT int
+gzread(gzFile file, voidp buf, unsigned len)
+{
+    return (NULL == qp_find(file)) ? REAL(gzread)(file, buf, len) : -1;
+}
+
+QP_EXPORT size_t
+gzfread(voidp buf, size_t size, size_t nitems, gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzfread)(buf, size, nitems, file) : 0;
+}
+
+QP_EXPORT char *
+gzgets(gzFile file, char *buf, int len)
+{
+    return (NULL == qp_find(file)) ? REAL(gzgets)(file, buf, len) : NULL;
+}
+
+// Parenthesised against zlib's gzgetc macro, which calls this once the
+// handle's `have` is 0, as it always is on ours
+QP_EXPORT int
+(gzgetc)(gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzgetc)(file) : -1;
+}
+
+QP_EXPORT int
+gzgetc_(gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzgetc_)(file) : -1;
+}
+
+QP_EXPORT int
+gzungetc(int c, gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzungetc)(c, file) : -1;
+}
+
+QP_EXPORT int
+gzdirect(gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzdirect)(file) : 0;
+}
+
+QP_EXPORT int
+gzeof(gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzeof)(file) : 0;
+}
+
+QP_EXPORT int
+gzrewind(gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzrewind)(file) : -1;
+}
+
+QP_EXPORT int
+gzclose_r(gzFile file)
+{
+    return (NULL == qp_find(file)) ? REAL(gzclose_r)(file) : Z_STREAM_ERROR;
+}
+// \end zlib entry points
+
+// \begin stdio entry points
+static int
+qp_suffixed(const char *path)
+{
+    size_t len = strlen(path), slen = strlen(config.suffix);
+
+    return slen > 0 && len > slen && 0 == strcmp(path + len - slen, config.suffix);
+}
+
+// Returns 1 with `*fp` set, possibly to NULL on failure, if `path` is ours
+static int
+qp_fopen(const char *path, const char *zmode, FILE **fp)
+{
+    char mode[4];
+    FILE *raw;
+    int fd;
+
+    if (NULL == path || !qp_suffixed(path) || !qp_wants(zmode, mode, sizeof(mode))) {
+        return 0;
+    }
+
+    *fp = NULL;
+    if ((fd = qp_open_path(path, mode)) >= 0) {
+        *fp = qp_open(path, fd, mode, &raw);
+    }
+
+    return 1;
+}
+
+QP_EXPORT FILE *
+fopen(const char *path, const char *zmode)
+{
+    FILE *fp;
+
+    return qp_fopen(path, zmode, &fp) ? fp : REAL(fopen)(path, zmode);
+}
+
+QP_EXPORT FILE *
+fopen64(const char *path, const char *zmode)
+{
+    FILE *fp;
+
+    return qp_fopen(path, zmode, &fp) ? fp : REAL(fopen64)(path, zmode);
+}
+// \end stdio entry points
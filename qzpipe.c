@@ -1,61 +1,379 @@
-
 #include "qzip_cookie.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define CHUNK (512*1024*1024)
+// Input is read by a dedicated thread into a small pool of reusable buffers
+// while the main thread compresses the previous ones. With the legacy
+// engine, compressed data is written out by the cookie's own writer thread,
+// so reading, compressing and writing all overlap. Memory use stays at
+// NBUFS * BUFSZ for input however long the stream is.
+#define NBUFS   8
+#define BUFSZ   (1024*1024)
+#define NSLOTS  4
 
-static char buf[CHUNK];
+typedef struct {
+    char            *buf;
+    size_t          len;
+} chunk_t;
 
-static int def_legacy(FILE *fin, FILE *fout)
-{
-    size_t bytes_read = 0;
+typedef struct {
+    chunk_t         chunks[NBUFS];
+    unsigned int    head;       // next chunk to fill
+    unsigned int    tail;       // next chunk to compress
+    unsigned int    count;      // number of filled chunks
+    int             eof;
+    FILE            *fin;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_full;
+    pthread_cond_t  not_empty;
+    pthread_t       reader;
+} pipeline_t;
 
-    FILE *fout_ = qzip_hook(fout, "w");
-    assert(fout_ != NULL);
+static void *reader(void *arg)
+{
+    pipeline_t *pl = (pipeline_t *)arg;
+    chunk_t *chunk;
+    size_t bytes_read;
 
     do {
-        bytes_read = fread(buf, 1, CHUNK, fin);
-        fwrite(buf, 1, bytes_read, fout_);
-    } while (bytes_read == CHUNK);
+        pthread_mutex_lock(&pl->lock);
+        while (pl->count == NBUFS) {
+            pthread_cond_wait(&pl->not_full, &pl->lock);
+        }
+        chunk = &(pl->chunks[pl->head]);
+        pthread_mutex_unlock(&pl->lock);
+
+        bytes_read = fread(chunk->buf, 1, BUFSZ, pl->fin);
+        chunk->len = bytes_read;
+
+        pthread_mutex_lock(&pl->lock);
+        if (bytes_read > 0) {
+            pl->head = (pl->head + 1) % NBUFS;
+            pl->count++;
+        }
+        if (bytes_read < BUFSZ) {
+            pl->eof = 1;
+        }
+        pthread_cond_signal(&pl->not_empty);
+        pthread_mutex_unlock(&pl->lock);
+    } while (bytes_read == BUFSZ);
 
-    return 0;
+    return NULL;
 }
 
-static int def_stream(FILE *fin, FILE *fout)
+// A regular file is mapped and fed to the cookie straight from the page
+// cache, with neither a reader thread nor a copy into the pool. Only the
+// part from the current position `pos` on is fed, as read(2) would.
+static int pump_mmap(int fd, off_t pos, size_t fsize, FILE *fout)
 {
-    size_t bytes_read = 0;
+    off_t start = pos & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    size_t map_len = fsize - start;
+    size_t len = fsize - pos;
+    size_t bytes_to_write, off;
+    int rc = 0;
 
-    FILE *fout_ = qzip_stream_hook(fout, "w");
-    assert(fout_ != NULL);;
+    char *addr = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, start);
+    if (MAP_FAILED == addr) {
+        return -1;
+    }
+    madvise(addr, map_len, MADV_SEQUENTIAL);
 
-    do {
-        bytes_read = fread(buf, 1, CHUNK, fin);
-        fwrite(buf, 1, bytes_read, fout_);
-    } while (bytes_read == CHUNK);
+    char *data = addr + (pos - start);
+    for (off = 0; off < len; off += bytes_to_write) {
+        bytes_to_write = ((len - off) < BUFSZ) ? (len - off) : BUFSZ;
+        if (fwrite(data + off, 1, bytes_to_write, fout) != bytes_to_write) {
+            rc = 1;
+            break;
+        }
+    }
+    if (fclose(fout) != 0) {
+        rc = 1;
+    }
+
+    munmap(addr, map_len);
+    lseek(fd, fsize, SEEK_SET);
 
-    return 0;
+    return rc;
 }
 
-int main(int argc, char **argv)
+// Hand every chunk read from `fin` to `fout`, then close it
+static int pump(FILE *fin, FILE *fout)
 {
-    int rc = 0;
+    pipeline_t pl;
+    struct stat st;
+    off_t pos;
+    int kind, rc = 0;
+    unsigned int i;
 
-    switch (argc) {
-        case 1:
-            rc = def_legacy(stdin, stdout);
-            break;
-        case 2:
-            rc = def_stream(stdin, stdout);
+    if (0 == fstat(fileno(fin), &st) && S_ISREG(st.st_mode) &&
+        (pos = lseek(fileno(fin), 0, SEEK_CUR)) >= 0 && pos < st.st_size &&
+        (rc = pump_mmap(fileno(fin), pos, st.st_size, fout)) >= 0) {
+        return rc;
+    }
+    rc = 0;
+
+    char *pool = (char *)qzip_huge_alloc(NBUFS * BUFSZ, &kind);
+    assert(pool != NULL);
+    QC_DEBUG("Input buffers backed by %s\n", qzip_huge_kind_str(kind));
+
+    for (i = 0; i < NBUFS; i++) {
+        pl.chunks[i].buf = pool + i * BUFSZ;
+        pl.chunks[i].len = 0;
+    }
+    pl.head = pl.tail = pl.count = 0;
+    pl.eof = 0;
+    pl.fin = fin;
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.not_full, NULL);
+    pthread_cond_init(&pl.not_empty, NULL);
+    rc = pthread_create(&pl.reader, NULL, reader, &pl);
+    assert(rc == 0);
+
+    while (1) {
+        pthread_mutex_lock(&pl.lock);
+        while (0 == pl.count && !pl.eof) {
+            pthread_cond_wait(&pl.not_empty, &pl.lock);
+        }
+        if (0 == pl.count) {
+            pthread_mutex_unlock(&pl.lock);
             break;
-        default:
-            printf("Usage: %s [-s] < source > dest\n", argv[0]);
-            exit(EXIT_FAILURE);
+        }
+        chunk_t *chunk = &(pl.chunks[pl.tail]);
+        pthread_mutex_unlock(&pl.lock);
+
+        if (fwrite(chunk->buf, 1, chunk->len, fout) != chunk->len) {
+            rc = 1;
+        }
+
+        // The cookie is done with the chunk once fwrite returns
+        pthread_mutex_lock(&pl.lock);
+        pl.tail = (pl.tail + 1) % NBUFS;
+        pl.count--;
+        pthread_cond_signal(&pl.not_full);
+        pthread_mutex_unlock(&pl.lock);
     }
 
+    pthread_join(pl.reader, NULL);
+    if (ferror(fin)) {
+        rc = 1;
+    }
+    if (fclose(fout) != 0) {
+        rc = 1;
+    }
+
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.not_full);
+    pthread_cond_destroy(&pl.not_empty);
+    qzip_huge_free(pool, NBUFS * BUFSZ, kind);
+
+    return rc;
+}
+
+enum { ENGINE_LEGACY, ENGINE_STREAM, ENGINE_PARALLEL, ENGINE_GZIP };
+
+static const char *engine_names[] = { "legacy", "stream", "parallel", "gzip" };
+
+typedef struct {
+    int             decompress;
+    int             level;      // 0 keeps the library default
+    int             engine;
+    unsigned int    nworkers;
+    int             stats;
+    int             passthrough;
+} options_t;
+
+// Output goes straight to the descriptor under `fout`, and is spliced
+// rather than copied when that is a pipe
+static FILE *open_legacy(FILE *fp, const char *mode, const options_t *opts)
+{
+    qzip_params_t params;
+    int rc = qzip_params_init(&params);
     assert(rc == 0);
 
-    return 0;
+    if (mode[0] == 'r') {
+        return qzip_hook(fp, mode);
+    }
+
+    params.nslots = NSLOTS;
+    params.passthrough = opts->passthrough;
+    if (opts->level > 0) {
+        params.comp_lvl = opts->level;
+    }
+
+    fflush(fp);
+    return qzip_fdopen_ex(fileno(fp), mode, &params);
+}
+
+static FILE *open_engine(FILE *fp, int decompress, const options_t *opts)
+{
+    char mode[4];
+
+    if (decompress) {
+        snprintf(mode, sizeof(mode), "r");
+    } else if (opts->level > 0) {
+        snprintf(mode, sizeof(mode), "w%d", opts->level);
+    } else {
+        snprintf(mode, sizeof(mode), "w");
+    }
+
+    switch (opts->engine) {
+        case ENGINE_STREAM:
+            return qzip_stream_hook(fp, mode);
+        case ENGINE_PARALLEL:
+            return qzip_parallel_hook(fp, mode, opts->nworkers);
+        case ENGINE_GZIP:
+            return gzip_parallel_hook(fp, mode, opts->nworkers);
+        default:
+            return open_legacy(fp, mode, opts);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The cookies count compressed data as bytes_out when writing and as
+// bytes_in when reading, so uncompressed and compressed sides swap with -d
+static void print_stats(const options_t *opts, double elapsed)
+{
+    qzip_cookie_stats_t st;
+    unsigned long long plain, packed, total;
+
+    if (qzip_cookie_get_stats(NULL, &st) != 0) {
+        return;
+    }
+
+    plain  = opts->decompress ? st.bytes_out : st.bytes_in;
+    packed = opts->decompress ? st.bytes_in : st.bytes_out;
+    total  = st.hw_bytes + st.sw_bytes;
+
+    fprintf(stderr, "engine:     %s\n", engine_names[opts->engine]);
+    fprintf(stderr, "bytes in:   %llu\n", st.bytes_in);
+    fprintf(stderr, "bytes out:  %llu\n", st.bytes_out);
+    fprintf(stderr, "ratio:      %.3f\n", packed > 0 ? (double)plain / packed : 0.0);
+    fprintf(stderr, "throughput: %.2f MB/s\n",
+            elapsed > 0 ? plain / elapsed / (1024 * 1024) : 0.0);
+    fprintf(stderr, "hw/sw:      %.1f%% / %.1f%% (estimated)\n",
+            total > 0 ? 100.0 * st.hw_bytes / total : 0.0,
+            total > 0 ? 100.0 * st.sw_bytes / total : 0.0);
+    fprintf(stderr, "stored:     %llu bytes\n", st.stored_bytes);
+    fprintf(stderr, "latency:    p50 %.1f us, p99 %.1f us, p999 %.1f us per request\n",
+            st.comp_ns.p50 / 1e3, st.comp_ns.p99 / 1e3, st.comp_ns.p999 / 1e3);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] < source > dest\n"
+            "  -d, --decompress     decompress instead of compress\n"
+            "  -1 .. -9             compression level\n"
+            "  -e, --engine NAME    legacy (default), stream, parallel, or gzip\n"
+            "                       for zlib on worker threads where QAT is missing\n"
+            "  -s, --stream         same as --engine stream\n"
+            "  -w, --workers N      number of workers for the parallel and gzip engines\n"
+            "      --stats          print statistics on stderr\n"
+            "      --passthrough    store incompressible chunks as-is (legacy engine)\n"
+            "  -h, --help           show this help\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    options_t opts = { 0, 0, ENGINE_LEGACY, 4, 0, 0 };
+    int c, rc = 0;
+    double start;
+
+    static struct option long_options[] = {
+        {"decompress", no_argument,       0, 'd'},
+        {"engine",     required_argument, 0, 'e'},
+        {"stream",     no_argument,       0, 's'},
+        {"workers",    required_argument, 0, 'w'},
+        {"stats",      no_argument,       0, 'S'},
+        {"passthrough", no_argument,      0, 'P'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "de:sw:h123456789",
+                            long_options, NULL)) != -1) {
+        switch (c) {
+            case 'd':
+                opts.decompress = 1;
+                break;
+            case 'e':
+                for (opts.engine = ENGINE_GZIP; opts.engine >= 0; opts.engine--) {
+                    if (0 == strcmp(optarg, engine_names[opts.engine])) {
+                        break;
+                    }
+                }
+                if (opts.engine < 0) {
+                    fprintf(stderr, "Unknown engine: %s\n", optarg);
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                opts.engine = ENGINE_STREAM;
+                break;
+            case 'w':
+                opts.nworkers = atoi(optarg);
+                if (opts.nworkers == 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                opts.stats = 1;
+                break;
+            case 'P':
+                opts.passthrough = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                if (c >= '1' && c <= '9') {
+                    opts.level = c - '0';
+                    break;
+                }
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    start = now();
+    if (opts.decompress) {
+        FILE *fin = open_engine(stdin, 1, &opts);
+        assert(fin != NULL);
+        rc = pump(fin, stdout);
+        if (fclose(fin) != 0) {
+            rc = 1;
+        }
+    } else {
+        FILE *fout = open_engine(stdout, 0, &opts);
+        assert(fout != NULL);
+        rc = pump(stdin, fout);
+    }
+
+    if (opts.stats) {
+        print_stats(&opts, now() - start);
+    }
+
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }